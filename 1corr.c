@@ -1,6 +1,12 @@
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "hmproto.h"
+#include "skiplist.h"
+#include "critnib-part.h"
+#include "async.h"
 
 #define ARRAYSZ(x) (sizeof(x)/sizeof(x[0]))
 
@@ -12,10 +18,18 @@ static uint64_t rnd64()
     return (uint64_t)(uint32_t)(mrand48())<<32 | (uint32_t)(mrand48());
 }
 
+/* for engines that support it, switch to read-only */
+static void freeze(void *c)
+{
+    if (hm_freeze)
+        CHECK(!hm_freeze(c));
+}
+
 static void test_smoke()
 {
     void *c = hm_new();
     hm_insert(c, 123, (void*)456);
+    freeze(c);
     CHECK(hm_get(c, 123) == (void*)456);
     CHECK(hm_get(c, 124) == 0);
     hm_delete(c);
@@ -41,6 +55,7 @@ static void test_1to1000()
     void *c = hm_new();
     for (long i=0; i<1000; i++)
         hm_insert(c, i, (void*)i);
+    freeze(c);
     for (long i=0; i<1000; i++)
         CHECK(hm_get(c, i) == (void*)i);
     hm_delete(c);
@@ -98,10 +113,12 @@ static void test_ffffffff_and_friends()
     void *c = hm_new();
     for (int i=0; i<ARRAYSZ(vals); i++)
         hm_insert(c, vals[i], (void*)~vals[i]);
+    freeze(c);
     for (int i=0; i<ARRAYSZ(vals); i++)
         CHECK(hm_get(c, vals[i]) == (void*)~vals[i]);
-    for (int i=0; i<ARRAYSZ(vals); i++)
-        CHECK(hm_remove(c, vals[i]) == (void*)~vals[i]);
+    if (!(hm_immutable & 1))
+        for (int i=0; i<ARRAYSZ(vals); i++)
+            CHECK(hm_remove(c, vals[i]) == (void*)~vals[i]);
     hm_delete(c);
 }
 
@@ -119,6 +136,39 @@ static void test_insert_delete_random()
     hm_delete(c);
 }
 
+static int grow_done;
+
+static void *grow_get_reader(void *c)
+{
+    while (!__atomic_load_n(&grow_done, __ATOMIC_ACQUIRE))
+        for (long i=1; i<=1000; i++)
+            CHECK(hm_get(c, i) == (void*)i);
+    return 0;
+}
+
+/* gets of keys known to be there, while a writer makes the map grow */
+static void test_grow_get()
+{
+    #define READERS 2
+    for (int round=0; round<4; round++)
+    {
+        void *c = hm_new();
+        for (long i=1; i<=1000; i++)
+            hm_insert(c, i, (void*)i);
+        grow_done=0;
+        pthread_t th[READERS];
+        for (int i=0; i<READERS; i++)
+            CHECK(!pthread_create(&th[i], 0, grow_get_reader, c));
+        for (long i=1001; i<=65536; i++)
+            hm_insert(c, i, (void*)i);
+        __atomic_store_n(&grow_done, 1, __ATOMIC_RELEASE);
+        for (int i=0; i<READERS; i++)
+            CHECK(!pthread_join(th[i], 0));
+        hm_delete(c);
+    }
+    #undef READERS
+}
+
 static void test_le_basic()
 {
     void *c = hm_new();
@@ -133,6 +183,7 @@ static void test_le_basic()
     INS(0x11);
     INS(0x12);
     INS(0x20);
+    freeze(c);
 #define GET_SAME(x) CHECK(hm_get(c, (x)) == (void*)(x))
 #define GET_NULL(x) CHECK(hm_get(c, (x)) == NULL)
     GET_NULL(122);
@@ -195,11 +246,39 @@ static void test_le_brute()
 
 }
 
+static void test_le_frozen_brute()
+{
+    void *c = hm_new();
+    char ws[65536]={0,};
+
+    for (int cnt=0; cnt<16384; cnt++)
+    {
+        int w = mrand48()&0xffff;
+        if (!ws[w])
+            hm_insert(c, expand_bits(w), (void*)expand_bits(w)), ws[w]=1;
+    }
+    freeze(c);
+
+    for (int w=0; w<65536; w++)
+    {
+        int v;
+        for (v=w; v>=0 && !ws[v]; v--)
+            ;
+        uint64_t res = (uint64_t)hm_find_le(c, expand_bits(w));
+        uint64_t exp = (v>=0)?expand_bits(v):0;
+        CHECK(res == exp);
+        CHECK(hm_get(c, expand_bits(w)) == (ws[w]?(void*)expand_bits(w):0));
+    }
+
+    hm_delete(c);
+}
+
 static void test_same_only()
 {
     void *c = hm_new();
     hm_insert(c, 123, (void*)456);
     hm_insert(c, 123, (void*)457);
+    freeze(c);
     CHECK(hm_get(c, 123) == (void*)456);
     CHECK(hm_get(c, 124) == 0);
     hm_delete(c);
@@ -211,12 +290,119 @@ static void test_same_two()
     hm_insert(c, 122, (void*)111);
     hm_insert(c, 123, (void*)456);
     hm_insert(c, 123, (void*)457);
+    freeze(c);
     CHECK(hm_get(c, 122) == (void*)111);
     CHECK(hm_get(c, 123) == (void*)456);
     CHECK(hm_get(c, 124) == 0);
     hm_delete(c);
 }
 
+static void test_ge_brute()
+{
+    void *c = hm_new();
+    char ws[65536]={0,};
+
+    for (int cnt=0; cnt<1024; cnt++)
+    {
+        int w = mrand48()&0xffff;
+        if (ws[w])
+            hm_remove(c, expand_bits(w)), ws[w]=0;
+        else
+            hm_insert(c, expand_bits(w), (void*)expand_bits(w)), ws[w]=1;
+
+        for (int cnt2=0; cnt2<1024; cnt2++)
+        {
+            w = mrand48()&0xffff;
+            int v;
+            for (v=w; v<65536 && !ws[v]; v++)
+                ;
+            uint64_t res = (uint64_t)skiplist_find_ge(c, expand_bits(w));
+            uint64_t exp = (v<65536)?expand_bits(v):0;
+            CHECK(res == exp);
+        }
+    }
+    CHECK(skiplist_find_ge(c, ~0ULL) == 0);
+    hm_insert(c, ~0ULL, (void*)~0ULL);
+    CHECK(skiplist_find_ge(c, ~0ULL) == (void*)~0ULL);
+    CHECK(skiplist_find_ge(c, expand_bits(65535)+1) == (void*)~0ULL);
+
+    hm_delete(c);
+}
+
+static void test_part_bulk()
+{
+    #define MAX 20000
+    static uint64_t key[MAX];
+    static void *value[MAX], *out[MAX];
+    for (int nt=0; nt<=5; nt+=5)
+    {
+        void *c = hm_new();
+        /* half spread over every partition, half dense in the first */
+        for (long i=0; i<MAX; i++)
+            key[i] = (i&1) ? rnd64() : (uint64_t)i*7+1, value[i]=(void*)(i+1);
+        for (long i=0; i<MAX/4; i++)
+            hm_insert(c, key[i], (void*)~i);
+
+        CHECK(critnib_part_insert_bulk(c, key, value, MAX, nt) == MAX-MAX/4);
+        for (long i=0; i<MAX; i++)
+            CHECK(hm_get(c, key[i]) == ((i<MAX/4) ? (void*)~i : value[i]));
+
+        /* every third key, each twice: only the first one removes */
+        long n=0;
+        for (long i=0; i<MAX; i+=3)
+            key[n++] = key[i], key[n++] = key[i];
+        CHECK(critnib_part_remove_bulk(c, key, out, n, nt) == n/2);
+        for (long i=0; i<n; i+=2)
+        {
+            long j = i/2*3;
+            CHECK(out[i] == ((j<MAX/4) ? (void*)~j : value[j]));
+            CHECK(out[i+1] == 0);
+            CHECK(hm_get(c, key[i]) == 0);
+        }
+        CHECK(critnib_part_remove_bulk(c, key, 0, n, nt) == 0);
+        critnib_part_delete_bulk(c, nt);
+    }
+    #undef MAX
+}
+
+static void test_async_queue()
+{
+    #define MAX 4096
+    void *c = hm_new();
+    static void *ws[MAX];
+    memset(ws, 0, sizeof(ws));
+
+    for (int round=0; round<64; round++)
+    {
+        /* more writes than the ring holds, thus producers wait at times */
+        for (int cnt=0; cnt<20000; cnt++)
+        {
+            int w = mrand48()&(MAX-1);
+            void *v = (void*)(uintptr_t)(mrand48()|1);
+            if (mrand48()&1)
+            {
+                async_insert_async(c, w, v);
+                if (!ws[w])
+                    ws[w] = v;
+            }
+            else
+                async_remove_async(c, w), ws[w]=0;
+        }
+        /* sync writes go after everything queued so far */
+        int w = mrand48()&(MAX-1);
+        CHECK(hm_remove(c, w) == ws[w]);
+        CHECK(!hm_insert(c, w, (void*)1));
+        ws[w]=(void*)1;
+        CHECK(hm_insert(c, w, (void*)2) == EEXIST);
+
+        async_flush(c);
+        for (int i=0; i<MAX; i++)
+            CHECK(hm_get(c, i) == ws[i]);
+    }
+    hm_delete(c);
+    #undef MAX
+}
+
 static void run_test(void (*func)(void), const char *name, int req)
 {
     printf("TEST: %s\n", name);
@@ -237,18 +423,42 @@ static void run_test(void (*func)(void), const char *name, int req)
 }
 #define TEST(x,req) do run_test(test_##x, #x, req); while (0)
 
+/* for what only one engine has */
+static void run_test_on(void (*func)(void), const char *name,
+                        const char *engine)
+{
+    printf("TEST: %s\n", name);
+    for (int i=0; i<ARRAYSZ(hms); i++)
+    {
+        hm_select(i);
+        if (strcmp(hm_name, engine))
+            continue;
+        printf(" \e[34m[\e[1m⚒\e[22m]\e[0m: %s\n", hm_name);
+        bad=0;
+        func();
+        if (!bad)
+            printf("\e[F \e[32m[\e[1m✓\e[22m]\e[0m\n");
+    }
+}
+#define TEST_ON(x,engine) do run_test_on(test_##x, #x, engine); while (0)
+
 int main()
 {
     TEST(smoke, 0);
-    TEST(key0, 0);
+    TEST(key0, 1);
     TEST(1to1000, 0);
-    TEST(insert_delete1M, 0);
-    TEST(insert_bulk_delete1M, 0);
+    TEST(insert_delete1M, 1);
+    TEST(insert_bulk_delete1M, 1);
     TEST(ffffffff_and_friends, 0);
-    TEST(insert_delete_random, 0);
+    TEST(insert_delete_random, 1);
+    TEST(grow_get, 1);
     TEST(le_basic, 2);
-    TEST(le_brute, 2);
+    TEST(le_brute, 3);
+    TEST(le_frozen_brute, 2);
     TEST(same_only, 2);
     TEST(same_two, 2);
+    TEST_ON(ge_brute, "skiplist");
+    TEST_ON(part_bulk, "critnib_part");
+    TEST_ON(async_queue, "async");
     return 0;
 }
@@ -0,0 +1,361 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#ifdef __AVX2__
+# include <immintrin.h>
+#endif
+#include "util.h"
+#include "critnib.h"
+
+/*
+ * A map that changes shape with its size: up to one key it's held inline
+ * in the head, up to SMALL keys in a sorted array of one cacheline of keys
+ * (searched in one go, AVX2 if available), past that it's a critnib.  Most
+ * maps hold a handful of entries and pay neither a critnib's nodes and
+ * leaves nor its remove_count; the few big ones cost a critnib plus one
+ * load and branch.
+ *
+ * While small, the head has a version that's odd while a writer changes
+ * the inline key, the array, or the shape.  A reader notes the version,
+ * reads, then checks it again and retries on a mismatch -- like btree's
+ * nodes.  Writes take the head's mutex.
+ *
+ * Growing past SMALL fills a critnib aside, then switches to it for good:
+ * a map that got big once is likely to again, and a shape that can't
+ * change back needs no version check -- readers and writers go straight
+ * to the critnib, its lock-free inserts included.  The array is kept till
+ * the map is deleted, as a reader may still be in it.
+ */
+
+#define FUNC(x) adaptive_##x
+
+#define SMALL 8
+
+enum { ONE, ARRAY, CRITNIB };
+
+struct adaptive_array
+{
+    uint64_t key[SMALL]; /* ~0 past count */
+    void *value[SMALL];
+};
+
+struct adaptive
+{
+    uint64_t volatile version;
+    uint32_t shape;
+    uint32_t count; /* while small */
+    uint64_t only_key;
+    void *only_val;
+    struct adaptive_array *arr;
+    struct critnib *c;
+    pthread_mutex_t mutex;
+};
+
+static inline void write_poke(struct adaptive *restrict t)
+{
+    util_fetch_and_add64(&t->version, 1);
+}
+
+static inline uint64_t read_version(struct adaptive *restrict t)
+{
+    uint64_t v;
+    while (1)
+    {
+        util_atomic_load_explicit64(&t->version, &v, memory_order_acquire);
+        if (!(v & 1))
+            return v;
+        sched_yield();
+    }
+}
+
+static inline int validate(struct adaptive *restrict t, uint64_t v)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return t->version == v;
+}
+
+/* number of keys <= k; the ones past count are ~0 */
+static inline int count_le(const struct adaptive_array *restrict a,
+                           uint32_t count, uint64_t k)
+{
+    int cnt = 0;
+#ifdef __AVX2__
+    const __m256i sign = _mm256_set1_epi64x(1ULL << 63);
+    __m256i kk = _mm256_set1_epi64x(k ^ (1ULL << 63));
+    for (int i=0; i<SMALL; i+=4)
+    {
+        __m256i v = _mm256_xor_si256(
+            _mm256_loadu_si256((const __m256i*)&a->key[i]), sign);
+        cnt += 4 - __builtin_popcount(_mm256_movemask_pd(
+            _mm256_castsi256_pd(_mm256_cmpgt_epi64(v, kk))));
+    }
+#else
+    for (int i=0; i<SMALL; i++)
+        cnt += a->key[i] <= k;
+#endif
+    /* k of ~0 matches the padding; a torn read can give garbage */
+    return (cnt < (int)count) ? cnt : (count < SMALL) ? (int)count : SMALL;
+}
+
+struct adaptive *FUNC(new)(void)
+{
+    struct adaptive *t = Zalloc(sizeof(struct adaptive));
+    if (!t)
+        return 0;
+    pthread_mutex_init(&t->mutex, 0);
+    return t;
+}
+
+void FUNC(delete)(struct adaptive *t)
+{
+    pthread_mutex_destroy(&t->mutex);
+    if (t->c)
+        critnib_delete(t->c);
+    Free(t->arr);
+    Free(t);
+}
+
+/* one key -> array; the array is filled in place, it's not being read */
+static int to_array(struct adaptive *restrict t)
+{
+    if (!t->arr)
+    {
+        if (!(t->arr = Malloc(sizeof(struct adaptive_array))))
+            return ENOMEM;
+        memset(t->arr->key, 0xff, sizeof(t->arr->key));
+    }
+    if (t->count)
+    {
+        t->arr->key[0] = t->only_key;
+        t->arr->value[0] = t->only_val;
+    }
+    t->shape = ARRAY;
+    return 0;
+}
+
+/* full array plus one key -> critnib, filled before anyone can see it */
+static int to_critnib(struct adaptive *restrict t, uint64_t key, void *value)
+{
+    if (!(t->c = critnib_new()))
+        return ENOMEM;
+
+    int ret = critnib_insert(t->c, key, value);
+    for (int i = 0; !ret && i < SMALL; i++)
+        ret = critnib_insert(t->c, t->arr->key[i], t->arr->value[i]);
+    if (ret)
+    {
+        critnib_delete(t->c);
+        t->c = 0;
+        return ret;
+    }
+
+    write_poke(t);
+    __atomic_store_n(&t->shape, CRITNIB, __ATOMIC_RELEASE);
+    write_poke(t);
+    return 0;
+}
+
+static inline int is_big(struct adaptive *restrict t)
+{
+    return __atomic_load_n(&t->shape, __ATOMIC_ACQUIRE) == CRITNIB;
+}
+
+/*
+ * insert -- write a key:value (both non-zero) pair
+ *
+ * Returns:
+ *  • 0 on success
+ *  • EEXIST if such a key already exists
+ *  • ENOMEM if we're out of memory
+ */
+int FUNC(insert)(struct adaptive *t, uint64_t key, void *value)
+{
+    if (is_big(t))
+        return critnib_insert(t->c, key, value);
+
+    int ret = 0;
+    pthread_mutex_lock(&t->mutex);
+
+    if (t->shape == CRITNIB)
+    {
+        pthread_mutex_unlock(&t->mutex);
+        return critnib_insert(t->c, key, value);
+    }
+
+    if (t->shape == ONE)
+    {
+        if (!t->count)
+        {
+            write_poke(t);
+            t->only_key = key;
+            t->only_val = value;
+            t->count = 1;
+            write_poke(t);
+            goto out;
+        }
+        if (t->only_key == key)
+        {
+            ret = EEXIST;
+            goto out;
+        }
+        write_poke(t);
+        ret = to_array(t);
+        write_poke(t);
+        if (ret)
+            goto out;
+    }
+
+    struct adaptive_array *restrict a = t->arr;
+    int i = count_le(a, t->count, key);
+    if (i && a->key[i - 1] == key)
+    {
+        ret = EEXIST;
+        goto out;
+    }
+    if (t->count == SMALL)
+    {
+        ret = to_critnib(t, key, value);
+        goto out;
+    }
+
+    write_poke(t);
+    memmove(&a->key[i + 1], &a->key[i], (t->count - i) * sizeof(uint64_t));
+    memmove(&a->value[i + 1], &a->value[i], (t->count - i) * sizeof(void *));
+    a->key[i] = key;
+    a->value[i] = value;
+    t->count++;
+    write_poke(t);
+
+out:
+    pthread_mutex_unlock(&t->mutex);
+    return ret;
+}
+
+/*
+ * remove -- delete a key from the map, returning its value
+ *
+ * Returns the value, or NULL if not found.
+ */
+void *FUNC(remove)(struct adaptive *t, uint64_t key)
+{
+    if (is_big(t))
+        return critnib_remove(t->c, key);
+
+    void *value = 0;
+    pthread_mutex_lock(&t->mutex);
+
+    if (t->shape == CRITNIB)
+    {
+        pthread_mutex_unlock(&t->mutex);
+        return critnib_remove(t->c, key);
+    }
+
+    if (t->shape == ONE)
+    {
+        if (t->count && t->only_key == key)
+        {
+            value = t->only_val;
+            write_poke(t);
+            t->count = 0;
+            write_poke(t);
+        }
+        goto out;
+    }
+
+    struct adaptive_array *restrict a = t->arr;
+    int i = count_le(a, t->count, key);
+    if (!i || a->key[--i] != key)
+        goto out;
+
+    value = a->value[i];
+    write_poke(t);
+    memmove(&a->key[i], &a->key[i + 1], (t->count - i - 1) * sizeof(uint64_t));
+    memmove(&a->value[i], &a->value[i + 1],
+        (t->count - i - 1) * sizeof(void *));
+    t->count--;
+    a->key[t->count] = ~0ULL;
+    if (t->count == 1)
+    {
+        t->only_key = a->key[0];
+        t->only_val = a->value[0];
+        a->key[0] = ~0ULL;
+        t->shape = ONE;
+    }
+    write_poke(t);
+
+out:
+    pthread_mutex_unlock(&t->mutex);
+    return value;
+}
+
+/*
+ * get -- query for a key
+ *
+ * Lock-free: retries if a writer changed the inline key, the array or the
+ * shape meanwhile.
+ */
+void *FUNC(get)(struct adaptive *t, uint64_t key)
+{
+    if (is_big(t))
+        return critnib_get(t->c, key);
+
+    void *res;
+    uint64_t v;
+    do
+    {
+        v = read_version(t);
+        uint32_t count = t->count;
+        switch (t->shape)
+        {
+        case ONE:
+            res = (count && t->only_key == key) ? t->only_val : 0;
+            break;
+        case ARRAY:
+        {
+            struct adaptive_array *restrict a = t->arr;
+            int i = count_le(a, count, key);
+            res = (i && a->key[i - 1] == key) ? a->value[i - 1] : 0;
+            break;
+        }
+        default:
+            return critnib_get(t->c, key);
+        }
+    } while (!validate(t, v));
+    return res;
+}
+
+/*
+ * find_le -- query for a key, returning the value of the largest one <= it
+ */
+void *FUNC(find_le)(struct adaptive *t, uint64_t key)
+{
+    if (is_big(t))
+        return critnib_find_le(t->c, key);
+
+    void *res;
+    uint64_t v;
+    do
+    {
+        v = read_version(t);
+        uint32_t count = t->count;
+        switch (t->shape)
+        {
+        case ONE:
+            res = (count && t->only_key <= key) ? t->only_val : 0;
+            break;
+        case ARRAY:
+        {
+            struct adaptive_array *restrict a = t->arr;
+            int i = count_le(a, count, key);
+            res = i ? a->value[i - 1] : 0;
+            break;
+        }
+        default:
+            return critnib_find_le(t->c, key);
+        }
+    } while (!validate(t, v));
+    return res;
+}
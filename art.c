@@ -0,0 +1,633 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "util.h"
+
+/*
+ * Adaptive radix tree: 8-bit slices like radix8, but a node comes in four
+ * sizes depending on how many children it has (4, 16, 48 or 256), and
+ * like in critnib a node that'd have only one child is skipped, every node
+ * carrying its path and shift.  With random keys most nodes have two or
+ * three children, and a Node4 is 56 bytes where a critnib node is ~140.
+ *
+ * Readers are lock-free and sync-free just like critnib's.  Node4/16/48
+ * are append-only in place: a new child is written into the next unused
+ * slot before bumping the count (or the index byte), a removed one just has
+ * its pointer cleared -- thus a reader never sees a slot with a key byte
+ * that doesn't belong to it.  A node that's full (of live children or of
+ * holes left by removes) is rebuilt aside, then swapped into its parent.
+ *
+ * Writes take a mutex.  Anything a write unlinks (leaves, outgrown nodes,
+ * collapsed ones) waits DELETED_LIFE further unlinks before being reused,
+ * readers restart if they've seen that many.  Nodes are pooled by size so
+ * a stale pointer always leads to a node of the type it claims to be.
+ */
+
+#define DELETED_LIFE 16
+
+enum { N4, N16, N48, N256 };
+
+struct art_node
+{
+    uint64_t path;
+    uint8_t shift;
+    uint8_t type;
+    uint8_t count; /* slots used so far, N4..N48 */
+    uint16_t live; /* children actually present */
+};
+
+struct art_node4
+{
+    struct art_node h;
+    uint8_t key[4];
+    struct art_node *child[4];
+};
+
+struct art_node16
+{
+    struct art_node h;
+    uint8_t key[16];
+    struct art_node *child[16];
+};
+
+struct art_node48
+{
+    struct art_node h;
+    uint8_t index[256]; /* slot+1, 0 if none */
+    struct art_node *child[48];
+};
+
+struct art_node256
+{
+    struct art_node h;
+    struct art_node *child[256];
+};
+
+struct art_leaf
+{
+    uint64_t key;
+    void *value;
+};
+
+struct art
+{
+    struct art_node *root;
+    struct art_node *deleted_node[4];
+    struct art_leaf *deleted_leaf;
+    struct art_node *pending_del_nodes[DELETED_LIFE];
+    struct art_leaf *pending_del_leaves[DELETED_LIFE];
+    uint64_t remove_count;
+    pthread_mutex_t mutex;
+};
+
+static const size_t node_size[4] =
+{
+    sizeof(struct art_node4),
+    sizeof(struct art_node16),
+    sizeof(struct art_node48),
+    sizeof(struct art_node256),
+};
+
+static const int node_cap[4] = { 4, 16, 48, 256 };
+
+static inline int is_leaf(struct art_node *n)
+{
+    return (uint64_t)n & 1;
+}
+
+static inline struct art_leaf *to_leaf(struct art_node *n)
+{
+    return (void*)((uint64_t)n & ~1ULL);
+}
+
+/* bits of the key that must match the node's path */
+static inline uint64_t above(uint8_t shift)
+{
+    return ~0ULL << shift << 8;
+}
+
+static inline uint8_t sl(uint64_t key, uint8_t shift)
+{
+    return key >> shift;
+}
+
+static inline void *load(void *src)
+{
+    return __atomic_load_n((void**)src, __ATOMIC_ACQUIRE);
+}
+
+static inline void store(void *dst, void *v)
+{
+    __atomic_store_n((void**)dst, v, __ATOMIC_RELEASE);
+}
+
+static inline uint8_t *keys(struct art_node *n)
+{
+    return (n->type == N4) ? ((struct art_node4*)n)->key
+                           : ((struct art_node16*)n)->key;
+}
+
+static inline struct art_node **children(struct art_node *n)
+{
+    switch (n->type)
+    {
+    case N4:
+        return ((struct art_node4*)n)->child;
+    case N16:
+        return ((struct art_node16*)n)->child;
+    case N48:
+        return ((struct art_node48*)n)->child;
+    default:
+        return ((struct art_node256*)n)->child;
+    }
+}
+
+/* the slot holding n's child for byte b, or 0 */
+static inline struct art_node **child_slot(struct art_node *n, uint8_t b)
+{
+    struct art_node **ch = children(n);
+
+    if (n->type <= N16)
+    {
+        uint8_t *k = keys(n);
+        int cnt = __atomic_load_n(&n->count, __ATOMIC_ACQUIRE);
+        for (int i=0; i<cnt; i++)
+            if (k[i] == b && load(&ch[i]))
+                return &ch[i];
+        return 0;
+    }
+    if (n->type == N48)
+    {
+        uint8_t i = __atomic_load_n(&((struct art_node48*)n)->index[b],
+                                    __ATOMIC_ACQUIRE);
+        return i ? &ch[i-1] : 0;
+    }
+    return &ch[b];
+}
+
+static inline struct art_node *get_child(struct art_node *n, uint8_t b)
+{
+    struct art_node **slot = child_slot(n, b);
+    return slot ? load(slot) : 0;
+}
+
+/* the child with the largest byte < b, said byte goes to *nb */
+static struct art_node *prev_child(struct art_node *n, int b, int *nb)
+{
+    struct art_node *res = 0;
+
+    if (n->type <= N16)
+    {
+        struct art_node **ch = children(n);
+        uint8_t *k = keys(n);
+        int cnt = __atomic_load_n(&n->count, __ATOMIC_ACQUIRE);
+        int best = -1;
+        for (int i=0; i<cnt; i++)
+        {
+            struct art_node *m;
+            if (k[i] < b && k[i] > best && (m = load(&ch[i])))
+                best = k[i], res = m;
+        }
+        *nb = best;
+        return res;
+    }
+
+    while (--b >= 0)
+        if ((res = get_child(n, b)))
+            break;
+    *nb = b;
+    return res;
+}
+
+/**************/
+/* allocation */
+/**************/
+
+static struct art_node *alloc_node(struct art *c, int type)
+{
+    struct art_node *n = c->deleted_node[type];
+    if (n)
+        c->deleted_node[type] = *(struct art_node**)n;
+    else if (!(n = Malloc(node_size[type])))
+        return 0;
+    memset(n, 0, node_size[type]);
+    n->type = type;
+    return n;
+}
+
+static void free_node(struct art *c, struct art_node *n)
+{
+    if (!n)
+        return;
+    *(struct art_node**)n = c->deleted_node[n->type];
+    c->deleted_node[n->type] = n;
+}
+
+static struct art_leaf *alloc_leaf(struct art *c)
+{
+    struct art_leaf *k = c->deleted_leaf;
+    if (!k)
+        return Malloc(sizeof(struct art_leaf));
+    c->deleted_leaf = k->value;
+    return k;
+}
+
+static void free_leaf(struct art *c, struct art_leaf *k)
+{
+    if (!k)
+        return;
+    k->value = c->deleted_leaf;
+    c->deleted_leaf = k;
+}
+
+/*
+ * n is an outgrown or collapsed node, k a removed leaf (either may be NULL);
+ * they take the ring slot of whatever this pushes out to the pools.
+ */
+static void retire(struct art *c, struct art_node *n, struct art_leaf *k)
+{
+    uint64_t del = util_fetch_and_add64(&c->remove_count, 1) % DELETED_LIFE;
+    free_node(c, c->pending_del_nodes[del]);
+    free_leaf(c, c->pending_del_leaves[del]);
+    c->pending_del_nodes[del] = n;
+    c->pending_del_leaves[del] = k;
+}
+
+struct art *art_new(void)
+{
+    struct art *c = Zalloc(sizeof(struct art));
+    if (!c)
+        return 0;
+    pthread_mutex_init(&c->mutex, 0);
+    return c;
+}
+
+static void teardown(struct art_node *n)
+{
+    if (is_leaf(n))
+    {
+        Free(to_leaf(n));
+        return;
+    }
+
+    int b = 256;
+    struct art_node *m;
+    while ((m = prev_child(n, b, &b)))
+        teardown(m);
+    Free(n);
+}
+
+void art_delete(struct art *c)
+{
+    if (c->root)
+        teardown(c->root);
+    for (int t=0; t<4; t++)
+        for (struct art_node *n = c->deleted_node[t], *nn; n; n = nn)
+        {
+            nn = *(struct art_node**)n;
+            Free(n);
+        }
+    for (struct art_leaf *k = c->deleted_leaf, *kk; k; k = kk)
+    {
+        kk = k->value;
+        Free(k);
+    }
+    for (int i=0; i<DELETED_LIFE; i++)
+    {
+        Free(c->pending_del_nodes[i]);
+        Free(c->pending_del_leaves[i]);
+    }
+    pthread_mutex_destroy(&c->mutex);
+    Free(c);
+}
+
+/*****************/
+/* node building */
+/*****************/
+
+static inline int type_for(int nchildren)
+{
+    return (nchildren <= 4) ? N4 : (nchildren <= 16) ? N16
+         : (nchildren <= 48) ? N48 : N256;
+}
+
+static inline int has_room(struct art_node *n)
+{
+    return n->type == N256 || n->count < node_cap[n->type];
+}
+
+/* the node must have room; the child becomes visible last */
+static void raw_add(struct art_node *n, uint8_t b, struct art_node *child)
+{
+    struct art_node **ch = children(n);
+    int i = n->count;
+
+    switch (n->type)
+    {
+    case N4:
+    case N16:
+        keys(n)[i] = b;
+        store(&ch[i], child);
+        __atomic_store_n(&n->count, i+1, __ATOMIC_RELEASE);
+        break;
+    case N48:
+        store(&ch[i], child);
+        __atomic_store_n(&((struct art_node48*)n)->index[b], i+1,
+                         __ATOMIC_RELEASE);
+        n->count = i+1;
+        break;
+    default:
+        store(&ch[b], child);
+    }
+    n->live++;
+}
+
+static void raw_del(struct art_node *n, uint8_t b)
+{
+    if (n->type == N48)
+    {
+        struct art_node48 *m = (void*)n;
+        int i = m->index[b];
+        __atomic_store_n(&m->index[b], 0, __ATOMIC_RELEASE);
+        store(&m->child[i-1], NULL);
+    }
+    else
+        store(child_slot(n, b), NULL);
+    n->live--;
+}
+
+/*
+ * A copy of n (without holes) of the given type, plus b:child unless child
+ * is null.  Children of small nodes get sorted on the way.
+ */
+static struct art_node *rebuild(struct art *c, struct art_node *n, int type,
+                                uint8_t b, struct art_node *child)
+{
+    struct art_node *m = alloc_node(c, type);
+    if (!m)
+        return 0;
+    m->path = n->path;
+    m->shift = n->shift;
+
+    int nb = 256;
+    struct art_node *ch[256];
+    uint8_t bs[256];
+    int cnt = 0;
+    for (struct art_node *k; (k = prev_child(n, nb, &nb)); cnt++)
+        bs[cnt] = nb, ch[cnt] = k;
+    int j = cnt - 1;
+    if (child)
+        for (; j >= 0 && bs[j] < b; j--)
+            raw_add(m, bs[j], ch[j]);
+    if (child)
+        raw_add(m, b, child);
+    for (; j >= 0; j--)
+        raw_add(m, bs[j], ch[j]);
+    return m;
+}
+
+/* to be called with the mutex held; slot is where n hangs */
+static int add_child(struct art *c, struct art_node **slot,
+                     struct art_node *n, uint8_t b, struct art_node *child)
+{
+    if (has_room(n))
+    {
+        raw_add(n, b, child);
+        return 0;
+    }
+
+    struct art_node *m = rebuild(c, n, type_for(n->live + 1), b, child);
+    if (!m)
+        return ENOMEM;
+    store(slot, m);
+    retire(c, n, 0);
+    return 0;
+}
+
+/*
+ * art_insert -- write a key:value pair
+ *
+ * Returns 0, EEXIST if the key is already there, or ENOMEM.
+ */
+int art_insert(struct art *c, uint64_t key, void *value)
+{
+    pthread_mutex_lock(&c->mutex);
+
+    struct art_leaf *k = alloc_leaf(c);
+    if (!k)
+    {
+        pthread_mutex_unlock(&c->mutex);
+        return ENOMEM;
+    }
+    k->key = key;
+    k->value = value;
+    struct art_node *kn = (void*)((uint64_t)k | 1);
+
+    struct art_node **slot = &c->root;
+    struct art_node *n = c->root;
+    while (n && !is_leaf(n) && !((key ^ n->path) & above(n->shift)))
+    {
+        struct art_node **s = child_slot(n, sl(key, n->shift));
+        if (!s || !*s)
+        {
+            int ret = add_child(c, slot, n, sl(key, n->shift), kn);
+            if (ret)
+                free_leaf(c, k);
+            pthread_mutex_unlock(&c->mutex);
+            return ret;
+        }
+        slot = s;
+        n = *s;
+    }
+
+    if (!n)
+    {
+        store(slot, kn);
+        pthread_mutex_unlock(&c->mutex);
+        return 0;
+    }
+
+    uint64_t path = is_leaf(n) ? to_leaf(n)->key : n->path;
+    uint64_t at = path ^ key;
+    if (!is_leaf(n))
+        at &= above(n->shift);
+    if (!at)
+    {
+        free_leaf(c, k);
+        pthread_mutex_unlock(&c->mutex);
+        return EEXIST;
+    }
+
+    /* split: a new Node4 above n, built aside */
+    uint8_t sh = util_mssb_index64(at) & ~7;
+    struct art_node *m = alloc_node(c, N4);
+    if (!m)
+    {
+        free_leaf(c, k);
+        pthread_mutex_unlock(&c->mutex);
+        return ENOMEM;
+    }
+    m->shift = sh;
+    m->path = key & above(sh);
+    if (sl(key, sh) < sl(path, sh))
+    {
+        raw_add(m, sl(key, sh), kn);
+        raw_add(m, sl(path, sh), n);
+    }
+    else
+    {
+        raw_add(m, sl(path, sh), n);
+        raw_add(m, sl(key, sh), kn);
+    }
+    store(slot, m);
+
+    pthread_mutex_unlock(&c->mutex);
+    return 0;
+}
+
+/*
+ * art_remove -- delete a key, returning its value or 0
+ */
+void *art_remove(struct art *c, uint64_t key)
+{
+    pthread_mutex_lock(&c->mutex);
+
+    struct art_node **nslot = 0, **slot = &c->root;
+    struct art_node *p = 0, *n = c->root;
+    while (n && !is_leaf(n))
+    {
+        struct art_node **s = child_slot(n, sl(key, n->shift));
+        if (!s)
+        {
+            n = 0;
+            break;
+        }
+        nslot = slot;
+        slot = s;
+        p = n;
+        n = *s;
+    }
+
+    if (!n || to_leaf(n)->key != key)
+    {
+        pthread_mutex_unlock(&c->mutex);
+        return 0;
+    }
+
+    struct art_leaf *k = to_leaf(n);
+    void *value = k->value;
+
+    if (!p)
+    {
+        store(slot, NULL);
+        retire(c, 0, k);
+        pthread_mutex_unlock(&c->mutex);
+        return value;
+    }
+
+    raw_del(p, sl(key, p->shift));
+
+    struct art_node *m = 0;
+    if (p->live == 1)
+    {
+        /* collapse: the only child takes p's place */
+        int b;
+        m = prev_child(p, 256, &b);
+    }
+    else if (p->type != N4 && p->live <= node_cap[p->type - 1] * 3 / 4)
+        m = rebuild(c, p, type_for(p->live), 0, 0);
+
+    if (m)
+    {
+        store(nslot, m);
+        retire(c, p, k);
+    }
+    else
+        retire(c, 0, k);
+
+    pthread_mutex_unlock(&c->mutex);
+    return value;
+}
+
+/*
+ * art_get -- query for a key
+ *
+ * Compares each node's path on the way down; a node it passed may have
+ * been reused only if remove_count moved by DELETED_LIFE, then it restarts.
+ */
+void *art_get(struct art *c, uint64_t key)
+{
+    uint64_t wrs1, wrs2;
+    void *res;
+
+    do
+    {
+        wrs1 = __atomic_load_n(&c->remove_count, __ATOMIC_ACQUIRE);
+        struct art_node *n = load(&c->root);
+        while (n && !is_leaf(n))
+            n = get_child(n, sl(key, n->shift));
+        res = (n && to_leaf(n)->key == key) ? to_leaf(n)->value : 0;
+        wrs2 = __atomic_load_n(&c->remove_count, __ATOMIC_ACQUIRE);
+    } while (wrs1 + DELETED_LIFE <= wrs2);
+
+    return res;
+}
+
+/* rightmost value in a subtree */
+static void *find_max(struct art_node *n)
+{
+    if (is_leaf(n))
+        return to_leaf(n)->value;
+
+    int b = 256;
+    for (struct art_node *m; (m = prev_child(n, b, &b)); )
+    {
+        void *res = find_max(m);
+        if (res)
+            return res;
+    }
+    return 0;
+}
+
+static void *find_le(struct art_node *n, uint64_t key)
+{
+    if (!n)
+        return 0;
+
+    if (is_leaf(n))
+        return (to_leaf(n)->key <= key) ? to_leaf(n)->value : 0;
+
+    /* the path diverges: the whole subtree is either below or above key */
+    if ((key ^ n->path) & above(n->shift))
+        return (n->path < key) ? find_max(n) : 0;
+
+    int b = sl(key, n->shift);
+    void *res = find_le(get_child(n, b), key);
+    if (res)
+        return res;
+
+    for (struct art_node *m; (m = prev_child(n, b, &b)); )
+        if ((res = find_max(m)))
+            return res;
+    return 0;
+}
+
+/*
+ * art_find_le -- the value of the largest key <= the given one
+ */
+void *art_find_le(struct art *c, uint64_t key)
+{
+    uint64_t wrs1, wrs2;
+    void *res;
+
+    do
+    {
+        wrs1 = __atomic_load_n(&c->remove_count, __ATOMIC_ACQUIRE);
+        res = find_le(load(&c->root), key);
+        wrs2 = __atomic_load_n(&c->remove_count, __ATOMIC_ACQUIRE);
+    } while (wrs1 + DELETED_LIFE <= wrs2);
+
+    return res;
+}
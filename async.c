@@ -0,0 +1,289 @@
+#include <errno.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "util.h"
+#include "hmproto.h"
+#include "async.h"
+
+/*
+ * An asynchronous write queue: producers put writes into a bounded MPSC
+ * ring and go on, a single applier thread takes them out in batches,
+ * sorts each batch by key and applies it to the inner engine (a critnib).
+ * Producers thus never touch the inner engine's locks or nodes, and the
+ * applier walks the tree in key order, neighbours sharing the upper nodes
+ * still in cache.
+ *
+ * A producer claims a ring slot with a fetch_add on the tail, waits for
+ * the slot's previous lap to be taken out, fills it and publishes it by
+ * storing its sequence number.  The applier takes out up to BATCH
+ * published slots in order, stopping at the first unpublished one, so a
+ * batch is always a prefix of the queue.  The sort is stable, keeping
+ * writes to the same key in queue order.  Then it bumps `applied`, which
+ * is what async_flush() waits for.
+ *
+ * Reads go straight to the inner engine and see queued writes only once
+ * applied.  The plain hm insert/remove are synchronous: they flush, then
+ * write to the inner engine themselves (next to the applier, as any
+ * engine here takes concurrent writers) and return its result.
+ *
+ * The applier spins (yielding) for a while when the queue runs dry, then
+ * sleeps; producers wake it only when it's asleep, a load otherwise.
+ * Built with a critnib inside as the `async` engine; async_new_of()
+ * (async.h) takes any.
+ */
+
+#define FUNC(x) async_##x
+
+#define ASYNC_INNER "critnib"
+
+#define RING_SIZE (1 << 14)
+#define BATCH 256
+#define IDLE_SPINS 100
+
+enum { OP_INSERT, OP_REMOVE };
+
+struct async_entry
+{
+    uint64_t key;
+    void *value;
+    int op;
+    uint64_t seq; /* i: free for queue position i; i+1: holds it */
+};
+
+struct batch_entry
+{
+    uint64_t key;
+    void *value;
+    int op;
+    int order; /* position in the batch, for a stable sort */
+};
+
+struct async
+{
+    const struct hm *inner;
+    void *map;
+    struct async_entry *ring;
+    pthread_t applier;
+    pthread_mutex_t sleep_lock;
+    pthread_cond_t wake;
+    int stop;
+
+    uint64_t pad1[8];
+    uint64_t tail; /* claimed by producers */
+    uint64_t pad2[7];
+    uint64_t applied; /* written by the applier only */
+    uint64_t pad3[7];
+    uint64_t sleeping;
+    uint64_t pad4[7];
+};
+
+static inline uint64_t load64(uint64_t *x)
+{
+    return __atomic_load_n(x, __ATOMIC_ACQUIRE);
+}
+
+static int cmp_batch(const void *a, const void *b)
+{
+    const struct batch_entry *x = a, *y = b;
+    if (x->key != y->key)
+        return (x->key < y->key) ? -1 : 1;
+    return x->order - y->order;
+}
+
+/* take out up to BATCH published ops from head on, return how many */
+static int take(struct async *a, uint64_t head, struct batch_entry *b)
+{
+    int n;
+    for (n = 0; n < BATCH; n++)
+    {
+        struct async_entry *e = &a->ring[(head + n) % RING_SIZE];
+        if (load64(&e->seq) != head + n + 1)
+            break;
+        b[n].key = e->key;
+        b[n].value = e->value;
+        b[n].op = e->op;
+        b[n].order = n;
+        /* free the slot for the next lap */
+        __atomic_store_n(&e->seq, head + n + RING_SIZE, __ATOMIC_RELEASE);
+    }
+    return n;
+}
+
+static void *applier(void *arg)
+{
+    struct async *a = arg;
+    struct batch_entry b[BATCH];
+    uint64_t head = 0;
+    int idle = 0;
+
+    while (1)
+    {
+        int n = take(a, head, b);
+        if (!n)
+        {
+            if (__atomic_load_n(&a->stop, __ATOMIC_ACQUIRE))
+                return 0;
+            if (++idle < IDLE_SPINS)
+            {
+                sched_yield();
+                continue;
+            }
+
+            /*
+             * Announce we're going to sleep, then look again: a producer
+             * publishes then checks `sleeping`, so one of us sees the other.
+             */
+            pthread_mutex_lock(&a->sleep_lock);
+            __atomic_store_n(&a->sleeping, 1, __ATOMIC_SEQ_CST);
+            struct async_entry *e = &a->ring[head % RING_SIZE];
+            if (__atomic_load_n(&e->seq, __ATOMIC_SEQ_CST) != head + 1 &&
+                !__atomic_load_n(&a->stop, __ATOMIC_SEQ_CST))
+            {
+                pthread_cond_wait(&a->wake, &a->sleep_lock);
+            }
+            __atomic_store_n(&a->sleeping, 0, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&a->sleep_lock);
+            idle = 0;
+            continue;
+        }
+        idle = 0;
+
+        qsort(b, n, sizeof(b[0]), cmp_batch);
+        for (int i = 0; i < n; i++)
+            if (b[i].op == OP_INSERT)
+                a->inner->hm_insert(a->map, b[i].key, b[i].value);
+            else
+                a->inner->hm_remove(a->map, b[i].key);
+
+        head += n;
+        __atomic_store_n(&a->applied, head, __ATOMIC_RELEASE);
+    }
+}
+
+static void wake_applier(struct async *a)
+{
+    pthread_mutex_lock(&a->sleep_lock);
+    pthread_cond_signal(&a->wake);
+    pthread_mutex_unlock(&a->sleep_lock);
+}
+
+struct async *async_new_of(const struct hm *inner)
+{
+    struct async *a = Zalloc(sizeof(struct async));
+    if (!a)
+        return 0;
+    a->inner = inner;
+
+    if (!(a->ring = Malloc(RING_SIZE * sizeof(struct async_entry))))
+        goto fail;
+    for (uint64_t i = 0; i < RING_SIZE; i++)
+        a->ring[i].seq = i;
+    if (!(a->map = inner->hm_new()))
+        goto fail;
+    pthread_mutex_init(&a->sleep_lock, 0);
+    pthread_cond_init(&a->wake, 0);
+    if (pthread_create(&a->applier, 0, applier, a))
+    {
+        pthread_cond_destroy(&a->wake);
+        pthread_mutex_destroy(&a->sleep_lock);
+        inner->hm_delete(a->map);
+        goto fail;
+    }
+    return a;
+
+fail:
+    Free(a->ring);
+    Free(a);
+    return 0;
+}
+
+void *FUNC(new)(void)
+{
+    for (size_t i = 0; i < sizeof(hms) / sizeof(hms[0]); i++)
+        if (hms[i].hm_name && !strcmp(hms[i].hm_name, ASYNC_INNER))
+            return async_new_of(&hms[i]);
+    return 0;
+}
+
+void FUNC(delete)(void *c)
+{
+    struct async *a = c;
+    async_flush(a);
+    __atomic_store_n(&a->stop, 1, __ATOMIC_SEQ_CST);
+    wake_applier(a);
+    pthread_join(a->applier, 0);
+
+    a->inner->hm_delete(a->map);
+    pthread_cond_destroy(&a->wake);
+    pthread_mutex_destroy(&a->sleep_lock);
+    Free(a->ring);
+    Free(a);
+}
+
+static void enqueue(struct async *a, int op, uint64_t key, void *value)
+{
+    uint64_t i = __atomic_fetch_add(&a->tail, 1, __ATOMIC_RELAXED);
+    struct async_entry *e = &a->ring[i % RING_SIZE];
+
+    /* queue full: wait for the applier to take this slot's last lap */
+    while (load64(&e->seq) != i)
+        sched_yield();
+
+    e->key = key;
+    e->value = value;
+    e->op = op;
+    __atomic_store_n(&e->seq, i + 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&a->sleeping, __ATOMIC_SEQ_CST))
+        wake_applier(a);
+}
+
+void async_insert_async(struct async *a, uint64_t key, void *value)
+{
+    enqueue(a, OP_INSERT, key, value);
+}
+
+void async_remove_async(struct async *a, uint64_t key)
+{
+    enqueue(a, OP_REMOVE, key, 0);
+}
+
+void async_flush(struct async *a)
+{
+    uint64_t tail = __atomic_load_n(&a->tail, __ATOMIC_ACQUIRE);
+    while (load64(&a->applied) < tail)
+    {
+        if (__atomic_load_n(&a->sleeping, __ATOMIC_SEQ_CST))
+            wake_applier(a);
+        sched_yield();
+    }
+}
+
+int FUNC(insert)(void *c, uint64_t key, void *value)
+{
+    struct async *a = c;
+    async_flush(a);
+    return a->inner->hm_insert(a->map, key, value);
+}
+
+void *FUNC(remove)(void *c, uint64_t key)
+{
+    struct async *a = c;
+    async_flush(a);
+    return a->inner->hm_remove(a->map, key);
+}
+
+void *FUNC(get)(void *c, uint64_t key)
+{
+    struct async *a = c;
+    return a->inner->hm_get(a->map, key);
+}
+
+void *FUNC(find_le)(void *c, uint64_t key)
+{
+    struct async *a = c;
+    return a->inner->hm_find_le(a->map, key);
+}
@@ -0,0 +1,27 @@
+/*
+ * async.h -- what the async write queue offers beyond HM_PROTOS
+ */
+
+#ifndef ASYNC_H
+#define ASYNC_H 1
+
+#include <stdint.h>
+
+struct hm;
+struct async;
+
+/* a queue in front of inner (an entry of hms[]), with its applier thread */
+struct async *async_new_of(const struct hm *inner);
+
+/*
+ * Queue a write and return at once (waiting only if the queue is full).
+ * It's applied some time later, in order with other writes to the same
+ * key; its result (EEXIST, ENOMEM, the removed value) is lost.
+ */
+void async_insert_async(struct async *a, uint64_t key, void *value);
+void async_remove_async(struct async *a, uint64_t key);
+
+/* wait until every write queued (by any thread) before the call is applied */
+void async_flush(struct async *a);
+
+#endif
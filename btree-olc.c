@@ -0,0 +1,7 @@
+/*
+ * btree-olc.c -- B+tree with optimistic lock coupling for writers too:
+ * per-node version locks instead of a global mutex
+ */
+#define BTREE_OLC
+#define FUNC(x) btree_olc_##x
+#include "btree.c"
@@ -0,0 +1,518 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#ifdef __AVX2__
+# include <immintrin.h>
+#endif
+#include "util.h"
+
+/*
+ * B+tree with optimistic lock coupling for readers.  Keys of a node take
+ * two cachelines and are searched in one go (AVX2 if available, otherwise
+ * a branchless loop gcc vectorizes); unused keys are kept at ~0 so the
+ * search doesn't need to know the count.
+ *
+ * Every node has a version that's odd while a writer is changing it.  A
+ * reader notes the version, reads what it needs, then checks the version
+ * again -- before descending into a child it also reads the child's
+ * version, then revalidates the parent.  Any mismatch restarts from the
+ * root.  Nodes are never freed while the tree lives (removes don't merge)
+ * so whatever a reader gets to is a valid node.
+ *
+ * Writes take a mutex.  A split builds the right half aside, links it into
+ * the parent (splitting that first if needed), and only then truncates the
+ * left half: a reader that got to the old node before sees every key.
+ *
+ * find_le that finds nothing <= key in its leaf (removes leave leaves
+ * sparse, even empty) retries with the leaf's lower bound minus one.
+ *
+ * With BTREE_OLC (btree-olc.c) there's no mutex: the version doubles as a
+ * per-node write lock, taken by bumping it from the even value the writer
+ * descended with to odd -- failing that, the writer restarts just like a
+ * reader would.  A full node is split on the way down (locking it and its
+ * parent, which has room as it'd have been split otherwise), so an insert
+ * needs to lock just the leaf; writers to different leaves don't meet.
+ */
+
+#ifndef FUNC
+# define FUNC(x) btree_##x
+#endif
+
+#define NKEYS 16
+#define MAX_DEPTH 32
+
+struct btree_node
+{
+    uint64_t volatile version;
+    uint32_t count;
+    uint32_t leaf;
+    uint64_t key[NKEYS];
+    void *ptr[NKEYS + 1]; /* values in a leaf, children otherwise */
+};
+
+struct btree
+{
+    struct btree_node *root;
+    pthread_mutex_t mutex;
+};
+
+static inline void write_poke(struct btree_node *restrict n)
+{
+    util_fetch_and_add64(&n->version, 1);
+}
+
+static inline uint64_t read_version(struct btree_node *restrict n)
+{
+    uint64_t v;
+    while (1)
+    {
+        util_atomic_load_explicit64(&n->version, &v, memory_order_acquire);
+        if (!(v & 1))
+            return v;
+        sched_yield();
+    }
+}
+
+static inline int validate(struct btree_node *restrict n, uint64_t v)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return n->version == v;
+}
+
+/* number of keys <= k; the ones past count are ~0 */
+static inline int count_le(const struct btree_node *restrict n, uint64_t k)
+{
+    int cnt = 0;
+#ifdef __AVX2__
+    const __m256i sign = _mm256_set1_epi64x(1ULL << 63);
+    __m256i kk = _mm256_set1_epi64x(k ^ (1ULL << 63));
+    for (int i=0; i<NKEYS; i+=4)
+    {
+        __m256i v = _mm256_xor_si256(
+            _mm256_loadu_si256((const __m256i*)&n->key[i]), sign);
+        cnt += 4 - __builtin_popcount(_mm256_movemask_pd(
+            _mm256_castsi256_pd(_mm256_cmpgt_epi64(v, kk))));
+    }
+#else
+    for (int i=0; i<NKEYS; i++)
+        cnt += n->key[i] <= k;
+#endif
+    /* k of ~0 matches the padding; a torn read can give garbage */
+    int c = n->count;
+    return (cnt < c) ? cnt : (c < NKEYS) ? c : NKEYS;
+}
+
+static struct btree_node *alloc_node(int leaf)
+{
+    struct btree_node *n = Zalloc(sizeof(struct btree_node));
+    if (!n)
+        return 0;
+    memset(n->key, 0xff, sizeof(n->key));
+    n->leaf = leaf;
+    return n;
+}
+
+struct btree *FUNC(new)(void)
+{
+    struct btree *t = Zalloc(sizeof(struct btree));
+    if (!t)
+        return 0;
+    if (!(t->root = alloc_node(1)))
+    {
+        Free(t);
+        return 0;
+    }
+    pthread_mutex_init(&t->mutex, 0);
+    return t;
+}
+
+static void teardown(struct btree_node *n)
+{
+    if (!n->leaf)
+        for (uint32_t i=0; i<=n->count; i++)
+            teardown(n->ptr[i]);
+    Free(n);
+}
+
+void FUNC(delete)(struct btree *t)
+{
+    teardown(t->root);
+    pthread_mutex_destroy(&t->mutex);
+    Free(t);
+}
+
+/* put key:ptr into a node that has room; the caller pokes if needed */
+static void put(struct btree_node *restrict n, uint64_t key, void *ptr)
+{
+    int pos = count_le(n, key);
+    int c = n->count;
+    int inner = !n->leaf;
+    memmove(&n->key[pos+1], &n->key[pos], (c - pos) * sizeof(uint64_t));
+    memmove(&n->ptr[pos+1+inner], &n->ptr[pos+inner],
+            (c - pos) * sizeof(void*));
+    n->key[pos] = key;
+    n->ptr[pos+inner] = ptr;
+    n->count = c + 1;
+}
+
+/* copy the right half of a full node n to r, return the separator */
+static uint64_t copy_right(const struct btree_node *restrict n,
+                           struct btree_node *restrict r)
+{
+    int mid = NKEYS / 2;
+    if (n->leaf)
+    {
+        r->count = NKEYS - mid;
+        memcpy(r->key, &n->key[mid], r->count * sizeof(uint64_t));
+        memcpy(r->ptr, &n->ptr[mid], r->count * sizeof(void*));
+        return r->key[0];
+    }
+
+    /* the middle key moves up */
+    r->count = NKEYS - mid - 1;
+    memcpy(r->key, &n->key[mid+1], r->count * sizeof(uint64_t));
+    memcpy(r->ptr, &n->ptr[mid+1], (r->count + 1) * sizeof(void*));
+    return n->key[mid];
+}
+
+/* drop the right half of a full node, once it's reachable elsewhere */
+static void truncate_left(struct btree_node *n)
+{
+    int mid = NKEYS / 2;
+    n->count = mid;
+    memset(&n->key[mid], 0xff, (NKEYS - mid) * sizeof(uint64_t));
+    memset(&n->ptr[mid + !n->leaf], 0,
+           (NKEYS - mid + n->leaf) * sizeof(void*));
+}
+
+#ifndef BTREE_OLC
+
+/*
+ * n (at path[d]) is full: split it, inserting key:ptr on the proper side.
+ * Nothing is visible to readers before the right half is linked in.
+ */
+static int split(struct btree *t, struct btree_node **path, int d,
+                 struct btree_node *n, uint64_t key, void *ptr)
+{
+    struct btree_node *r = alloc_node(n->leaf);
+    if (!r)
+        return ENOMEM;
+
+    uint64_t sep = copy_right(n, r);
+    if (key >= sep)
+        put(r, key, ptr);
+
+    if (!d)
+    {
+        struct btree_node *root = alloc_node(0);
+        if (!root)
+        {
+            Free(r);
+            return ENOMEM;
+        }
+        root->count = 1;
+        root->key[0] = sep;
+        root->ptr[0] = n;
+        root->ptr[1] = r;
+        __atomic_store_n(&t->root, root, __ATOMIC_RELEASE);
+    }
+    else
+    {
+        struct btree_node *p = path[d-1];
+        if (p->count < NKEYS)
+        {
+            write_poke(p);
+            put(p, sep, r);
+            write_poke(p);
+        }
+        else
+        {
+            int ret = split(t, path, d-1, p, sep, r);
+            if (ret)
+            {
+                Free(r);
+                return ret;
+            }
+        }
+    }
+
+    write_poke(n);
+    truncate_left(n);
+    if (key < sep)
+        put(n, key, ptr);
+    write_poke(n);
+    return 0;
+}
+
+int FUNC(insert)(struct btree *t, uint64_t key, void *value)
+{
+    struct btree_node *path[MAX_DEPTH];
+    int d = 0;
+
+    pthread_mutex_lock(&t->mutex);
+    struct btree_node *n = t->root;
+    while (!n->leaf)
+    {
+        path[d++] = n;
+        n = n->ptr[count_le(n, key)];
+    }
+    path[d] = n;
+
+    int i = count_le(n, key);
+    if (i && n->key[i-1] == key)
+    {
+        pthread_mutex_unlock(&t->mutex);
+        return EEXIST;
+    }
+
+    int ret = 0;
+    if (n->count < NKEYS)
+    {
+        write_poke(n);
+        put(n, key, value);
+        write_poke(n);
+    }
+    else
+        ret = split(t, path, d, n, key, value);
+
+    pthread_mutex_unlock(&t->mutex);
+    return ret;
+}
+
+void *FUNC(remove)(struct btree *t, uint64_t key)
+{
+    void *value = 0;
+
+    pthread_mutex_lock(&t->mutex);
+    struct btree_node *n = t->root;
+    while (!n->leaf)
+        n = n->ptr[count_le(n, key)];
+
+    int i = count_le(n, key);
+    if (i && n->key[i-1] == key)
+    {
+        int c = n->count;
+        value = n->ptr[i-1];
+        write_poke(n);
+        memmove(&n->key[i-1], &n->key[i], (c - i) * sizeof(uint64_t));
+        memmove(&n->ptr[i-1], &n->ptr[i], (c - i) * sizeof(void*));
+        n->key[c-1] = ~0ULL;
+        n->ptr[c-1] = 0;
+        n->count = c - 1;
+        write_poke(n);
+    }
+
+    pthread_mutex_unlock(&t->mutex);
+    return value;
+}
+
+#endif
+
+/*
+ * Descend to the leaf for key with lock coupling; *low gets the leaf's
+ * lower bound (if it has one, otherwise stays untouched).  Returns 0 if
+ * the reader has to restart.
+ */
+static inline struct btree_node *descend(struct btree *t, uint64_t key,
+                                         uint64_t *v, uint64_t *low)
+{
+    struct btree_node *n = __atomic_load_n(&t->root, __ATOMIC_ACQUIRE);
+    *v = read_version(n);
+    /* a root that got replaced might be already truncated */
+    if (__atomic_load_n(&t->root, __ATOMIC_ACQUIRE) != n)
+        return 0;
+
+    while (!n->leaf)
+    {
+        int i = count_le(n, key);
+        if (i && low)
+            *low = n->key[i-1];
+        struct btree_node *c = n->ptr[i];
+        if (!validate(n, *v))
+            return 0;
+        uint64_t vc = read_version(c);
+        if (!validate(n, *v))
+            return 0;
+        n = c;
+        *v = vc;
+    }
+    return n;
+}
+
+void* FUNC(get)(struct btree *t, uint64_t key)
+{
+    struct btree_node *n;
+    uint64_t v;
+    void *res;
+
+    do
+    {
+        if (!(n = descend(t, key, &v, 0)))
+            continue;
+        int i = count_le(n, key);
+        res = (i && n->key[i-1] == key) ? n->ptr[i-1] : 0;
+    } while (!n || !validate(n, v));
+
+    return res;
+}
+
+void* FUNC(find_le)(struct btree *t, uint64_t key)
+{
+    struct btree_node *n;
+    uint64_t v, low;
+    void *res;
+    int i;
+
+    while (1)
+    {
+        low = 0;
+        if (!(n = descend(t, key, &v, &low)))
+            continue;
+        i = count_le(n, key);
+        res = i ? n->ptr[i-1] : 0;
+        if (!validate(n, v))
+            continue;
+        /* the leaf has nothing <= key, try the one to the left */
+        if (!i && low)
+        {
+            key = low - 1;
+            continue;
+        }
+        return res;
+    }
+}
+
+#ifdef BTREE_OLC
+/* lock n if it's still at version v */
+static inline int upgrade(struct btree_node *restrict n, uint64_t v)
+{
+    return util_bool_compare_and_swap64(&n->version, v, v + 1);
+}
+
+static inline void unlock(struct btree_node *restrict n)
+{
+    write_poke(n);
+}
+
+/*
+ * Split a full n whose parent p has room; both are locked (p is NULL if n
+ * is the root).  The right half gets linked in before n is truncated.
+ */
+static int split_locked(struct btree *t, struct btree_node *p,
+                        struct btree_node *n)
+{
+    struct btree_node *r = alloc_node(n->leaf);
+    if (!r)
+        return ENOMEM;
+    uint64_t sep = copy_right(n, r);
+
+    if (!p)
+    {
+        struct btree_node *root = alloc_node(0);
+        if (!root)
+        {
+            Free(r);
+            return ENOMEM;
+        }
+        root->count = 1;
+        root->key[0] = sep;
+        root->ptr[0] = n;
+        root->ptr[1] = r;
+        __atomic_store_n(&t->root, root, __ATOMIC_RELEASE);
+    }
+    else
+        put(p, sep, r);
+
+    truncate_left(n);
+    return 0;
+}
+
+int FUNC(insert)(struct btree *t, uint64_t key, void *value)
+{
+    struct btree_node *p, *n;
+    uint64_t pv, v;
+
+restart:
+    p = 0;
+    pv = 0;
+    n = __atomic_load_n(&t->root, __ATOMIC_ACQUIRE);
+    v = read_version(n);
+    if (__atomic_load_n(&t->root, __ATOMIC_ACQUIRE) != n)
+        goto restart;
+
+    while (1)
+    {
+        /* what we read is good only if the upgrade succeeds */
+        if (n->count == NKEYS)
+        {
+            if (p && !upgrade(p, pv))
+                goto restart;
+            if (!upgrade(n, v))
+            {
+                if (p)
+                    unlock(p);
+                goto restart;
+            }
+            int ret = split_locked(t, p, n);
+            unlock(n);
+            if (p)
+                unlock(p);
+            if (ret)
+                return ret;
+            goto restart;
+        }
+        if (n->leaf)
+            break;
+
+        struct btree_node *c = n->ptr[count_le(n, key)];
+        if (!validate(n, v))
+            goto restart;
+        uint64_t vc = read_version(c);
+        if (!validate(n, v))
+            goto restart;
+        p = n;
+        pv = v;
+        n = c;
+        v = vc;
+    }
+
+    if (!upgrade(n, v))
+        goto restart;
+    int i = count_le(n, key);
+    if (i && n->key[i-1] == key)
+    {
+        unlock(n);
+        return EEXIST;
+    }
+    put(n, key, value);
+    unlock(n);
+    return 0;
+}
+
+void *FUNC(remove)(struct btree *t, uint64_t key)
+{
+    struct btree_node *n;
+    uint64_t v;
+    void *value = 0;
+
+    do
+        n = descend(t, key, &v, 0);
+    while (!n || !upgrade(n, v));
+
+    int i = count_le(n, key);
+    if (i && n->key[i-1] == key)
+    {
+        int c = n->count;
+        value = n->ptr[i-1];
+        memmove(&n->key[i-1], &n->key[i], (c - i) * sizeof(uint64_t));
+        memmove(&n->ptr[i-1], &n->ptr[i], (c - i) * sizeof(void*));
+        n->key[c-1] = ~0ULL;
+        n->ptr[c-1] = 0;
+        n->count = c - 1;
+    }
+    unlock(n);
+    return value;
+}
+#endif
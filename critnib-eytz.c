@@ -0,0 +1,77 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "util.h"
+#include "critnib.h"
+
+/*
+ * critnib_freeze() as an engine: a plain critnib until hm_freeze, after
+ * that reads go to the Eytzinger snapshot and writes are refused.
+ */
+
+struct critnib_eytz
+{
+    struct critnib *c;
+    struct critnib_frozen *f;
+};
+
+struct critnib_eytz *critnib_eytz_new(void)
+{
+    struct critnib_eytz *e = Zalloc(sizeof(struct critnib_eytz));
+    if (!e)
+        return 0;
+    if (!(e->c = critnib_new()))
+    {
+        Free(e);
+        return 0;
+    }
+    return e;
+}
+
+void critnib_eytz_delete(struct critnib_eytz *e)
+{
+    if (e->c)
+        critnib_delete(e->c);
+    if (e->f)
+        critnib_frozen_delete(e->f);
+    Free(e);
+}
+
+int critnib_eytz_freeze(struct critnib_eytz *e)
+{
+    if (e->f)
+        return 0;
+    if (!(e->f = critnib_freeze(e->c)))
+        return ENOMEM;
+    critnib_delete(e->c);
+    e->c = 0;
+    return 0;
+}
+
+int critnib_eytz_insert(struct critnib_eytz *e, uint64_t key, void *value)
+{
+    if (e->f)
+        return EROFS;
+    return critnib_insert(e->c, key, value);
+}
+
+void *critnib_eytz_remove(struct critnib_eytz *e, uint64_t key)
+{
+    if (e->f)
+        return 0;
+    return critnib_remove(e->c, key);
+}
+
+void *critnib_eytz_get(struct critnib_eytz *e, uint64_t key)
+{
+    if (e->f)
+        return critnib_frozen_get(e->f, key);
+    return critnib_get(e->c, key);
+}
+
+void *critnib_eytz_find_le(struct critnib_eytz *e, uint64_t key)
+{
+    if (e->f)
+        return critnib_frozen_find_le(e->f, key);
+    return critnib_find_le(e->c, key);
+}
@@ -0,0 +1,5 @@
+/*
+ * critnib-fc.c -- critnib with flat-combined removes
+ */
+#define CRITNIB_FC
+#include "critnib.c"
@@ -0,0 +1,249 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "util.h"
+#include "critnib.h"
+#include "critnib-part.h"
+
+/*
+ * PARTS independent critnibs, each with its own remove locks, remove_count
+ * and pools: writers to different partitions never meet, nor do readers
+ * retry for removes elsewhere.  A key goes to partition key >> PART_SHIFT,
+ * the keys past the last one to the last -- ranges, not a hash, so the
+ * order across partitions is the partition number and find_le that finds
+ * nothing in its key's partition moves on to the largest key of the ones
+ * below.  The default splits on the top nibble, for keys spread over all
+ * 64 bits; denser keys want PART_SHIFT lowered to where they differ.
+ *
+ * Each get and write costs one shift and compare more than a critnib.
+ * find_le is as linearizable as a critnib's within a partition; across
+ * them, it's the partitions' answers at slightly different times.
+ *
+ * Bulk inserts and removes (critnib-part.h) first bucket the keys by
+ * partition, then hand whole partitions to threads, so threads never
+ * share a partition's lock or cachelines.
+ */
+
+#define FUNC(x) critnib_part_##x
+
+#ifndef PART_BITS
+# define PART_BITS 4
+#endif
+#ifndef PART_SHIFT
+# define PART_SHIFT (64 - PART_BITS)
+#endif
+#define PARTS (1 << PART_BITS)
+
+struct critnib_part
+{
+    struct critnib *part[PARTS];
+};
+
+static inline int part_of(uint64_t key)
+{
+    uint64_t p = key >> PART_SHIFT;
+    return (p < PARTS) ? p : PARTS - 1;
+}
+
+struct critnib_part *FUNC(new)(void)
+{
+    struct critnib_part *c = Zalloc(sizeof(struct critnib_part));
+    if (!c)
+        return 0;
+    for (int p = 0; p < PARTS; p++)
+        if (!(c->part[p] = critnib_new()))
+        {
+            while (p--)
+                critnib_delete(c->part[p]);
+            Free(c);
+            return 0;
+        }
+    return c;
+}
+
+void FUNC(delete)(struct critnib_part *c)
+{
+    for (int p = 0; p < PARTS; p++)
+        critnib_delete(c->part[p]);
+    Free(c);
+}
+
+int FUNC(insert)(struct critnib_part *c, uint64_t key, void *value)
+{
+    return critnib_insert(c->part[part_of(key)], key, value);
+}
+
+void *FUNC(remove)(struct critnib_part *c, uint64_t key)
+{
+    return critnib_remove(c->part[part_of(key)], key);
+}
+
+void *FUNC(get)(struct critnib_part *c, uint64_t key)
+{
+    return critnib_get(c->part[part_of(key)], key);
+}
+
+void *FUNC(find_le)(struct critnib_part *c, uint64_t key)
+{
+    int p = part_of(key);
+    void *res = critnib_find_le(c->part[p], key);
+    while (!res && p--)
+        res = critnib_find_le(c->part[p], ~0ULL);
+    return res;
+}
+
+/********/
+/* bulk */
+/********/
+
+enum { BULK_INSERT, BULK_REMOVE, BULK_DELETE };
+
+struct bulk
+{
+    struct critnib_part *c;
+    int op;
+    int nthreads;
+    const uint64_t *key;
+    void *const *in;
+    void **out;
+    size_t *order; /* indices into key, grouped by partition */
+    size_t start[PARTS + 1];
+};
+
+struct bulk_thread
+{
+    struct bulk *b;
+    int id;
+    size_t done;
+};
+
+static void *bulk_worker(void *arg)
+{
+    struct bulk_thread *t = arg;
+    struct bulk *b = t->b;
+    for (int p = t->id; p < PARTS; p += b->nthreads)
+    {
+        struct critnib *cn = b->c->part[p];
+        if (b->op == BULK_DELETE)
+        {
+            critnib_delete(cn);
+            continue;
+        }
+        for (size_t j = b->start[p]; j < b->start[p + 1]; j++)
+        {
+            size_t i = b->order[j];
+            if (b->op == BULK_INSERT)
+                t->done += !critnib_insert(cn, b->key[i], b->in[i]);
+            else
+            {
+                void *v = critnib_remove(cn, b->key[i]);
+                t->done += !!v;
+                if (b->out)
+                    b->out[i] = v;
+            }
+        }
+    }
+    return 0;
+}
+
+/* run the workers, the calling thread being one of them */
+static size_t bulk_run(struct bulk *b)
+{
+    if (b->nthreads <= 0)
+        b->nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (b->nthreads > PARTS)
+        b->nthreads = PARTS;
+    if (b->nthreads < 1)
+        b->nthreads = 1;
+
+    struct bulk_thread t[PARTS];
+    pthread_t th[PARTS];
+    int started[PARTS] = { 0 };
+    for (int i = 0; i < b->nthreads; i++)
+    {
+        t[i].b = b;
+        t[i].id = i;
+        t[i].done = 0;
+    }
+    for (int i = 1; i < b->nthreads; i++)
+        started[i] = !pthread_create(&th[i], 0, bulk_worker, &t[i]);
+    bulk_worker(&t[0]);
+
+    size_t done = t[0].done;
+    for (int i = 1; i < b->nthreads; i++)
+    {
+        if (started[i])
+            pthread_join(th[i], 0);
+        else
+            bulk_worker(&t[i]); /* couldn't start: do its share here */
+        done += t[i].done;
+    }
+    return done;
+}
+
+/* counting sort of the keys by partition */
+static int bulk_order(struct bulk *b, size_t n)
+{
+    if (!(b->order = Malloc((n + 1) * sizeof(size_t))))
+        return ENOMEM;
+    size_t cnt[PARTS + 1] = { 0 };
+    for (size_t i = 0; i < n; i++)
+        cnt[part_of(b->key[i]) + 1]++;
+    for (int p = 0; p < PARTS; p++)
+        cnt[p + 1] += cnt[p];
+    memcpy(b->start, cnt, sizeof(b->start));
+    for (size_t i = 0; i < n; i++)
+        b->order[cnt[part_of(b->key[i])]++] = i;
+    return 0;
+}
+
+/*
+ * critnib_part_insert_bulk -- insert many keys, in parallel
+ *
+ * Returns the number inserted; 0 with errno set if out of memory before
+ * anything started.
+ */
+size_t critnib_part_insert_bulk(struct critnib_part *c, const uint64_t *key,
+    void *const *value, size_t n, int nthreads)
+{
+    struct bulk b = { .c = c, .op = BULK_INSERT, .nthreads = nthreads,
+        .key = key, .in = value };
+    if (bulk_order(&b, n))
+    {
+        errno = ENOMEM;
+        return 0;
+    }
+    size_t done = bulk_run(&b);
+    Free(b.order);
+    return done;
+}
+
+/*
+ * critnib_part_remove_bulk -- remove many keys, in parallel
+ *
+ * value[i], if value is given, gets what key[i] held or NULL.  Returns the
+ * number removed.
+ */
+size_t critnib_part_remove_bulk(struct critnib_part *c, const uint64_t *key,
+    void **value, size_t n, int nthreads)
+{
+    struct bulk b = { .c = c, .op = BULK_REMOVE, .nthreads = nthreads,
+        .key = key, .out = value };
+    if (bulk_order(&b, n))
+    {
+        errno = ENOMEM;
+        return 0;
+    }
+    size_t done = bulk_run(&b);
+    Free(b.order);
+    return done;
+}
+
+void critnib_part_delete_bulk(struct critnib_part *c, int nthreads)
+{
+    struct bulk b = { .c = c, .op = BULK_DELETE, .nthreads = nthreads };
+    bulk_run(&b);
+    Free(c);
+}
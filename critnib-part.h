@@ -0,0 +1,26 @@
+/*
+ * critnib-part.h -- what the partitioned critnib offers beyond HM_PROTOS
+ */
+
+#ifndef CRITNIB_PART_H
+#define CRITNIB_PART_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct critnib_part;
+
+/*
+ * Bulk operations, spread over nthreads (0: one per CPU) each owning a
+ * share of the partitions.  Return how many keys were inserted (ones
+ * already there are skipped) or removed; value may be NULL for remove.
+ */
+size_t critnib_part_insert_bulk(struct critnib_part *c, const uint64_t *key,
+    void *const *value, size_t n, int nthreads);
+size_t critnib_part_remove_bulk(struct critnib_part *c, const uint64_t *key,
+    void **value, size_t n, int nthreads);
+
+/* critnib_part_delete() with the partitions torn down in parallel */
+void critnib_part_delete_bulk(struct critnib_part *c, int nthreads);
+
+#endif
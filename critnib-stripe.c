@@ -0,0 +1,5 @@
+/*
+ * critnib-stripe.c -- critnib with removes striped by the key's top bits
+ */
+#define CRITNIB_STRIPED
+#include "critnib.c"
@@ -47,7 +47,7 @@
  * Critnib is a hybrid between a radix tree and DJ Bernstein's critbit:
  * it skips nodes for uninteresting radix nodes (ie, ones that would have
  * exactly one child), this requires adding to every node a field that
- * describes the slice (4-bit in our case) that this radix level is for.
+ * describes the slice (4-bit by default) that this radix level is for.
  *
  * This implementation also stores each node's path (ie, bits that are
  * common to every key in that subtree) -- this doesn't help with lookups
@@ -64,20 +64,85 @@
  * notice the data being stale and restart the work.  In usual cases,
  * the structure having been modified does _not_ cause a restart.
  *
- * Writes could be easily made lock-free as well (with only a cmpxchg
- * sync), but this leads to problems with removes.  A possible solution
- * would be doing removes by overwriting by NULL w/o freeing -- yet this
- * would lead to the structure growing without bounds.  Complex per-node
- * locks would increase concurrency but they slow down individual writes
- * enough that in practice a simple global write lock works faster.
+ * Inserts are lock-free as well: they build the new leaf (and node, if
+ * needed) aside, then publish it with a cmpxchg on the parent's slot,
+ * restarting if someone else changed that slot first.  Removes take a
+ * lock, striped by the key's top CRITNIB_STRIPE_BITS (none by default,
+ * 4 for critnib_stripe -- critnib-stripe.c): every node below the
+ * level that splits on those bits holds keys of a single stripe, thus two
+ * removes under different stripes never touch the same node.  Nodes that
+ * don't (the root split, "shared") are written to only with the shared
+ * lock held as well -- a remove whose leaf hangs right off one, or is the
+ * root, takes it.  To keep a concurrent insert from landing in a node
+ * that's being collapsed, a remove first freezes every slot of that node
+ * (sets bit 1 of the pointer); inserts and removes that see a frozen slot
+ * restart, readers just mask the bit away.
+ *
+ * An insert that got stalled must not write into a node that has been
+ * recycled meanwhile: unlike readers, it can't undo its damage afterwards.
+ * Thus nodes past their grace period go to a limbo first, and reach the
+ * free pool only once every insert that started before has finished (two
+ * alternating generations of inserters are counted).  Removes under other
+ * stripes recycle nodes we may walk through, so removes count as inserts
+ * here too; the limbo itself is handled under the shared lock.
  *
  * Removes are the only operation that can break reads.  The structure
  * can do local RCU well -- the problem being knowing when it's safe to
  * free.  Any synchronization with reads would kill their speed, thus
  * instead we have a remove count.  The grace period is DELETED_LIFE,
- * after which any read will notice staleness and restart its work.
+ * after which any read will notice staleness and restart its work.  As
+ * removes under other stripes bump the count meanwhile, a remove does so
+ * only once it has unlinked its node, and notes the value it got.
+ *
+ * FLAT COMBINING
+ *
+ * Built with CRITNIB_FC, there are no stripes: a remove posts its key in
+ * a slot of its own, and whoever gets the shared lock does every posted
+ * remove in one go -- with one remove_count bump and one trip to the
+ * limbo for the lot, and the tree's top still warm from the previous one.
+ * Inserts stay lock-free.
+ */
+
+/*
+ * With CRITNIB_WIDTH defined (see critnib2.c and friends) this file builds
+ * a critnib<width>_* family with that many bits per slice instead, so
+ * different fanouts can be compared without editing anything.  With
+ * CRITNIB_FC (critnib-fc.c) it builds critnib_fc_*, whose removes are
+ * flat-combined, and with CRITNIB_STRIPED (critnib-stripe.c) critnib_stripe_*,
+ * whose removes are striped.
  */
+#if defined(CRITNIB_WIDTH) || defined(CRITNIB_FC) || defined(CRITNIB_STRIPED)
+#ifdef CRITNIB_FC
+#define CRITNIB_NAME(x) critnib_fc_##x
+#elif defined(CRITNIB_STRIPED)
+#define CRITNIB_NAME(x) critnib_stripe_##x
+#else
+#define CRITNIB_NAME_(w, x) critnib##w##_##x
+#define CRITNIB_NAME__(w, x) CRITNIB_NAME_(w, x)
+#define CRITNIB_NAME(x) CRITNIB_NAME__(CRITNIB_WIDTH, x)
+#endif
+#define critnib_new CRITNIB_NAME(new)
+#define critnib_delete CRITNIB_NAME(delete)
+#define critnib_insert CRITNIB_NAME(insert)
+#define critnib_remove CRITNIB_NAME(remove)
+#define critnib_get CRITNIB_NAME(get)
+#define critnib_find_le CRITNIB_NAME(find_le)
+#define critnib_count CRITNIB_NAME(count)
+#define critnib_sorted CRITNIB_NAME(sorted)
+#define critnib_freeze CRITNIB_NAME(freeze)
+#define critnib_frozen_delete CRITNIB_NAME(frozen_delete)
+#define critnib_frozen_get CRITNIB_NAME(frozen_get)
+#define critnib_frozen_find_le CRITNIB_NAME(frozen_find_le)
+#endif
+
+#ifdef CRITNIB_WIDTH
+#define SLICE CRITNIB_WIDTH
+#else
+#define SLICE 4
+#endif
+
 #include <errno.h>
+#include <sched.h>
 #include <stdbool.h>
 
 #include "critnib.h"
@@ -103,7 +168,33 @@
  */
 #define DELETED_LIFE 16
 
-#define SLICE 4
+/*
+ * Removes lock one of 1<<CRITNIB_STRIPE_BITS stripes, picked by the key's
+ * top bits.  Nodes that split on any of those bits are shared.  Each stripe
+ * costs a padded pending ring in the head, and a remove under a shared
+ * node takes two locks instead of one; plain critnib thus has one stripe.
+ *
+ * Flat-combined, there's one stripe and FC_SLOTS slots for posting
+ * removes; a batch is counted as one remove, thus the pending ring must
+ * hold DELETED_LIFE of them.
+ */
+#ifdef CRITNIB_FC
+#undef CRITNIB_STRIPE_BITS
+#define CRITNIB_STRIPE_BITS 0
+#define FC_SLOTS 32
+#define PENDING (DELETED_LIFE * FC_SLOTS)
+#else
+#define PENDING DELETED_LIFE
+#endif
+#if defined(CRITNIB_STRIPED) && !defined(CRITNIB_STRIPE_BITS)
+#define CRITNIB_STRIPE_BITS 4
+#endif
+#ifndef CRITNIB_STRIPE_BITS
+#define CRITNIB_STRIPE_BITS 0
+#endif
+#define STRIPES (1 << CRITNIB_STRIPE_BITS)
+#define STRIPE_SHIFT (64 - CRITNIB_STRIPE_BITS)
+
 #define NIB ((1ULL << SLICE) - 1)
 #define SLNODES (1 << SLICE)
 
@@ -115,7 +206,7 @@ struct critnib_node {
 	 * explicit nodes or collapsed links) -- ie, any subtree below has all
 	 * those bits set to this value.
 	 *
-	 * nib is a 4-bit slice that's an index into the node's children.
+	 * nib is a SLICE-bit slice that's an index into the node's children.
 	 *
 	 * shift is the length (in bits) of the part of the key below this node.
 	 *
@@ -135,20 +226,56 @@ struct critnib_leaf {
 	void *value;
 };
 
+struct critnib_stripe {
+	os_mutex_t mutex;
+
+	/*
+	 * nodes removed but not yet eligible for reuse, a ring from
+	 * pending_tail to pending_head, each with remove_count as it was
+	 * when unlinked
+	 */
+	uint64_t pending_head, pending_tail;
+	struct critnib_node *pending_del_nodes[PENDING];
+	struct critnib_leaf *pending_del_leaves[PENDING];
+	uint64_t pending_count[PENDING];
+} __attribute__((aligned(64)));
+
+#ifdef CRITNIB_FC
+enum { FC_FREE, FC_BUSY, FC_POSTED, FC_DONE };
+
+struct critnib_fc_slot {
+	uint64_t state;
+	uint64_t key;
+	void *value; /* what the remove returns */
+} __attribute__((aligned(64)));
+#endif
+
 struct critnib {
 	struct critnib_node *root;
 
-	/* pool of freed nodes: singly linked list, next at child[0] */
-	struct critnib_node *deleted_node;
-	struct critnib_leaf *deleted_leaf;
+	/*
+	 * pools of freed nodes: lock-free stacks, next at child[0] (leaves:
+	 * at value), an ABA tag in the top 16 bits of the head
+	 */
+	uint64_t deleted_node;
+	uint64_t deleted_leaf;
+
+	/* past grace period, but maybe still seen by a stalled insert */
+	struct critnib_node *limbo_nodes[2];
+	struct critnib_leaf *limbo_leaves[2];
+
+	uint64_t remove_count; /* all removes, what readers check */
 
-	/* nodes removed but not yet eligible for reuse */
-	struct critnib_node *pending_del_nodes[DELETED_LIFE];
-	struct critnib_leaf *pending_del_leaves[DELETED_LIFE];
+	/* insert generation, and number of inserts running in each */
+	uint64_t ins_gen;
+	uint64_t ins_active[2];
 
-	uint64_t remove_count;
+	os_mutex_t shared_mutex; /* removes writing to shared nodes, retire() */
 
-	os_mutex_t mutex; /* writes/removes */
+	struct critnib_stripe stripe[STRIPES];
+#ifdef CRITNIB_FC
+	struct critnib_fc_slot fc[FC_SLOTS];
+#endif
 };
 
 /*
@@ -161,16 +288,6 @@ load(void *src, void *dst)
 		memory_order_acquire);
 }
 
-/*
- * atomic store
- */
-static void
-store(void *dst, void *src)
-{
-	util_atomic_store_explicit64((uint64_t *)dst, (uint64_t)src,
-		memory_order_release);
-}
-
 /*
  * internal: is_leaf -- check tagged pointer for leafness
  */
@@ -199,6 +316,29 @@ path_mask(sh_t shift)
 	return ~NIB << shift;
 }
 
+/*
+ * internal: is_shared -- check whether a node may hold keys of several
+ * stripes
+ */
+static inline bool
+is_shared(struct critnib_node *n)
+{
+	return n->shift + SLICE > STRIPE_SHIFT;
+}
+
+/*
+ * internal: stripe_of -- the stripe whose lock a remove of key takes
+ */
+static inline struct critnib_stripe *
+stripe_of(struct critnib *c, uint64_t key)
+{
+#if CRITNIB_STRIPE_BITS
+	return &c->stripe[key >> STRIPE_SHIFT];
+#else
+	return &c->stripe[0];
+#endif
+}
+
 /*
  * internal: slice_index -- return index of child at the given nib
  */
@@ -208,6 +348,76 @@ slice_index(uint64_t key, sh_t shift)
 	return (key >> shift) & NIB;
 }
 
+/*
+ * internal: is_frozen -- check whether a slot has been frozen by a remove
+ */
+static inline bool
+is_frozen(struct critnib_node *n)
+{
+	return (uint64_t)n & 2;
+}
+
+/*
+ * internal: unfrozen -- strip the frozen bit, as seen by readers
+ */
+static inline struct critnib_node *
+unfrozen(struct critnib_node *n)
+{
+	return (void *)((uint64_t)n & ~2ULL);
+}
+
+/*
+ * internal: cas -- compare and swap a slot
+ */
+static inline bool
+cas(void *slot, void *oldval, void *newval)
+{
+	return util_bool_compare_and_swap64((uint64_t *)slot,
+		(uint64_t)oldval, (uint64_t)newval);
+}
+
+#define POOL_PTR ((1ULL << 48) - 1)
+#define POOL_TAG (1ULL << 48)
+
+/*
+ * internal: pool_push -- put a chain (first..last, linked through *next)
+ * onto a lock-free pool
+ */
+static void
+pool_push(uint64_t *pool, void *first, void **last_next)
+{
+	uint64_t head;
+	do {
+		load(pool, &head);
+		*last_next = (void *)(head & POOL_PTR);
+	} while (!cas(pool, (void *)head,
+		(void *)(((head & ~POOL_PTR) + POOL_TAG) | (uint64_t)first)));
+}
+
+/*
+ * internal: pool_pop -- take an item off a lock-free pool, NULL if empty
+ *
+ * Items are never freed to malloc while the critnib exists, thus reading
+ * *next of an item someone else has just taken is harmless; the tag keeps
+ * our cmpxchg from succeeding then.
+ */
+static void *
+pool_pop(uint64_t *pool, size_t next_offset)
+{
+	uint64_t head;
+	void *item, *next;
+	do {
+		load(pool, &head);
+		item = (void *)(head & POOL_PTR);
+		if (!item)
+			return NULL;
+		load((char *)item + next_offset, &next);
+	} while (!cas(pool, (void *)head,
+		(void *)(((head & ~POOL_PTR) + POOL_TAG) | (uint64_t)next)));
+
+	return item;
+}
+
 /*
  * critnib_new -- allocates a new critnib structure
  */
@@ -218,7 +428,9 @@ critnib_new(void)
 	if (!c)
 		return NULL;
 
-	os_mutex_init(&c->mutex);
+	os_mutex_init(&c->shared_mutex);
+	for (int i = 0; i < STRIPES; i++)
+		os_mutex_init(&c->stripe[i].mutex);
 
 	return c;
 }
@@ -250,30 +462,78 @@ critnib_delete(struct critnib *c)
 	if (c->root)
 		delete_node(c->root);
 
-	os_mutex_destroy(&c->mutex);
+	os_mutex_destroy(&c->shared_mutex);
 
-	for (struct critnib_node *m = c->deleted_node; m; ) {
+	for (struct critnib_node *m = (void *)(c->deleted_node & POOL_PTR);
+			m; ) {
 		struct critnib_node *mm = m->child[0];
 		Free(m);
 		m = mm;
 	}
 
-	for (struct critnib_leaf *k = c->deleted_leaf; k; ) {
+	for (struct critnib_leaf *k = (void *)(c->deleted_leaf & POOL_PTR);
+			k; ) {
 		struct critnib_leaf *kk = k->value;
 		Free(k);
 		k = kk;
 	}
 
-	for (int i = 0; i < DELETED_LIFE; i++) {
-		Free(c->pending_del_nodes[i]);
-		Free(c->pending_del_leaves[i]);
+	for (int i = 0; i < 2; i++) {
+		for (struct critnib_node *m = c->limbo_nodes[i]; m; ) {
+			struct critnib_node *mm = unfrozen(m->child[0]);
+			Free(m);
+			m = mm;
+		}
+
+		for (struct critnib_leaf *k = c->limbo_leaves[i]; k; ) {
+			struct critnib_leaf *kk = k->value;
+			Free(k);
+			k = kk;
+		}
+	}
+
+	for (int i = 0; i < STRIPES; i++) {
+		struct critnib_stripe *s = &c->stripe[i];
+		os_mutex_destroy(&s->mutex);
+		for (uint64_t j = s->pending_tail; j < s->pending_head; j++) {
+			Free(s->pending_del_nodes[j % PENDING]);
+			Free(s->pending_del_leaves[j % PENDING]);
+		}
 	}
 
 	Free(c);
 }
 
 /*
- * internal: free_node -- free (to internal pool, not malloc) a node.
+ * internal: insert_enter -- register a running insert, return its generation
+ */
+static uint64_t
+insert_enter(struct critnib *__restrict c)
+{
+	uint64_t gen, gen2;
+
+	while (1) {
+		load(&c->ins_gen, &gen);
+		util_fetch_and_add64(&c->ins_active[gen & 1], 1);
+		load(&c->ins_gen, &gen2);
+		if (gen == gen2)
+			return gen;
+		util_fetch_and_sub64(&c->ins_active[gen & 1], 1);
+	}
+}
+
+/*
+ * internal: insert_leave -- unregister an insert
+ */
+static void
+insert_leave(struct critnib *__restrict c, uint64_t gen)
+{
+	util_fetch_and_sub64(&c->ins_active[gen & 1], 1);
+}
+
+/*
+ * internal: free_node -- free (to internal pool, not malloc) a node that has
+ * never been published.
  *
  * We cannot free them to malloc as a stalled reader thread may still walk
  * through such nodes; it will notice the result being bogus but only after
@@ -287,8 +547,7 @@ free_node(struct critnib *__restrict c, struct critnib_node *__restrict n)
 		return;
 
 	ASSERT(!is_leaf(n));
-	n->child[0] = c->deleted_node;
-	c->deleted_node = n;
+	pool_push(&c->deleted_node, n, (void **)&n->child[0]);
 }
 
 /*
@@ -297,18 +556,17 @@ free_node(struct critnib *__restrict c, struct critnib_node *__restrict n)
 static struct critnib_node *
 alloc_node(struct critnib *__restrict c)
 {
-	if (!c->deleted_node)
+	struct critnib_node *n = pool_pop(&c->deleted_node,
+		offsetof(struct critnib_node, child[0]));
+	if (!n)
 		return Malloc(sizeof(struct critnib_node));
 
-	struct critnib_node *n = c->deleted_node;
-
-	c->deleted_node = n->child[0];
-
 	return n;
 }
 
 /*
- * internal: free_leaf -- free (to internal pool, not malloc) a leaf.
+ * internal: free_leaf -- free (to internal pool, not malloc) a leaf that has
+ * never been published.
  *
  * See free_node().
  */
@@ -317,8 +575,7 @@ free_leaf(struct critnib *__restrict c, struct critnib_leaf *__restrict k)
 {
 	if (!k)
 		return;
-	k->value = c->deleted_leaf;
-	c->deleted_leaf = k;
+	pool_push(&c->deleted_leaf, k, &k->value);
 }
 
 /*
@@ -327,14 +584,63 @@ free_leaf(struct critnib *__restrict c, struct critnib_leaf *__restrict k)
 static struct critnib_leaf *
 alloc_leaf(struct critnib *__restrict c)
 {
-	if (!c->deleted_leaf)
+	struct critnib_leaf *k = pool_pop(&c->deleted_leaf,
+		offsetof(struct critnib_leaf, value));
+	if (!k)
 		return Malloc(sizeof(struct critnib_leaf));
 
-	struct critnib_leaf *k = c->deleted_leaf;
+	return k;
+}
+
+/*
+ * internal: retire -- pass a node and leaf whose grace period for readers
+ * is over towards the pools
+ *
+ * Called with the shared lock held.  Everything retired while the
+ * generation was N-1 can be reused once no inserts from N-1 are running, as
+ * inserts of N and later started after it became unreachable.
+ */
+static void
+retire(struct critnib *__restrict c, struct critnib_node *__restrict n,
+	struct critnib_leaf *__restrict k)
+{
+	uint64_t gen = c->ins_gen;
+	uint64_t active;
 
-	c->deleted_leaf = k->value;
+	load(&c->ins_active[(gen + 1) & 1], &active);
+	if (!active) {
+		struct critnib_node *m = c->limbo_nodes[(gen + 1) & 1];
+		if (m) {
+			struct critnib_node *last = m;
+			while ((last->child[0] = unfrozen(last->child[0])))
+				last = last->child[0];
+			pool_push(&c->deleted_node, m, (void **)&last->child[0]);
+		}
 
-	return k;
+		struct critnib_leaf *l = c->limbo_leaves[(gen + 1) & 1];
+		if (l) {
+			struct critnib_leaf *last = l;
+			while (last->value)
+				last = last->value;
+			pool_push(&c->deleted_leaf, l, &last->value);
+		}
+
+		c->limbo_nodes[(gen + 1) & 1] = NULL;
+		c->limbo_leaves[(gen + 1) & 1] = NULL;
+		util_fetch_and_add64(&c->ins_gen, 1);
+		gen++;
+	}
+
+	if (n) {
+		/* keep it frozen, a stalled insert may still look there */
+		n->child[0] = (void *)((uint64_t)c->limbo_nodes[gen & 1] | 2);
+		c->limbo_nodes[gen & 1] = n;
+	}
+
+	if (k) {
+		k->value = c->limbo_leaves[gen & 1];
+		c->limbo_leaves[gen & 1] = k;
+	}
 }
 
 /*
@@ -345,16 +651,16 @@ alloc_leaf(struct critnib *__restrict c)
  *  • EEXIST if such a key already exists
  *  • ENOMEM if we're out of memory
  *
- * Takes a global write lock but doesn't stall any readers.
+ * Lock-free, doesn't stall any readers.
  */
 int
 critnib_insert(struct critnib *c, uint64_t key, void *value)
 {
-	os_mutex_lock(&c->mutex);
+	uint64_t gen = insert_enter(c);
 
 	struct critnib_leaf *k = alloc_leaf(c);
 	if (!k) {
-		os_mutex_unlock(&c->mutex);
+		insert_leave(c, gen);
 
 		return ENOMEM;
 	}
@@ -363,30 +669,29 @@ critnib_insert(struct critnib *c, uint64_t key, void *value)
 	k->value = value;
 
 	struct critnib_node *kn = (void *)((uint64_t)k | 1);
+	struct critnib_node *m = NULL;
 
-	struct critnib_node *n = c->root;
-	if (!n) {
-		c->root = kn;
-
-		os_mutex_unlock(&c->mutex);
-
-		return 0;
-	}
-
+retry:;
 	struct critnib_node **parent = &c->root;
-	struct critnib_node *prev = c->root;
+	struct critnib_node *n;
+	load(parent, &n);
 
 	while (n && !is_leaf(n) && (key & path_mask(n->shift)) == n->path) {
-		prev = n;
 		parent = &n->child[slice_index(key, n->shift)];
-		n = *parent;
+		load(parent, &n);
+		if (is_frozen(n)) {
+			/* a remove is collapsing this node, wait for it */
+			sched_yield();
+			goto retry;
+		}
 	}
 
 	if (!n) {
-		n = prev;
-		store(&n->child[slice_index(key, n->shift)], kn);
+		if (!cas(parent, NULL, kn))
+			goto retry;
 
-		os_mutex_unlock(&c->mutex);
+		free_node(c, m);
+		insert_leave(c, gen);
 
 		return 0;
 	}
@@ -396,22 +701,23 @@ critnib_insert(struct critnib *c, uint64_t key, void *value)
 	uint64_t at = path ^ key;
 	if (!at) {
 		ASSERT(is_leaf(n));
-		free_leaf(c, to_leaf(kn));
+		free_leaf(c, k);
+		free_node(c, m);
 		/* fail instead of replacing */
 
-		os_mutex_unlock(&c->mutex);
+		insert_leave(c, gen);
 
 		return EEXIST;
 	}
 
 	/* and convert that to an index. */
-	sh_t sh = util_mssb_index64(at) & (sh_t)~(SLICE - 1);
+	sh_t sh = util_mssb_index64(at);
+	sh -= sh % SLICE;
 
-	struct critnib_node *m = alloc_node(c);
-	if (!m) {
-		free_leaf(c, to_leaf(kn));
+	if (!m && !(m = alloc_node(c))) {
+		free_leaf(c, k);
 
-		os_mutex_unlock(&c->mutex);
+		insert_leave(c, gen);
 
 		return ENOMEM;
 	}
@@ -423,108 +729,330 @@ critnib_insert(struct critnib *c, uint64_t key, void *value)
 	m->child[slice_index(path, sh)] = n;
 	m->shift = sh;
 	m->path = key & path_mask(sh);
-	store(parent, m);
+	if (!cas(parent, n, m))
+		goto retry;
 
-	os_mutex_unlock(&c->mutex);
+	insert_leave(c, gen);
 
 	return 0;
 }
 
 /*
- * critnib_remove -- delete a key from the critnib structure, return its value
+ * internal: collapse -- unlink node n, which has only one child left
+ *
+ * Every slot of n gets frozen first, so no insert can sneak in.  Returns
+ * false if an insert did so before we managed that; n then keeps living.
  */
-void *
-critnib_remove(struct critnib *c, uint64_t key)
+static bool
+collapse(struct critnib *__restrict c, struct critnib_node *__restrict n,
+	uint64_t key)
 {
-	os_mutex_lock(&c->mutex);
+	int ochild = -1;
+	int nchild = 0;
 
-	struct critnib_node *n = c->root;
-	if (!n) {
-		os_mutex_unlock(&c->mutex);
+	/* inserts only ever add children, no need to freeze if we have two */
+	for (int i = 0; i < SLNODES; i++) {
+		struct critnib_node *m;
+		load(&n->child[i], &m);
+		if (m && ++nchild > 1)
+			return false;
+	}
 
-		return NULL;
+	nchild = 0;
+	for (int i = 0; i < SLNODES; i++) {
+		if (cas(&n->child[i], NULL, (void *)2ULL))
+			continue;
+		ochild = i;
+		nchild++;
 	}
 
-	uint64_t del = util_fetch_and_add64(&c->remove_count, 1) % DELETED_LIFE;
-	free_node(c, c->pending_del_nodes[del]);
-	free_leaf(c, c->pending_del_leaves[del]);
-	c->pending_del_nodes[del] = NULL;
-	c->pending_del_leaves[del] = NULL;
+	if (nchild != 1) {
+		for (int i = 0; i < SLNODES; i++)
+			cas(&n->child[i], (void *)2ULL, NULL);
 
-	if (is_leaf(n)) {
-		struct critnib_leaf *k = to_leaf(n);
-		if (k->key == key) {
-			store(&c->root, NULL);
-			void *value = k->value;
-			c->pending_del_leaves[del] = k;
+		return false;
+	}
 
-			os_mutex_unlock(&c->mutex);
+	struct critnib_node *m;
+	do {
+		load(&n->child[ochild], &m);
+	} while (!cas(&n->child[ochild], m, (void *)((uint64_t)m | 2)));
 
-			return value;
+	/*
+	 * An insert might have put a new node above n meanwhile, or a remove
+	 * under another stripe collapsed a shared node above; if so, find n's
+	 * new parent.  A frozen slot on the way means such a collapse is
+	 * still going on, wait for it.  Nothing but us can unlink n.
+	 */
+	struct critnib_node **parent;
+	do {
+		struct critnib_node *p;
+		parent = &c->root;
+		while (load(parent, &p), p != n) {
+			if (is_frozen(p)) {
+				sched_yield();
+				parent = &c->root;
+				continue;
+			}
+			parent = &p->child[slice_index(key, p->shift)];
 		}
+	} while (!cas(parent, n, m));
 
-		os_mutex_unlock(&c->mutex);
+	return true;
+}
+
+/*
+ * internal: pend -- count removes that unlinked nr leaves k[] and nodes n[]
+ * (NULL if none), retire what in the stripe is past its grace period, and
+ * hold the new ones for theirs
+ *
+ * Called with the stripe lock held, and the shared one if so.  Every
+ * remove (or batch of them) bumps remove_count after its unlinks, thus the
+ * ring never holds more than DELETED_LIFE removes' worth.
+ */
+static void
+pend(struct critnib *__restrict c, struct critnib_stripe *__restrict s,
+	struct critnib_node **n, struct critnib_leaf **k, int nr, bool shared)
+{
+	uint64_t cnt = util_fetch_and_add64(&c->remove_count, 1);
+
+	uint64_t t = s->pending_tail;
+	if (t < s->pending_head &&
+			s->pending_count[t % PENDING] + DELETED_LIFE <= cnt + 1) {
+		if (!shared)
+			os_mutex_lock(&c->shared_mutex);
+		do {
+			retire(c, s->pending_del_nodes[t % PENDING],
+				s->pending_del_leaves[t % PENDING]);
+			t++;
+		} while (t < s->pending_head && s->pending_count[t % PENDING]
+			+ DELETED_LIFE <= cnt + 1);
+		if (!shared)
+			os_mutex_unlock(&c->shared_mutex);
+		s->pending_tail = t;
+	}
+
+	for (int i = 0; i < nr; i++) {
+		uint64_t h = s->pending_head++ % PENDING;
+		s->pending_del_nodes[h] = n[i];
+		s->pending_del_leaves[h] = k[i];
+		s->pending_count[h] = cnt;
+	}
+}
+
+/*
+ * internal: unlink_key -- take the key's leaf out of the tree, and its
+ * parent (*dead, else NULL) too if that's left with one child
+ *
+ * Returns the leaf, NULL if there's none -- or if it hangs off a shared
+ * node or is the root while we don't hold the shared lock, then sets
+ * *need_shared.
+ */
+static struct critnib_leaf *
+unlink_key(struct critnib *__restrict c, uint64_t key, bool shared,
+	bool *need_shared, struct critnib_node **dead)
+{
+	*dead = NULL;
 
+retry:;
+	struct critnib_node *n;
+	load(&c->root, &n);
+	if (!n)
 		return NULL;
+
+	if (is_leaf(n)) {
+		struct critnib_leaf *k = to_leaf(n);
+		if (k->key != key)
+			return NULL;
+
+		if (!shared) {
+			*need_shared = true;
+			return NULL;
+		}
+
+		if (!cas(&c->root, n, NULL))
+			goto retry;
+
+		return k;
 	}
 	/*
 	 * n and k are a parent:child pair (after the first iteration); k is the
 	 * leaf that holds the key we're deleting.
 	 */
 	struct critnib_node **k_parent = &c->root;
-	struct critnib_node **n_parent = &c->root;
 	struct critnib_node *kn = n;
 
 	while (!is_leaf(kn)) {
-		n_parent = k_parent;
 		n = kn;
 		k_parent = &kn->child[slice_index(key, kn->shift)];
-		kn = *k_parent;
-
-		if (!kn) {
-			os_mutex_unlock(&c->mutex);
+		load(k_parent, &kn);
+		if (is_frozen(kn)) {
+			/* a shared node is being collapsed (or we're in a dead one) */
+			sched_yield();
+			goto retry;
+		}
 
+		if (!kn)
 			return NULL;
-		}
 	}
 
 	struct critnib_leaf *k = to_leaf(kn);
-	if (k->key != key) {
-		os_mutex_unlock(&c->mutex);
+	if (k->key != key)
+		return NULL;
 
+	if (is_shared(n) && !shared) {
+		*need_shared = true;
 		return NULL;
 	}
 
-	store(&n->child[slice_index(key, n->shift)], NULL);
+	/* an insert may have just split our leaf off */
+	if (!cas(k_parent, kn, NULL))
+		goto retry;
 
 	/* Remove the node if there's only one remaining child. */
-	int ochild = -1;
-	for (int i = 0; i < SLNODES; i++) {
-		if (n->child[i]) {
-			if (ochild != -1) {
-				void *value = k->value;
-				c->pending_del_leaves[del] = k;
+	if (collapse(c, n, key))
+		*dead = n;
 
-				os_mutex_unlock(&c->mutex);
+	return k;
+}
 
-				return value;
-			}
+#ifndef CRITNIB_FC
+/*
+ * critnib_remove -- delete a key from the critnib structure, return its value
+ *
+ * Takes the key's stripe lock, plus the shared one if the leaf hangs off a
+ * shared node.
+ */
+void *
+critnib_remove(struct critnib *c, uint64_t key)
+{
+	struct critnib_stripe *s = stripe_of(c, key);
+	bool shared = false;
+	bool need_shared = false;
+	struct critnib_node *n;
+
+	os_mutex_lock(&s->mutex);
+	uint64_t gen = insert_enter(c);
+
+	struct critnib_leaf *k = unlink_key(c, key, false, &need_shared, &n);
+	if (need_shared) {
+		os_mutex_lock(&c->shared_mutex);
+		shared = true;
+		k = unlink_key(c, key, true, &need_shared, &n);
+	}
 
-			ochild = i;
-		}
+	void *value = NULL;
+	if (k) {
+		value = k->value;
+		pend(c, s, &n, &k, 1, shared);
 	}
 
-	ASSERTne(ochild, -1);
+	insert_leave(c, gen);
+	if (shared)
+		os_mutex_unlock(&c->shared_mutex);
+	os_mutex_unlock(&s->mutex);
+
+	return value;
+}
+#else
+/* which slot a thread tries first */
+static __thread unsigned fc_self = -1U;
+static unsigned fc_threads;
+
+/*
+ * internal: fc_claim -- take a free slot, preferably our own
+ */
+static struct critnib_fc_slot *
+fc_claim(struct critnib *__restrict c)
+{
+	if (fc_self == -1U)
+		fc_self = util_fetch_and_add32(&fc_threads, 1);
 
-	store(n_parent, n->child[ochild]);
-	void *value = k->value;
-	c->pending_del_nodes[del] = n;
-	c->pending_del_leaves[del] = k;
+	for (unsigned i = 0; ; i++) {
+		struct critnib_fc_slot *f = &c->fc[(fc_self + i) % FC_SLOTS];
+		if (util_bool_compare_and_swap64(&f->state, FC_FREE, FC_BUSY))
+			return f;
+
+		/* more threads than slots, wait for one to free up */
+		if (i % FC_SLOTS == FC_SLOTS - 1)
+			sched_yield();
+	}
+}
+
+/*
+ * internal: combine -- do every posted remove, as one
+ *
+ * Called with the shared lock held.
+ */
+static void
+combine(struct critnib *__restrict c)
+{
+	struct critnib_node *n[FC_SLOTS];
+	struct critnib_leaf *k[FC_SLOTS];
+	struct critnib_fc_slot *done[FC_SLOTS];
+	int nr = 0, nd = 0;
+	uint64_t gen = insert_enter(c);
+
+	/* a thread only strays from its own slot once all are taken */
+	unsigned nslots = __atomic_load_n(&fc_threads, __ATOMIC_RELAXED);
+	if (nslots > FC_SLOTS)
+		nslots = FC_SLOTS;
+
+	for (unsigned i = 0; i < nslots; i++) {
+		struct critnib_fc_slot *f = &c->fc[i];
+		uint64_t state;
+		load(&f->state, &state);
+		if (state != FC_POSTED)
+			continue;
+
+		bool need_shared;
+		k[nr] = unlink_key(c, f->key, true, &need_shared, &n[nr]);
+		f->value = k[nr] ? k[nr]->value : NULL;
+		if (k[nr])
+			nr++;
+		done[nd++] = f;
+	}
 
-	os_mutex_unlock(&c->mutex);
+	if (nr)
+		pend(c, &c->stripe[0], n, k, nr, true);
+	insert_leave(c, gen);
+
+	for (int i = 0; i < nd; i++)
+		util_atomic_store_explicit64(&done[i]->state, FC_DONE,
+			memory_order_release);
+}
+
+/*
+ * critnib_remove -- delete a key from the critnib structure, return its value
+ *
+ * Posts the key, then either combines (if it gets the lock) or waits for
+ * whoever does.
+ */
+void *
+critnib_remove(struct critnib *c, uint64_t key)
+{
+	struct critnib_fc_slot *f = fc_claim(c);
+	f->key = key;
+	util_atomic_store_explicit64(&f->state, FC_POSTED,
+		memory_order_release);
+
+	uint64_t state;
+	while (load(&f->state, &state), state != FC_DONE) {
+		if (!os_mutex_trylock(&c->shared_mutex)) {
+			combine(c);
+			os_mutex_unlock(&c->shared_mutex);
+		} else {
+			sched_yield();
+		}
+	}
+
+	void *value = f->value;
+	util_atomic_store_explicit64(&f->state, FC_FREE,
+		memory_order_release);
 
 	return value;
 }
+#endif
 
 /*
  * critnib_get -- query for a key ("==" match), returns value or NULL
@@ -553,8 +1081,10 @@ critnib_get(struct critnib *c, uint64_t key)
 		 * each node's critical bit^H^H^Hnibble.  This means we risk
 		 * going wrong way if our path is missing, but that's ok...
 		 */
-		while (n && !is_leaf(n))
+		while (n && !is_leaf(n)) {
 			load(&n->child[slice_index(key, n->shift)], &n);
+			n = unfrozen(n);
+		}
 
 		/* ... as we check it at the end. */
 		struct critnib_leaf *k = to_leaf(n);
@@ -573,14 +1103,17 @@ find_successor(struct critnib_node *__restrict n)
 {
 	while (1) {
 		int nib;
-		for (nib = NIB; nib >= 0; nib--)
-			if (n->child[nib])
+		struct critnib_node *m = NULL;
+		for (nib = NIB; nib >= 0; nib--) {
+			load(&n->child[nib], &m);
+			if ((m = unfrozen(m)))
 				break;
+		}
 
 		if (nib < 0)
 			return NULL;
 
-		n = n->child[nib];
+		n = m;
 		if (is_leaf(n))
 			return to_leaf(n)->value;
 	}
@@ -628,6 +1161,7 @@ find_le(struct critnib_node *__restrict n, uint64_t key)
 	{
 		struct critnib_node *m;
 		load(&n->child[nib], &m);
+		m = unfrozen(m);
 		void *value = find_le(m, key);
 		if (value)
 			return value;
@@ -641,7 +1175,7 @@ find_le(struct critnib_node *__restrict n, uint64_t key)
 	for (nib--; nib >= 0; nib--) {
 		struct critnib_node *m;
 		load(&n->child[nib], &m);
-		if (m) {
+		if ((m = unfrozen(m))) {
 			n = m;
 			if (is_leaf(n))
 				return to_leaf(n)->value;
@@ -674,3 +1208,201 @@ critnib_find_le(struct critnib *c, uint64_t key)
 
 	return res;
 }
+
+/*
+ * A frozen critnib: every key in one sorted array, laid out in Eytzinger
+ * (BFS) order so the search is branchless and the next levels can be
+ * prefetched -- the 8 keys of a cacheline at 8k..8k+7 are descendants of
+ * k three levels down.  Immutable, thus reads need no remove_count.
+ */
+struct critnib_frozen {
+	size_t n;
+	uint64_t *key; /* 1-based */
+	void **value;
+};
+
+#define FROZEN_HDR 64 /* keeps key[0] cacheline-aligned */
+
+/*
+ * internal: freeze_count -- number of leaves in a subtree
+ */
+static size_t
+freeze_count(struct critnib_node *__restrict n)
+{
+	if (!n)
+		return 0;
+
+	if (is_leaf(n))
+		return 1;
+
+	size_t cnt = 0;
+	for (int i = 0; i < SLNODES; i++)
+		cnt += freeze_count(unfrozen(n->child[i]));
+
+	return cnt;
+}
+
+/*
+ * internal: freeze_sorted -- append a subtree's leaves in key order
+ */
+static void
+freeze_sorted(struct critnib_node *__restrict n,
+	struct critnib_leaf **sorted, size_t *cnt)
+{
+	if (!n)
+		return;
+
+	if (is_leaf(n)) {
+		sorted[(*cnt)++] = to_leaf(n);
+		return;
+	}
+
+	for (int i = 0; i < SLNODES; i++)
+		freeze_sorted(unfrozen(n->child[i]), sorted, cnt);
+}
+
+/*
+ * internal: freeze_eytz -- fill subtree k of the implicit tree in order
+ */
+static size_t
+freeze_eytz(struct critnib_frozen *__restrict f,
+	struct critnib_leaf **sorted, size_t i, size_t k)
+{
+	if (k > f->n)
+		return i;
+
+	i = freeze_eytz(f, sorted, i, 2 * k);
+	f->key[k] = sorted[i]->key;
+	f->value[k] = sorted[i]->value;
+	return freeze_eytz(f, sorted, i + 1, 2 * k + 1);
+}
+
+/*
+ * critnib_freeze -- build a read-only snapshot of a critnib
+ *
+ * There must be no concurrent writers; the critnib itself is left intact.
+ * Returns NULL if out of memory.
+ */
+struct critnib_frozen *
+critnib_freeze(struct critnib *c)
+{
+	size_t n = freeze_count(c->root);
+	struct critnib_leaf **sorted = Malloc((n + 1) * sizeof(*sorted));
+	if (!sorted)
+		return NULL;
+
+	size_t ksz = ((n + 1) * sizeof(uint64_t) + 63) & ~(size_t)63;
+	struct critnib_frozen *f;
+	if (posix_memalign((void **)&f, 64,
+			FROZEN_HDR + ksz + (n + 1) * sizeof(void *))) {
+		Free(sorted);
+		return NULL;
+	}
+
+	f->n = n;
+	f->key = (void *)((char *)f + FROZEN_HDR);
+	f->value = (void *)((char *)f->key + ksz);
+
+	size_t cnt = 0;
+	freeze_sorted(c->root, sorted, &cnt);
+	ASSERTeq(cnt, n);
+	freeze_eytz(f, sorted, 0, 1);
+	Free(sorted);
+
+	return f;
+}
+
+/*
+ * internal: sorted_fill -- append a subtree's entries in key order
+ */
+static void
+sorted_fill(struct critnib_node *__restrict n, uint64_t *key, void **value,
+	size_t *cnt)
+{
+	if (!n)
+		return;
+
+	if (is_leaf(n)) {
+		key[*cnt] = to_leaf(n)->key;
+		value[(*cnt)++] = to_leaf(n)->value;
+		return;
+	}
+
+	for (int i = 0; i < SLNODES; i++)
+		sorted_fill(unfrozen(n->child[i]), key, value, cnt);
+}
+
+/*
+ * critnib_count -- number of entries
+ *
+ * There must be no concurrent writers.
+ */
+size_t
+critnib_count(struct critnib *c)
+{
+	return freeze_count(c->root);
+}
+
+/*
+ * critnib_sorted -- copy all entries out, in key order
+ *
+ * There must be no concurrent writers; key and value need room for
+ * critnib_count() entries.  For building other read-only structures.
+ */
+void
+critnib_sorted(struct critnib *c, uint64_t *key, void **value)
+{
+	size_t cnt = 0;
+	sorted_fill(c->root, key, value, &cnt);
+}
+
+/*
+ * critnib_frozen_delete -- free a snapshot
+ */
+void
+critnib_frozen_delete(struct critnib_frozen *f)
+{
+	free(f);
+}
+
+/*
+ * internal: frozen_le -- index of the largest key <= given, 0 if none
+ *
+ * Every step goes right iff key[k] <= key, the last right turn is the
+ * answer: drop trailing left turns (zeroes) and that one.
+ */
+static inline size_t
+frozen_le(const struct critnib_frozen *__restrict f, uint64_t key)
+{
+	size_t k = 1;
+	while (k <= f->n) {
+		__builtin_prefetch(&f->key[8 * k]);
+		k = 2 * k + (f->key[k] <= key);
+	}
+
+	return k >> __builtin_ffsll((long long)k);
+}
+
+/*
+ * critnib_frozen_get -- query a snapshot for a key, returns value or NULL
+ *
+ * Wait-free, no synchronization at all.
+ */
+void *
+critnib_frozen_get(struct critnib_frozen *f, uint64_t key)
+{
+	size_t k = frozen_le(f, key);
+
+	return (k && f->key[k] == key) ? f->value[k] : NULL;
+}
+
+/*
+ * critnib_frozen_find_le -- query a snapshot ("<=" match)
+ */
+void *
+critnib_frozen_find_le(struct critnib_frozen *f, uint64_t key)
+{
+	size_t k = frozen_le(f, key);
+
+	return k ? f->value[k] : NULL;
+}
@@ -38,6 +38,7 @@
 #define LIBPMEMOBJ_CRITNIB_H 1
 
 #include <stdint.h>
+#include <stddef.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -53,6 +54,17 @@ void *critnib_remove(struct critnib *c, uint64_t key);
 void *critnib_get(struct critnib *c, uint64_t key);
 void *critnib_find_le(struct critnib *c, uint64_t key);
 
+size_t critnib_count(struct critnib *c);
+void critnib_sorted(struct critnib *c, uint64_t *key, void **value);
+
+struct critnib_frozen;
+
+struct critnib_frozen *critnib_freeze(struct critnib *c);
+void critnib_frozen_delete(struct critnib_frozen *f);
+
+void *critnib_frozen_get(struct critnib_frozen *f, uint64_t key);
+void *critnib_frozen_find_le(struct critnib_frozen *f, uint64_t key);
+
 #ifdef __cplusplus
 }
 #endif
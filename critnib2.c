@@ -0,0 +1,5 @@
+/*
+ * critnib2.c -- critnib with 2-bit slices
+ */
+#define CRITNIB_WIDTH 2
+#include "critnib.c"
@@ -0,0 +1,5 @@
+/*
+ * critnib5.c -- critnib with 5-bit slices
+ */
+#define CRITNIB_WIDTH 5
+#include "critnib.c"
@@ -0,0 +1,5 @@
+/*
+ * critnib8.c -- critnib with 8-bit slices
+ */
+#define CRITNIB_WIDTH 8
+#include "critnib.c"
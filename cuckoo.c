@@ -0,0 +1,346 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "util.h"
+#include "dlock.h"
+
+/*
+ * Bucketized cuckoo hash: every key has two candidate buckets of SLOTS
+ * entries each, a bucket being exactly one cacheline.  Thus a get touches
+ * at most two cachelines of the table (plus the header), no matter the size.
+ *
+ * Concurrency is "RCU + deletion lock" as described in README.md:
+ *  • writes take a global mutex
+ *  • a write that stays within the table bumps the table's write_status
+ *    seqlock around it, readers retry if they overlapped
+ *  • growing builds a new table aside, publishes it, then leaves the old
+ *    one's write_status odd forever so any straggler goes to the new one
+ *  • the old table is freed by the last reader to leave it, through the
+ *    deletion lock (dlock.h)
+ */
+
+#define FUNC(x) cuckoo_##x
+
+#define SLOTS 4
+#define MIN_BUCKETS 16
+#define MAX_KICKS 512
+/* grow when more than 9/10 of slots are used */
+#define MAX_LOAD(n) ((n) * SLOTS / 10 * 9)
+
+struct cuckoo_bucket
+{
+    uint64_t key[SLOTS];
+    void*    value[SLOTS];
+} __attribute__((aligned(64)));
+
+struct cuckoo_table
+{
+    uint64_t volatile write_status;
+    uint64_t mask;
+    struct cuckoo_bucket b[];
+};
+
+struct cuckoo
+{
+    struct cuckoo_table *table;
+    struct dlock del; /* guards the previous table */
+    uint64_t count;
+    uint64_t rnd;
+    pthread_mutex_t mutex;
+};
+
+/* h is util_hash64(key); its halves give two independent bucket indices */
+static inline struct cuckoo_bucket *bucket1(struct cuckoo_table *t, uint64_t h)
+{
+    return &t->b[h & t->mask];
+}
+
+static inline struct cuckoo_bucket *bucket2(struct cuckoo_table *t, uint64_t h)
+{
+    return &t->b[(h >> 32) & t->mask];
+}
+
+static struct cuckoo_table *alloc_table(uint64_t nbuckets)
+{
+    struct cuckoo_table *t;
+    size_t sz = sizeof(struct cuckoo_table)
+              + nbuckets * sizeof(struct cuckoo_bucket);
+    if (posix_memalign((void**)&t, CACHELINE_SIZE, sz))
+        return 0;
+    memset(t, 0, sz);
+    t->mask = nbuckets - 1;
+    return t;
+}
+
+struct cuckoo *FUNC(new)(void)
+{
+    struct cuckoo *c = Zalloc(sizeof(struct cuckoo));
+    if (!c)
+        return 0;
+    if (!(c->table = alloc_table(MIN_BUCKETS)))
+    {
+        Free(c);
+        return 0;
+    }
+    c->rnd = 0x2545f4914f6cdd1dULL;
+    pthread_mutex_init(&c->mutex, 0);
+    return c;
+}
+
+void FUNC(delete)(struct cuckoo *c)
+{
+    pthread_mutex_destroy(&c->mutex);
+    free(c->del.old);
+    free(c->table);
+    Free(c);
+}
+
+/*******************/
+/* deletion lock   */
+/*******************/
+
+static inline void read_lock(struct cuckoo *c)
+{
+    dlock_read_lock(&c->del);
+}
+
+static inline void read_unlock(struct cuckoo *c)
+{
+    dlock_read_unlock(&c->del, free);
+}
+
+/* to be called with the write mutex held, after the new table is live */
+static void retire(struct cuckoo *c, struct cuckoo_table *t)
+{
+    dlock_retire(&c->del, t, free);
+}
+
+/*******************/
+/* table internals */
+/*******************/
+
+static inline void write_poke(struct cuckoo_table *restrict t)
+{
+    util_fetch_and_add64(&t->write_status, 1);
+}
+
+static inline int find_slot(struct cuckoo_bucket *restrict b, uint64_t key)
+{
+    for (int i=0; i<SLOTS; i++)
+        if (b->value[i] && b->key[i] == key)
+            return i;
+    return -1;
+}
+
+static inline int free_slot(struct cuckoo_bucket *restrict b)
+{
+    for (int i=0; i<SLOTS; i++)
+        if (!b->value[i])
+            return i;
+    return -1;
+}
+
+static inline void *lookup(struct cuckoo_table *restrict t, uint64_t key)
+{
+    uint64_t h = util_hash64(key);
+    struct cuckoo_bucket *b = bucket1(t, h);
+    int i = find_slot(b, key);
+    if (i >= 0)
+        return b->value[i];
+    b = bucket2(t, h);
+    i = find_slot(b, key);
+    return (i >= 0) ? b->value[i] : 0;
+}
+
+static inline uint64_t xorshift(uint64_t *s)
+{
+    uint64_t x = *s;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *s = x;
+}
+
+/*
+ * Random walk: put the pair into one of its buckets, kicking out a victim
+ * into the victim's other bucket, and so on.  Returns 0 on success; on
+ * failure *key:*value hold the entry that's left homeless (not necessarily
+ * the one we started with).
+ */
+static int place(struct cuckoo_table *restrict t, uint64_t *rnd,
+                 uint64_t *key, void **value)
+{
+    uint64_t h = util_hash64(*key);
+    struct cuckoo_bucket *b = bucket1(t, h), *b2 = bucket2(t, h);
+    int i;
+
+    if ((i = free_slot(b)) < 0)
+    {
+        b = b2;
+        if ((i = free_slot(b)) < 0)
+            b = (xorshift(rnd) & 1) ? bucket1(t, h) : b2;
+    }
+
+    for (int kick=0; kick<MAX_KICKS; kick++)
+    {
+        if (i >= 0)
+        {
+            b->value[i] = *value;
+            b->key[i] = *key;
+            return 0;
+        }
+
+        i = xorshift(rnd) % SLOTS;
+        uint64_t vk = b->key[i];
+        void *vv = b->value[i];
+        b->key[i] = *key;
+        b->value[i] = *value;
+        *key = vk;
+        *value = vv;
+
+        h = util_hash64(vk);
+        b = (bucket1(t, h) == b) ? bucket2(t, h) : bucket1(t, h);
+        i = free_slot(b);
+    }
+
+    return 1;
+}
+
+/*
+ * Build a bigger table holding everything from t plus the given pair.
+ * The new one is not visible to anyone yet, no pokes needed.
+ */
+static struct cuckoo_table *rehash(struct cuckoo *c, struct cuckoo_table *t,
+                                   uint64_t key, void *value)
+{
+    uint64_t nb = t->mask + 1;
+again:
+    nb *= 2;
+    struct cuckoo_table *n = alloc_table(nb);
+    if (!n)
+        return 0;
+    for (uint64_t j=0; j<=t->mask; j++)
+        for (int i=0; i<SLOTS; i++)
+        {
+            uint64_t k = t->b[j].key[i];
+            void *v = t->b[j].value[i];
+            if (v && place(n, &c->rnd, &k, &v))
+            {
+                free(n);
+                goto again;
+            }
+        }
+    if (value && place(n, &c->rnd, &key, &value))
+    {
+        free(n);
+        goto again;
+    }
+    return n;
+}
+
+int FUNC(insert)(struct cuckoo *c, uint64_t key, void *value)
+{
+    /* value of 0 marks an empty slot */
+    if (!value)
+        return EINVAL;
+
+    pthread_mutex_lock(&c->mutex);
+    struct cuckoo_table *t = c->table;
+    if (lookup(t, key))
+    {
+        pthread_mutex_unlock(&c->mutex);
+        return EEXIST;
+    }
+
+    if (c->count + 1 > MAX_LOAD(t->mask + 1))
+    {
+        /* proactive grow: the old table stays valid for readers meanwhile */
+        struct cuckoo_table *n = rehash(c, t, key, value);
+        if (!n)
+        {
+            pthread_mutex_unlock(&c->mutex);
+            return ENOMEM;
+        }
+        __atomic_store_n(&c->table, n, __ATOMIC_RELEASE);
+        write_poke(t);
+        retire(c, t);
+        c->count++;
+        pthread_mutex_unlock(&c->mutex);
+        return 0;
+    }
+
+    write_poke(t);
+    if (place(t, &c->rnd, &key, &value))
+    {
+        /*
+         * Some entry is now homeless, the old table must never again look
+         * consistent to readers -- we leave write_status odd.
+         */
+        struct cuckoo_table *n = rehash(c, t, key, value);
+        if (!n)
+        {
+            /* nowhere to put the homeless one; can't fail cleanly */
+            abort();
+        }
+        __atomic_store_n(&c->table, n, __ATOMIC_RELEASE);
+        retire(c, t);
+    }
+    else
+        write_poke(t);
+    c->count++;
+    pthread_mutex_unlock(&c->mutex);
+    return 0;
+}
+
+void *FUNC(remove)(struct cuckoo *c, uint64_t key)
+{
+    void *value = 0;
+    pthread_mutex_lock(&c->mutex);
+    struct cuckoo_table *t = c->table;
+    uint64_t h = util_hash64(key);
+    struct cuckoo_bucket *b = bucket1(t, h);
+    int i = find_slot(b, key);
+    if (i < 0)
+        i = find_slot(b = bucket2(t, h), key);
+    if (i >= 0)
+    {
+        write_poke(t);
+        value = b->value[i];
+        b->value[i] = 0;
+        b->key[i] = 0;
+        write_poke(t);
+        c->count--;
+    }
+    pthread_mutex_unlock(&c->mutex);
+    return value;
+}
+
+void* FUNC(get)(struct cuckoo *c, uint64_t key)
+{
+    struct cuckoo_table *t;
+    uint64_t wrs1, wrs2;
+    void *res;
+
+    read_lock(c);
+retry:
+    t = __atomic_load_n(&c->table, __ATOMIC_ACQUIRE);
+    util_atomic_load_explicit64(&t->write_status, &wrs1, memory_order_acquire);
+    if (wrs1 & 1)
+    {
+        sched_yield();
+        goto retry;
+    }
+    res = lookup(t, key);
+    util_atomic_load_explicit64(&t->write_status, &wrs2, memory_order_acquire);
+    if (wrs1 != wrs2)
+        goto retry;
+    read_unlock(c);
+    return res;
+}
+
+void* FUNC(find_le)(struct cuckoo *c, uint64_t key)
+{
+    fprintf(stderr, "Not implemented.\n");
+    abort();
+}
@@ -0,0 +1,66 @@
+/*
+ * dlock.h -- the deletion lock of README.md's "RCU + deletion lock"
+ *
+ * Readers count themselves in and out around their use of an RCU-published
+ * version; a writer that replaced one hands the old one to dlock_retire(),
+ * and it's released once no reader that could have seen it is left.  One
+ * retired version is pending at a time.
+ *
+ * The reader count and the "a version is pending" flag share one word,
+ * readers*2 + pending, so the release is claimed by a single CAS from "no
+ * readers, pending" to "no readers, none pending".  A thread late to that
+ * CAS can't claim a later version while readers are in it, nor can two
+ * threads claim the same one -- unlike a bare counter that sits at -1 while
+ * the version is being freed, which a reader coming in then takes for a
+ * clean 0.
+ */
+
+#ifndef DLOCK_H
+#define DLOCK_H 1
+
+#include <sched.h>
+#include <stdint.h>
+#include "util.h"
+
+struct dlock
+{
+    uint64_t word; /* readers*2 + pending */
+    void *old;     /* the pending version */
+};
+
+/* release the pending version, if there's one and no reader left */
+static inline void dlock_claim(struct dlock *l, void (*release)(void *))
+{
+    if (!util_bool_compare_and_swap64(&l->word, 1, 0))
+        return;
+    release(__atomic_load_n(&l->old, __ATOMIC_ACQUIRE));
+    __atomic_store_n(&l->old, NULL, __ATOMIC_RELEASE);
+}
+
+static inline void dlock_read_lock(struct dlock *l)
+{
+    util_fetch_and_add64(&l->word, 2);
+}
+
+static inline void dlock_read_unlock(struct dlock *l, void (*release)(void *))
+{
+    if (util_fetch_and_sub64(&l->word, 2) == 3)
+        dlock_claim(l, release);
+}
+
+/*
+ * With writers excluded, once old can't be reached by new readers: hand it
+ * over, to be released by the last reader still in it -- or right away if
+ * there's none.  Waits for the previous one's release to finish first.
+ */
+static inline void dlock_retire(struct dlock *l, void *old,
+                                void (*release)(void *))
+{
+    while (__atomic_load_n(&l->old, __ATOMIC_ACQUIRE))
+        sched_yield();
+    __atomic_store_n(&l->old, old, __ATOMIC_RELEASE);
+    util_fetch_and_add64(&l->word, 1);
+    dlock_claim(l, release);
+}
+
+#endif
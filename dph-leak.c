@@ -0,0 +1,7 @@
+/*
+ * dph-leak.c -- dynamic perfect hashing, variant that leaks old buckets
+ * instead of taking a deletion lock in reads
+ */
+#define DPH_LEAK
+#define FUNC(x) dph_leak_##x
+#include "dph.c"
@@ -0,0 +1,497 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "util.h"
+#include "out.h"
+#include "dlock.h"
+
+/*
+ * Dynamic perfect hashing (FKS): a top level table splits keys into small
+ * buckets, each bucket is a second level table with its own hash seed that
+ * has no collisions among the bucket's keys.  A get thus looks at exactly
+ * one top slot and one bucket entry.
+ *
+ * Buckets are immutable once published: a write builds a new version of the
+ * bucket aside and swaps the pointer (per-bucket RCU).  What to do with the
+ * old version:
+ *  • default: a deletion lock per top slot (dlock.h), freed by the last
+ *    reader to leave
+ *  • DPH_LEAK: never freed while the map exists, readers need no sync at
+ *    all.  Old versions are kept on a list and reclaimed at delete time.
+ *
+ * As FKS requires for linear space, the top level has at least a slot per
+ * key, and the buckets' tables (~n_i² entries each) add up to at most
+ * SPACE_PER_KEY entries per key; past either, the whole map is rewritten
+ * -- doubling the top, or with a new top seed if it's just unlucky.  The
+ * rewrites block other writers but never readers, and cost O(1) amortized
+ * per insert.  Old top tables are always leaked (until delete) -- together
+ * as big as the current one.
+ */
+
+#ifndef FUNC
+# define FUNC(x) dph_##x
+#endif
+
+#define MAX_TOP_BITS 32
+/*
+ * Σ n_i² over buckets is ~2n for a random top seed (and a slot per key);
+ * the power of 2 rounding makes the tables ~3 entries per key.
+ */
+#define SPACE_PER_KEY 6
+#define SEED_TRIES 16
+
+struct dph_entry
+{
+    uint64_t key;
+    void*    value;
+};
+
+struct dph_bucket
+{
+    uint64_t seed;
+    uint64_t mask;
+    uint64_t n;
+    struct dph_bucket *next; /* on the graveyard, leak variant */
+    struct dph_entry e[];
+};
+
+struct dph_slot
+{
+    struct dph_bucket *b;
+#ifndef DPH_LEAK
+    struct dlock del; /* guards the previous bucket */
+#endif
+};
+
+struct dph_top
+{
+    uint64_t seed;
+    uint64_t mask;
+    struct dph_top *prev; /* older, leaked versions */
+    struct dph_slot s[];
+};
+
+struct dph
+{
+    struct dph_top *top;
+    uint64_t count;
+    uint64_t space; /* entries in all current buckets' tables */
+    uint64_t rnd;
+    struct dph_bucket *graveyard;
+    pthread_mutex_t mutex;
+};
+
+static inline uint64_t xorshift(uint64_t *s)
+{
+    uint64_t x = *s;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *s = x;
+}
+
+/* the seed is xored into the key before hashing */
+static inline struct dph_slot *top_slot(struct dph_top *t, uint64_t key)
+{
+    return &t->s[util_hash64(key ^ t->seed) & t->mask];
+}
+
+static inline struct dph_entry *bucket_entry(struct dph_bucket *b, uint64_t key)
+{
+    return &b->e[util_hash64(key ^ b->seed) & b->mask];
+}
+
+static struct dph_top *alloc_top(struct dph *c, uint64_t nslots)
+{
+    struct dph_top *t = Zalloc(sizeof(struct dph_top)
+                               + nslots * sizeof(struct dph_slot));
+    if (!t)
+        return 0;
+    t->seed = xorshift(&c->rnd);
+    t->mask = nslots - 1;
+    return t;
+}
+
+struct dph *FUNC(new)(void)
+{
+    struct dph *c = Zalloc(sizeof(struct dph));
+    if (!c)
+        return 0;
+    c->rnd = 0x9e3779b97f4a7c15ULL;
+    if (!(c->top = alloc_top(c, 1)))
+    {
+        Free(c);
+        return 0;
+    }
+    pthread_mutex_init(&c->mutex, 0);
+    return c;
+}
+
+void FUNC(delete)(struct dph *c)
+{
+    struct dph_top *t = c->top;
+    for (uint64_t i=0; i<=t->mask; i++)
+    {
+        Free(t->s[i].b);
+#ifndef DPH_LEAK
+        Free(t->s[i].del.old);
+#endif
+    }
+    while (t)
+    {
+        struct dph_top *tt = t->prev;
+#ifndef DPH_LEAK
+        if (tt)
+            for (uint64_t i=0; i<=tt->mask; i++)
+                Free(tt->s[i].del.old);
+#endif
+        Free(t);
+        t = tt;
+    }
+    for (struct dph_bucket *b = c->graveyard; b; )
+    {
+        struct dph_bucket *bb = b->next;
+        Free(b);
+        b = bb;
+    }
+    pthread_mutex_destroy(&c->mutex);
+    Free(c);
+}
+
+/***************************/
+/* reclaiming old versions */
+/***************************/
+
+#ifndef DPH_LEAK
+static inline void read_lock(struct dph_slot *s)
+{
+    dlock_read_lock(&s->del);
+}
+
+static inline void read_unlock(struct dph_slot *s)
+{
+    dlock_read_unlock(&s->del, Free);
+}
+#endif
+
+/* to be called with the write mutex held, after s->b no longer points to b */
+static void retire(struct dph *c, struct dph_slot *s, struct dph_bucket *b)
+{
+    if (!b)
+        return;
+#ifdef DPH_LEAK
+    b->next = c->graveyard;
+    c->graveyard = b;
+#else
+    dlock_retire(&s->del, b, Free);
+#endif
+}
+
+/******************/
+/* building parts */
+/******************/
+
+/* a bucket's table for n entries: the smallest power of 2 that's >= n² */
+static inline uint64_t bucket_size(uint64_t n)
+{
+    if (!n)
+        return 0;
+    uint64_t sz = 2;
+    while (sz < n * n)
+        sz *= 2;
+    return sz;
+}
+
+/*
+ * Build a collision-free bucket for n entries: a random seed works with
+ * probability >= 1/2.
+ */
+static struct dph_bucket *build_bucket(struct dph *c,
+                                       const struct dph_entry *restrict e,
+                                       uint64_t n)
+{
+    if (!n)
+        return 0;
+
+    uint64_t sz = bucket_size(n);
+
+    size_t bytes = sizeof(struct dph_bucket) + sz * sizeof(struct dph_entry);
+    struct dph_bucket *b = Malloc(bytes);
+    if (!b)
+        return 0;
+
+    for (int tries=0; ; tries++)
+    {
+        if (tries == SEED_TRIES)
+        {
+            /* very unlucky or hash is bad for these keys; loosen up */
+            struct dph_bucket *bb;
+            sz *= 2;
+            bytes = sizeof(struct dph_bucket) + sz * sizeof(struct dph_entry);
+            if (!(bb = Malloc(bytes)))
+                return Free(b), NULL;
+            Free(b);
+            b = bb;
+            tries = 0;
+        }
+
+        memset(b, 0, bytes);
+        b->seed = xorshift(&c->rnd);
+        b->mask = sz - 1;
+        b->n = n;
+
+        uint64_t i;
+        for (i=0; i<n; i++)
+        {
+            struct dph_entry *d = bucket_entry(b, e[i].key);
+            if (d->value)
+                break;
+            *d = e[i];
+        }
+        if (i == n)
+            return b;
+    }
+}
+
+/* gather a bucket's entries, sans the one with key "skip" if present */
+static uint64_t gather(struct dph_bucket *restrict b,
+                       struct dph_entry *restrict e, uint64_t skip,
+                       int skip_it)
+{
+    uint64_t n = 0;
+    if (!b)
+        return 0;
+    for (uint64_t i=0; i<=b->mask; i++)
+        if (b->e[i].value && !(skip_it && b->e[i].key == skip))
+            e[n++] = b->e[i];
+    return n;
+}
+
+/*
+ * Whole-table rewrite: a new top level of 2^bits slots and a new seed,
+ * with every bucket rebuilt, plus the entry being inserted.  If the
+ * buckets come out too big, tries another seed (SEED_TRIES times, then
+ * settles).  Readers keep using the old version till the new one is
+ * published.
+ */
+static int rebuild_top(struct dph *c, uint64_t bits, uint64_t key, void *value)
+{
+    struct dph_top *t = c->top;
+    struct dph_top *nt = 0;
+
+    uint64_t n = c->count + 1;
+    uint64_t space = 0;
+    struct dph_entry *all = Malloc(n * sizeof(struct dph_entry));
+    struct dph_entry *sorted = Malloc(n * sizeof(struct dph_entry));
+    uint64_t *pos = Malloc(((1ULL << bits) + 1) * sizeof(uint64_t));
+    if (!all || !sorted || !pos)
+        goto nomem;
+
+    uint64_t k = 0;
+    for (uint64_t i=0; i<=t->mask; i++)
+        k += gather(t->s[i].b, all + k, 0, 0);
+    all[k].key = key;
+    all[k].value = value;
+    ASSERTeq(k + 1, n);
+
+    for (int tries=0; ; tries++)
+    {
+        if (!(nt = alloc_top(c, 1ULL << bits)))
+            goto nomem;
+
+        /* counting sort everything by the new slot */
+        memset(pos, 0, ((nt->mask + 1) + 1) * sizeof(uint64_t));
+        for (uint64_t i=0; i<n; i++)
+            pos[(top_slot(nt, all[i].key) - nt->s) + 1]++;
+
+        /* the buckets' sizes, before building any */
+        space = 0;
+        for (uint64_t i=0; i<=nt->mask; i++)
+            space += bucket_size(pos[i + 1]);
+        if (space <= SPACE_PER_KEY * n || tries == SEED_TRIES)
+            break;
+        Free(nt);
+    }
+
+    for (uint64_t i=0; i<=nt->mask; i++)
+        pos[i + 1] += pos[i];
+    for (uint64_t i=0; i<n; i++)
+        sorted[pos[top_slot(nt, all[i].key) - nt->s]++] = all[i];
+
+    /* pos[i] is now the end of slot i's run */
+    space = 0;
+    for (uint64_t i=0, start=0; i<=nt->mask; start=pos[i++])
+    {
+        if (start == pos[i])
+            continue;
+        if (!(nt->s[i].b = build_bucket(c, sorted + start, pos[i] - start)))
+            goto nomem;
+        space += nt->s[i].b->mask + 1;
+    }
+
+    Free(pos);
+    Free(sorted);
+    Free(all);
+
+    nt->prev = t;
+    __atomic_store_n(&c->top, nt, __ATOMIC_RELEASE);
+
+    /*
+     * Stragglers on the old top may still look at its buckets.  In the
+     * deletion lock variant, they notice the top changed and retry.
+     */
+    for (uint64_t i=0; i<=t->mask; i++)
+    {
+        struct dph_bucket *b = t->s[i].b;
+#ifndef DPH_LEAK
+        __atomic_store_n(&t->s[i].b, NULL, __ATOMIC_RELEASE);
+#endif
+        retire(c, &t->s[i], b);
+    }
+    c->count++;
+    c->space = space;
+    return 0;
+
+nomem:
+    if (nt)
+        for (uint64_t i=0; i<=nt->mask; i++)
+            Free(nt->s[i].b);
+    Free(nt);
+    Free(pos);
+    Free(sorted);
+    Free(all);
+    return ENOMEM;
+}
+
+/*************/
+/* interface */
+/*************/
+
+int FUNC(insert)(struct dph *c, uint64_t key, void *value)
+{
+    /* value of 0 marks an empty entry */
+    if (!value)
+        return EINVAL;
+
+    pthread_mutex_lock(&c->mutex);
+    struct dph_top *t = c->top;
+    struct dph_slot *s = top_slot(t, key);
+    struct dph_bucket *b = s->b;
+    if (b && bucket_entry(b, key)->value && bucket_entry(b, key)->key == key)
+    {
+        pthread_mutex_unlock(&c->mutex);
+        return EEXIST;
+    }
+
+    uint64_t n = b ? b->n : 0;
+    uint64_t bits = util_popcount64(t->mask);
+    uint64_t space = c->space - (b ? b->mask + 1 : 0) + bucket_size(n + 1);
+    if (bits < MAX_TOP_BITS && (c->count + 1 > t->mask + 1
+                                || space > SPACE_PER_KEY * (c->count + 1)))
+    {
+        /* out of slots: double the top; else just a bad seed */
+        if (c->count + 1 > t->mask + 1)
+            bits++;
+        int ret = rebuild_top(c, bits, key, value);
+        pthread_mutex_unlock(&c->mutex);
+        return ret;
+    }
+
+    struct dph_entry e[n + 1];
+    gather(b, e, 0, 0);
+    e[n].key = key;
+    e[n].value = value;
+    struct dph_bucket *nb = build_bucket(c, e, n + 1);
+    if (!nb)
+    {
+        pthread_mutex_unlock(&c->mutex);
+        return ENOMEM;
+    }
+
+    c->space += (nb->mask + 1) - (b ? b->mask + 1 : 0);
+    __atomic_store_n(&s->b, nb, __ATOMIC_RELEASE);
+    retire(c, s, b);
+    c->count++;
+    pthread_mutex_unlock(&c->mutex);
+    return 0;
+}
+
+void *FUNC(remove)(struct dph *c, uint64_t key)
+{
+    pthread_mutex_lock(&c->mutex);
+    struct dph_slot *s = top_slot(c->top, key);
+    struct dph_bucket *b = s->b;
+    struct dph_entry *d;
+    if (!b || !(d = bucket_entry(b, key))->value || d->key != key)
+    {
+        pthread_mutex_unlock(&c->mutex);
+        return 0;
+    }
+
+    void *value = d->value;
+    struct dph_bucket *nb = 0;
+    if (b->n > 1)
+    {
+        struct dph_entry e[b->n];
+        uint64_t n = gather(b, e, key, 1);
+        if (!(nb = build_bucket(c, e, n)))
+        {
+            /*
+             * Out of memory for a smaller bucket: empty the entry in place
+             * instead.  Readers see either the value or none, both fine;
+             * the bucket keeps its size till its next rewrite.
+             */
+            __atomic_store_n(&d->value, NULL, __ATOMIC_RELEASE);
+            b->n--;
+            c->count--;
+            pthread_mutex_unlock(&c->mutex);
+            return value;
+        }
+    }
+
+    c->space -= (b->mask + 1) - (nb ? nb->mask + 1 : 0);
+    __atomic_store_n(&s->b, nb, __ATOMIC_RELEASE);
+    retire(c, s, b);
+    c->count--;
+    pthread_mutex_unlock(&c->mutex);
+    return value;
+}
+
+static inline void *bucket_get(struct dph_bucket *b, uint64_t key)
+{
+    if (!b)
+        return 0;
+    struct dph_entry *d = bucket_entry(b, key);
+    return (d->key == key) ? __atomic_load_n(&d->value, __ATOMIC_ACQUIRE) : 0;
+}
+
+void* FUNC(get)(struct dph *c, uint64_t key)
+{
+    struct dph_top *t = __atomic_load_n(&c->top, __ATOMIC_ACQUIRE);
+    struct dph_slot *s = top_slot(t, key);
+#ifdef DPH_LEAK
+    return bucket_get(__atomic_load_n(&s->b, __ATOMIC_ACQUIRE), key);
+#else
+    void *res;
+    for (;;)
+    {
+        read_lock(s);
+        res = bucket_get(__atomic_load_n(&s->b, __ATOMIC_ACQUIRE), key);
+        read_unlock(s);
+
+        /* a straggler on a grown-out top may have seen a cleared slot */
+        struct dph_top *tt = __atomic_load_n(&c->top, __ATOMIC_ACQUIRE);
+        if (tt == t)
+            return res;
+        t = tt;
+        s = top_slot(t, key);
+    }
+#endif
+}
+
+void* FUNC(find_le)(struct dph *c, uint64_t key)
+{
+    fprintf(stderr, "Not implemented.\n");
+    abort();
+}
@@ -0,0 +1,229 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#ifdef __BMI2__
+# include <immintrin.h>
+#endif
+#include "util.h"
+#include "frozen.h"
+#include "eliasfano.h"
+
+/*
+ * Elias-Fano coding of the sorted key set: of n keys up to max, the low
+ * l = log2(max/n) bits of each are stored packed as they are, the rest
+ * (the high part) in unary -- key i sets bit (high_i + i) of the upper
+ * bit array, so the keys of bucket h end right before its h-th zero.
+ * That's 2 + log2(max/n) bits per key instead of 64, within two bits of
+ * the information-theoretic minimum.
+ *
+ * find_le finds the key's bucket with a select0 on the upper bits (a
+ * sampled position every SAMPLE zeros, then popcounts), then binary
+ * searches the bucket's low bits -- ~1 key per bucket on average, but
+ * clustered keys can crowd one.  If all there are bigger, the key before
+ * the bucket is the answer whatever its low bits are.
+ *
+ * Values are a plain array by rank: they're what's left of the size.
+ * The engine (eliasfano_*) is a critnib until hm_freeze (frozen.h).
+ */
+
+#define SAMPLE 256
+
+struct ef_index
+{
+    size_t n;
+    int l; /* low bits per key */
+    uint64_t max;
+    uint64_t *low;
+    uint64_t *upper;
+    uint64_t *sample; /* position of every SAMPLE-th zero */
+    void **value;
+};
+
+/* position of the k-th (from 0) set bit */
+static inline int select64(uint64_t w, int k)
+{
+#ifdef __BMI2__
+    return __builtin_ctzll(_pdep_u64(1ULL << k, w));
+#else
+    while (k--)
+        w &= w - 1;
+    return __builtin_ctzll(w);
+#endif
+}
+
+static inline int test_bit(const uint64_t *bits, uint64_t b)
+{
+    return bits[b / 64] >> (b % 64) & 1;
+}
+
+static inline uint64_t get_low(const struct ef_index *f, uint64_t i)
+{
+    if (!f->l)
+        return 0;
+    uint64_t b = i * f->l;
+    uint64_t w = f->low[b / 64] >> (b % 64);
+    if (b % 64 + f->l > 64)
+        w |= f->low[b / 64 + 1] << (64 - b % 64);
+    return w & (~0ULL >> (64 - f->l));
+}
+
+/* position of the h-th (from 0) zero of the upper bits */
+static inline uint64_t select0(const struct ef_index *f, uint64_t h)
+{
+    uint64_t pos = f->sample[h / SAMPLE];
+    uint64_t k = h % SAMPLE;
+    uint64_t w = pos / 64;
+    uint64_t z = ~f->upper[w] & (~0ULL << (pos % 64));
+    for (;;)
+    {
+        uint64_t c = __builtin_popcountll(z);
+        if (k < c)
+            return w * 64 + select64(z, k);
+        k -= c;
+        z = ~f->upper[++w];
+    }
+}
+
+/*
+ * The number of keys <= the given one (< max), thus the answer's index
+ * plus one; *exact tells whether it's the key itself.
+ */
+static uint64_t rank_le(const struct ef_index *f, uint64_t key, int *exact)
+{
+    uint64_t h = key >> f->l;
+    uint64_t lo = f->l ? key & (~0ULL >> (64 - f->l)) : 0;
+    /* bucket h's keys are the ones between zeros h-1 and h */
+    uint64_t b = h ? select0(f, h - 1) + 1 : 0;
+    uint64_t first = b - h;
+    uint64_t w = b / 64;
+    uint64_t z = ~f->upper[w] & (~0ULL << (b % 64));
+    while (!z)
+        z = ~f->upper[++w];
+    uint64_t end = w * 64 + __builtin_ctzll(z) - h;
+
+    /* within a bucket the low bits are sorted; before it, all is smaller */
+    uint64_t i = first, n = end - first;
+    while (n)
+    {
+        uint64_t half = n / 2;
+        if (get_low(f, i + half) <= lo)
+        {
+            i += half + 1;
+            n -= half + 1;
+        }
+        else
+            n = half;
+    }
+    *exact = i > first && get_low(f, i - 1) == lo;
+    return i;
+}
+
+/*
+ * ef_build -- Elias-Fano code a sorted key set
+ *
+ * Returns NULL if out of memory, or (EINVAL) if the keys aren't sorted.
+ */
+struct ef_index *ef_build(const uint64_t *key, void *const *value, size_t n)
+{
+    for (size_t i = 1; i < n; i++)
+        if (key[i - 1] >= key[i])
+        {
+            errno = EINVAL;
+            return 0;
+        }
+
+    struct ef_index *f = Zalloc(sizeof(struct ef_index));
+    if (!f)
+        return 0;
+    f->n = n;
+    if (!n)
+        return f;
+
+    f->max = key[n - 1];
+    f->l = (f->max / n) ? 63 - __builtin_clzll(f->max / n) : 0;
+    uint64_t buckets = (f->max >> f->l) + 1;
+    uint64_t ubits = n + buckets;
+
+    /* a spare word at the end so get_low and select0 may read past */
+    if (!(f->low = Zalloc((n * f->l / 64 + 2) * sizeof(uint64_t))))
+        goto fail;
+    if (!(f->upper = Zalloc((ubits / 64 + 2) * sizeof(uint64_t))))
+        goto fail;
+    if (!(f->sample = Malloc(((buckets - 1) / SAMPLE + 1) * sizeof(uint64_t))))
+        goto fail;
+    if (!(f->value = Malloc(n * sizeof(void *))))
+        goto fail;
+    memcpy(f->value, value, n * sizeof(void *));
+
+    for (size_t i = 0; i < n; i++)
+    {
+        uint64_t b = (key[i] >> f->l) + i;
+        f->upper[b / 64] |= 1ULL << (b % 64);
+        if (!f->l)
+            continue;
+        uint64_t lo = key[i] & (~0ULL >> (64 - f->l));
+        b = i * f->l;
+        f->low[b / 64] |= lo << (b % 64);
+        if (b % 64 + f->l > 64)
+            f->low[b / 64 + 1] |= lo >> (64 - b % 64);
+    }
+
+    uint64_t zeros = 0;
+    for (uint64_t b = 0; zeros < buckets; b++)
+        if (!test_bit(f->upper, b))
+        {
+            if (!(zeros % SAMPLE))
+                f->sample[zeros / SAMPLE] = b;
+            zeros++;
+        }
+
+    return f;
+
+fail:
+    ef_index_delete(f);
+    return 0;
+}
+
+void ef_index_delete(struct ef_index *f)
+{
+    Free(f->low);
+    Free(f->upper);
+    Free(f->sample);
+    Free(f->value);
+    Free(f);
+}
+
+/*
+ * ef_index_get -- query for a key
+ */
+void *ef_index_get(struct ef_index *f, uint64_t key)
+{
+    if (!f->n || key > f->max)
+        return 0;
+    if (key == f->max)
+        return f->value[f->n - 1];
+    int exact;
+    uint64_t i = rank_le(f, key, &exact);
+    return exact ? f->value[i - 1] : 0;
+}
+
+/*
+ * ef_index_find_le -- the value of the largest key <= the given one
+ */
+void *ef_index_find_le(struct ef_index *f, uint64_t key)
+{
+    if (!f->n)
+        return 0;
+    if (key >= f->max)
+        return f->value[f->n - 1];
+    int exact;
+    uint64_t i = rank_le(f, key, &exact);
+    return i ? f->value[i - 1] : 0;
+}
+
+/**********/
+/* engine */
+/**********/
+
+FROZEN_ENGINE(eliasfano, ef_index, ef_build, ef_index_get,
+    ef_index_find_le, ef_index_delete)
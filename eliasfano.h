@@ -0,0 +1,20 @@
+/*
+ * eliasfano.h -- a read-only Elias-Fano coded map, built in bulk
+ */
+
+#ifndef ELIASFANO_H
+#define ELIASFANO_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct ef_index;
+
+/* keys sorted, no duplicates; both get copied.  NULL if no memory */
+struct ef_index *ef_build(const uint64_t *key, void *const *value, size_t n);
+void ef_index_delete(struct ef_index *f);
+
+void *ef_index_get(struct ef_index *f, uint64_t key);
+void *ef_index_find_le(struct ef_index *f, uint64_t key);
+
+#endif
@@ -0,0 +1,117 @@
+/*
+ * frozen.h -- an engine that's a critnib until hm_freeze, then a read-only
+ * index built from the critnib's sorted contents (like critnib_eytz)
+ *
+ * FROZEN_ENGINE(x, index, build, get, find_le, free) defines x_new,
+ * x_delete, x_freeze, x_insert, x_remove, x_get and x_find_le around
+ * struct index and its
+ *   struct index *build(const uint64_t *key, void *const *value, size_t n);
+ *   void *get(struct index *f, uint64_t key);
+ *   void *find_le(struct index *f, uint64_t key);
+ *   void free(struct index *f);
+ * build gets the keys sorted, returns NULL if out of memory.  An index is
+ * never written once built, thus its reads need no synchronization at all;
+ * neither do the engine's, as it switches from the critnib only in
+ * hm_freeze, which can't run alongside anything.
+ */
+
+#ifndef FROZEN_H
+#define FROZEN_H 1
+
+#include <errno.h>
+#include <stdint.h>
+#include "util.h"
+#include "critnib.h"
+
+/* the critnib's contents, sorted, handed to build; NULL if out of memory */
+static inline void *frozen_build(struct critnib *c,
+    void *(*build)(const uint64_t *key, void *const *value, size_t n))
+{
+    void *f = 0;
+    size_t n = critnib_count(c);
+    uint64_t *key = Malloc((n + 1) * sizeof(uint64_t));
+    void **value = Malloc((n + 1) * sizeof(void *));
+    if (key && value)
+    {
+        critnib_sorted(c, key, value);
+        f = build(key, value, n);
+    }
+    Free(key);
+    Free(value);
+    return f;
+}
+
+#define FROZEN_ENGINE(x, index, build, get, find_le, free) \
+    struct x\
+    {\
+        struct critnib *c;\
+        struct index *f;\
+    };\
+    \
+    struct x *x##_new(void)\
+    {\
+        struct x *e = Zalloc(sizeof(struct x));\
+        if (!e)\
+            return 0;\
+        if (!(e->c = critnib_new()))\
+        {\
+            Free(e);\
+            return 0;\
+        }\
+        return e;\
+    }\
+    \
+    void x##_delete(struct x *e)\
+    {\
+        if (e->c)\
+            critnib_delete(e->c);\
+        if (e->f)\
+            free(e->f);\
+        Free(e);\
+    }\
+    \
+    static void *x##_build_(const uint64_t *key, void *const *value, size_t n)\
+    {\
+        return build(key, value, n);\
+    }\
+    \
+    int x##_freeze(struct x *e)\
+    {\
+        if (e->f)\
+            return 0;\
+        if (!(e->f = frozen_build(e->c, x##_build_)))\
+            return ENOMEM;\
+        critnib_delete(e->c);\
+        e->c = 0;\
+        return 0;\
+    }\
+    \
+    int x##_insert(struct x *e, uint64_t key, void *value)\
+    {\
+        if (e->f)\
+            return EROFS;\
+        return critnib_insert(e->c, key, value);\
+    }\
+    \
+    void *x##_remove(struct x *e, uint64_t key)\
+    {\
+        if (e->f)\
+            return 0;\
+        return critnib_remove(e->c, key);\
+    }\
+    \
+    void *x##_get(struct x *e, uint64_t key)\
+    {\
+        if (e->f)\
+            return get(e->f, key);\
+        return critnib_get(e->c, key);\
+    }\
+    \
+    void *x##_find_le(struct x *e, uint64_t key)\
+    {\
+        if (e->f)\
+            return find_le(e->f, key);\
+        return critnib_find_le(e->c, key);\
+    }
+
+#endif
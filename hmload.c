@@ -2,12 +2,49 @@
 #include <stdio.h>
 #include "hmproto.h"
 
-struct hm hms[4] =
+/* the optional ops (critnib-part.h, async.h), taken as void * like the rest */
+size_t critnib_part_insert_bulk(void *c, const uint64_t *key,
+    void *const *value, size_t n, int nthreads);
+void async_insert_async(void *c, uint64_t key, void *value);
+void async_flush(void *c);
+
+struct hm hms[35] =
 {
     HM_ARR(critbit, 2),
     HM_ARR(tcradix, 2),
+    HM_ARR(tcradix_fg, 2),
     HM_ARR(critnib, 0),
     HM_ARR(critnib_tag, 0),
+    HM_ARR_FROZEN(critnib_eytz, 1),
+    HM_ARR(critnib2, 0),
+    HM_ARR(critnib5, 0),
+    HM_ARR(critnib8, 0),
+    HM_ARR(cuckoo, 2),
+    HM_ARR(swiss, 2),
+    HM_ARR(splitorder, 2),
+    HM_ARR(dph, 2),
+    HM_ARR(dph_leak, 2),
+    HM_ARR(radix8, 4),
+    HM_ARR(radix11, 4),
+    HM_ARR(radix13, 4),
+    HM_ARR(radix16, 4),
+    HM_ARR(art, 0),
+    HM_ARR(hot, 0),
+    HM_ARR(btree, 0),
+    HM_ARR(btree_olc, 0),
+    HM_ARR(skiplist, 0),
+    HM_ARR(yfast, 0),
+    HM_ARR_FROZEN(learned, 1),
+    HM_ARR_FROZEN(mph, 3),
+    HM_ARR_FROZEN(eliasfano, 1),
+    HM_ARR(adaptive, 0),
+    HM_ARR_FROZEN(lsm, 0),
+    HM_ARR(nr, 0),
+    HM_ARR_BULK(critnib_part, 0),
+    HM_ARR(critnib_fc, 0),
+    HM_ARR(tcradix_fc, 2),
+    HM_ARR_ASYNC(async, 0),
+    HM_ARR(critnib_stripe, 0),
 };
 
 void hm_select(int i)
@@ -20,4 +57,8 @@ void hm_select(int i)
     hm_find_le	= hms[i].hm_find_le;
     hm_name	= hms[i].hm_name;
     hm_immutable= hms[i].hm_immutable;
+    hm_freeze	= hms[i].hm_freeze;
+    hm_insert_bulk	= hms[i].hm_insert_bulk;
+    hm_insert_async	= hms[i].hm_insert_async;
+    hm_flush	= hms[i].hm_flush;
 }
@@ -1,3 +1,4 @@
+#include <stddef.h>
 #include <stdint.h>
 
 #define HM_PROTOS(x) \
@@ -8,11 +9,45 @@
     void *x##_remove(void *c, uint64_t key);\
     void *x##_get(void *c, uint64_t key);\
     void *x##_find_le(void *c, uint64_t key);
+#define HM_PROTOS_FROZEN(x) \
+    HM_PROTOS(x)\
+    int x##_freeze(void *c);
 
 HM_PROTOS(critbit)
 HM_PROTOS(tcradix)
+HM_PROTOS(tcradix_fg)
 HM_PROTOS(critnib)
 HM_PROTOS(critnib_tag)
+HM_PROTOS_FROZEN(critnib_eytz)
+HM_PROTOS(critnib2)
+HM_PROTOS(critnib5)
+HM_PROTOS(critnib8)
+HM_PROTOS(cuckoo)
+HM_PROTOS(swiss)
+HM_PROTOS(splitorder)
+HM_PROTOS(dph)
+HM_PROTOS(dph_leak)
+HM_PROTOS(radix8)
+HM_PROTOS(radix11)
+HM_PROTOS(radix13)
+HM_PROTOS(radix16)
+HM_PROTOS(art)
+HM_PROTOS(hot)
+HM_PROTOS(btree)
+HM_PROTOS(btree_olc)
+HM_PROTOS(skiplist)
+HM_PROTOS(yfast)
+HM_PROTOS_FROZEN(learned)
+HM_PROTOS_FROZEN(mph)
+HM_PROTOS_FROZEN(eliasfano)
+HM_PROTOS(adaptive)
+HM_PROTOS_FROZEN(lsm)
+HM_PROTOS(nr)
+HM_PROTOS(critnib_part)
+HM_PROTOS(critnib_fc)
+HM_PROTOS(tcradix_fc)
+HM_PROTOS(async)
+HM_PROTOS(critnib_stripe)
 
 void *(*hm_new)(void);
 void (*hm_delete)(void *c);
@@ -22,6 +57,11 @@ void *(*hm_get)(void *c, uint64_t key);
 void *(*hm_find_le)(void *c, uint64_t key);
 const char *hm_name;
 int hm_immutable;
+int (*hm_freeze)(void *c);
+size_t (*hm_insert_bulk)(void *c, const uint64_t *key, void *const *value,
+    size_t n, int nthreads);
+void (*hm_insert_async)(void *c, uint64_t key, void *value);
+void (*hm_flush)(void *c);
 
 #define HM_SELECT_ONE(x,f) hm_##f=x##_##f
 #define HM_SELECT(x) \
@@ -31,10 +71,21 @@ int hm_immutable;
     HM_SELECT_ONE(x,remove);\
     HM_SELECT_ONE(x,get);\
     HM_SELECT_ONE(x,find_le);\
+    hm_freeze=0;\
+    hm_insert_bulk=0;\
+    hm_insert_async=0;\
+    hm_flush=0;\
     hm_name=#x
 
 #define HM_ARR(x,imm) { x##_new, x##_delete, x##_insert, x##_remove, x##_get, \
                         x##_find_le, #x, imm }
+#define HM_ARR_FROZEN(x,imm) { x##_new, x##_delete, x##_insert, x##_remove, \
+                        x##_get, x##_find_le, #x, imm, x##_freeze }
+#define HM_ARR_BULK(x,imm) { x##_new, x##_delete, x##_insert, x##_remove, \
+                        x##_get, x##_find_le, #x, imm, 0, x##_insert_bulk }
+#define HM_ARR_ASYNC(x,imm) { x##_new, x##_delete, x##_insert, x##_remove, \
+                        x##_get, x##_find_le, #x, imm, 0, 0, x##_insert_async, \
+                        x##_flush }
 struct hm
 {
     void *(*hm_new)(void);
@@ -44,7 +95,14 @@ struct hm
     void *(*hm_get)(void *c, uint64_t key);
     void *(*hm_find_le)(void *c, uint64_t key);
     const char *hm_name;
-    int hm_immutable;
-} hms[4];
+    int hm_immutable; /* 1: no writes after hm_freeze, 2: no find_le, 4: no sparse keys */
+    int (*hm_freeze)(void *c); /* optional: done with writes */
+    /* optional: many inserts at once, spread over nthreads (0: per CPU) */
+    size_t (*hm_insert_bulk)(void *c, const uint64_t *key, void *const *value,
+        size_t n, int nthreads);
+    /* optional: a queued insert, applied by the time hm_flush returns */
+    void (*hm_insert_async)(void *c, uint64_t key, void *value);
+    void (*hm_flush)(void *c);
+} hms[35];
 
 void hm_select(int i);
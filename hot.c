@@ -0,0 +1,655 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#ifdef __BMI2__
+# include <immintrin.h>
+#endif
+#include "util.h"
+
+/*
+ * Height Optimized Trie (Binna et al.): a binary Patricia trie cut into
+ * nodes of up to 32 entries each, no matter how many bits those entries
+ * span.  Fanout stays high for clustered keys too, where a fixed slice
+ * width (critnib, art) would waste levels on shared prefixes.
+ *
+ * A node keeps the set of bit positions its binary trie tests (mask), and
+ * for every entry a "sparse partial key": those bits of it that lie on its
+ * path, the rest 0.  A lookup extracts the mask's bits from the key (pext)
+ * and picks the last entry whose sparse key is a subset of that -- all 32
+ * compared at once.  Entries are leaves or child nodes, tagged by bit 0.
+ * Without BMI2 there's no fast pext: sparse keys then stay unpacked, 64
+ * bits each, the subset test works on the key as is, scanned backwards.
+ *
+ * A node that'd overflow is split by its root bit.  The halves go into the
+ * parent if that doesn't make it taller than needed, otherwise they get a
+ * new node of their own -- so height grows only where keys need it.
+ *
+ * Nodes are immutable once published, except for a child pointer being
+ * replaced by another node's: every write builds a new node (or a few) and
+ * swaps it in.  Writes take a mutex; readers are lock-free the critnib way
+ * (everything unlinked waits DELETED_LIFE further unlinks, readers that saw
+ * that many restart).  Nodes are pooled by entry count, so a stale node's
+ * count always matches its size.
+ */
+
+#define FUNC(x) hot_##x
+
+#define DELETED_LIFE 16
+#define MAXF 32
+/* every level tests lower bits than the one above, the root may have none */
+#define MAX_DEPTH 66
+
+#ifdef __BMI2__
+typedef uint32_t sparse_t;
+#else
+typedef uint64_t sparse_t;
+#endif
+
+struct hot_node
+{
+    uint64_t mask;
+    uint8_t count;
+    uint8_t height; /* 1 + the tallest child node */
+    uint8_t pad[6];
+    sparse_t sparse[]; /* padded to a multiple of 8, then the children */
+};
+
+struct hot_leaf
+{
+    uint64_t key;
+    void *value;
+};
+
+struct hot
+{
+    struct hot_node *root;
+    struct hot_node *deleted_node[MAXF + 1];
+    struct hot_leaf *deleted_leaf;
+    struct hot_node *pending_del_nodes[DELETED_LIFE];
+    struct hot_leaf *pending_del_leaves[DELETED_LIFE];
+    uint64_t remove_count;
+    pthread_mutex_t mutex;
+};
+
+/* a child and its key (for nodes: any key below) while building */
+struct hot_entry
+{
+    uint64_t key;
+    struct hot_node *ptr;
+};
+
+static inline int round8(int n)
+{
+    return (n + 7) & ~7;
+}
+
+static inline struct hot_node **children(const struct hot_node *n)
+{
+    return (struct hot_node **)&n->sparse[round8(n->count)];
+}
+
+static inline size_t node_size(int count)
+{
+    return sizeof(struct hot_node) + round8(count) * sizeof(sparse_t)
+         + count * sizeof(struct hot_node *);
+}
+
+static inline int is_leaf(struct hot_node *n)
+{
+    return (uint64_t)n & 1;
+}
+
+static inline struct hot_leaf *to_leaf(struct hot_node *n)
+{
+    return (void*)((uint64_t)n & ~1ULL);
+}
+
+static inline int topbit(uint64_t x)
+{
+    return 63 - __builtin_clzll(x | 1);
+}
+
+static inline void *load(void *src)
+{
+    return __atomic_load_n((void**)src, __ATOMIC_ACQUIRE);
+}
+
+static inline void store(void *dst, void *v)
+{
+    __atomic_store_n((void**)dst, v, __ATOMIC_RELEASE);
+}
+
+/* the key's bits at the mask's positions, packed if we can */
+static inline sparse_t extract(uint64_t key, uint64_t mask)
+{
+#ifdef __BMI2__
+    return _pext_u64(key, mask);
+#else
+    return key & mask;
+#endif
+}
+
+/* the entry whose path the key follows */
+static inline int search(const struct hot_node *restrict n, uint64_t key)
+{
+    sparse_t pk = extract(key, n->mask);
+#if defined(__AVX2__) && defined(__BMI2__)
+    uint32_t hits = 1; /* entry 0's sparse key is 0, it always matches */
+    __m256i k = _mm256_set1_epi32(pk);
+    for (int i=0; i<n->count; i+=8)
+    {
+        __m256i s = _mm256_loadu_si256((const __m256i*)&n->sparse[i]);
+        __m256i eq = _mm256_cmpeq_epi32(_mm256_and_si256(s, k), s);
+        hits |= (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(eq)) << i;
+    }
+    /* padding is ~0, which an unpacked key of ~0 would match */
+    return topbit(hits & (uint32_t)((2ULL << (n->count - 1)) - 1));
+#else
+    /* the last match wins, so scan backwards and stop at the first */
+    int i = n->count - 1;
+    while (i && (pk & n->sparse[i]) != n->sparse[i])
+        i--;
+    return i;
+#endif
+}
+
+/**************/
+/* allocation */
+/**************/
+
+static struct hot_node *alloc_node(struct hot *c, int count)
+{
+    struct hot_node *n = c->deleted_node[count];
+    if (n)
+        c->deleted_node[count] = *(struct hot_node**)n;
+    else if (!(n = Malloc(node_size(count))))
+        return 0;
+    n->count = count;
+    return n;
+}
+
+static void free_node(struct hot *c, struct hot_node *n)
+{
+    if (!n)
+        return;
+    *(struct hot_node**)n = c->deleted_node[n->count];
+    c->deleted_node[n->count] = n;
+}
+
+static struct hot_leaf *alloc_leaf(struct hot *c)
+{
+    struct hot_leaf *k = c->deleted_leaf;
+    if (!k)
+        return Malloc(sizeof(struct hot_leaf));
+    c->deleted_leaf = k->value;
+    return k;
+}
+
+static void free_leaf(struct hot *c, struct hot_leaf *k)
+{
+    if (!k)
+        return;
+    k->value = c->deleted_leaf;
+    c->deleted_leaf = k;
+}
+
+/*
+ * n is a node some rebuilt copy replaced, k a removed leaf; whatever they
+ * push out of the ring goes back to the pools by entry count.
+ */
+static void retire(struct hot *c, struct hot_node *n, struct hot_leaf *k)
+{
+    uint64_t del = util_fetch_and_add64(&c->remove_count, 1) % DELETED_LIFE;
+    free_node(c, c->pending_del_nodes[del]);
+    free_leaf(c, c->pending_del_leaves[del]);
+    c->pending_del_nodes[del] = n;
+    c->pending_del_leaves[del] = k;
+}
+
+struct hot *FUNC(new)(void)
+{
+    struct hot *c = Zalloc(sizeof(struct hot));
+    if (!c)
+        return 0;
+    pthread_mutex_init(&c->mutex, 0);
+    return c;
+}
+
+static void teardown(struct hot_node *n)
+{
+    if (is_leaf(n))
+    {
+        Free(to_leaf(n));
+        return;
+    }
+    for (int i=0; i<n->count; i++)
+        teardown(children(n)[i]);
+    Free(n);
+}
+
+void FUNC(delete)(struct hot *c)
+{
+    if (c->root)
+        teardown(c->root);
+    for (int i=0; i<=MAXF; i++)
+        for (struct hot_node *n = c->deleted_node[i], *nn; n; n = nn)
+        {
+            nn = *(struct hot_node**)n;
+            Free(n);
+        }
+    for (struct hot_leaf *k = c->deleted_leaf, *kk; k; k = kk)
+    {
+        kk = k->value;
+        Free(k);
+    }
+    for (int i=0; i<DELETED_LIFE; i++)
+    {
+        Free(c->pending_del_nodes[i]);
+        Free(c->pending_del_leaves[i]);
+    }
+    pthread_mutex_destroy(&c->mutex);
+    Free(c);
+}
+
+/************/
+/* building */
+/************/
+
+/* leftmost key below */
+static uint64_t any_key(struct hot_node *n)
+{
+    while (!is_leaf(n))
+        n = children(n)[0];
+    return to_leaf(n)->key;
+}
+
+static int entries(const struct hot_node *n, struct hot_entry *e)
+{
+    for (int i=0; i<n->count; i++)
+    {
+        e[i].ptr = children(n)[i];
+        e[i].key = any_key(e[i].ptr);
+    }
+    return n->count;
+}
+
+static void fill_sparse(struct hot_node *n, const struct hot_entry *e,
+                        int lo, int hi, sparse_t path)
+{
+    if (lo == hi)
+    {
+        n->sparse[lo] = extract(e[lo].key, n->mask) & path;
+        return;
+    }
+
+    /* the root of this subtrie tests the highest bit they differ at */
+    int b = topbit(e[lo].key ^ e[hi].key);
+    int s = lo + 1;
+    while (!(e[s].key >> b & 1))
+        s++;
+    path |= extract(1ULL << b, n->mask);
+    fill_sparse(n, e, lo, s - 1, path);
+    fill_sparse(n, e, s, hi, path);
+}
+
+/* a node out of sorted entries; not visible to anyone yet */
+static struct hot_node *build(struct hot *c, const struct hot_entry *e,
+                              int cnt)
+{
+    struct hot_node *n = alloc_node(c, cnt);
+    if (!n)
+        return 0;
+
+    /* adjacent keys differ right at the bit of the trie node between them */
+    uint64_t mask = 0;
+    for (int i=0; i<cnt-1; i++)
+        mask |= 1ULL << topbit(e[i].key ^ e[i+1].key);
+    n->mask = mask;
+
+    fill_sparse(n, e, 0, cnt - 1, 0);
+    for (int i=cnt; i<round8(cnt); i++)
+        n->sparse[i] = (sparse_t)~0ULL;
+
+    int h = 0;
+    for (int i=0; i<cnt; i++)
+    {
+        children(n)[i] = e[i].ptr;
+        if (!is_leaf(e[i].ptr) && e[i].ptr->height > h)
+            h = e[i].ptr->height;
+    }
+    n->height = h + 1;
+    return n;
+}
+
+static void link(struct hot *c, struct hot_node **path, int *idx, int t,
+                 struct hot_node *n)
+{
+    if (t)
+        store(&children(path[t-1])[idx[t-1]], n);
+    else
+        store(&c->root, n);
+}
+
+/* one entry stands for itself, more get a node */
+static int make_half(struct hot *c, const struct hot_entry *e, int cnt,
+                     struct hot_entry *h)
+{
+    if (cnt == 1)
+    {
+        *h = e[0];
+        return 0;
+    }
+    h->key = e[0].key;
+    return (h->ptr = build(c, e, cnt)) ? 0 : ENOMEM;
+}
+
+static inline int entry_height(const struct hot_entry *e)
+{
+    return is_leaf(e->ptr) ? 0 : e->ptr->height;
+}
+
+/*
+ * Put sorted entries e in place of path[t], retire the old node.  If they
+ * don't fit in one node, they're split by the root bit; the two halves
+ * go into the parent unless it's taller than they need, in which case
+ * (or at the root) they get a node of their own.
+ */
+static int replace(struct hot *c, struct hot_node **path, int *idx, int t,
+                   struct hot_entry *e, int cnt)
+{
+    struct hot_node *n;
+
+    if (cnt <= MAXF)
+    {
+        if (!(n = build(c, e, cnt)))
+            return ENOMEM;
+        link(c, path, idx, t, n);
+        retire(c, path[t], 0);
+        return 0;
+    }
+
+    int b = topbit(e[0].key ^ e[cnt-1].key);
+    int s = 1;
+    while (!(e[s].key >> b & 1))
+        s++;
+
+    struct hot_entry half[2];
+    if (make_half(c, e, s, &half[0]))
+        return ENOMEM;
+    if (make_half(c, e + s, cnt - s, &half[1]))
+    {
+        if (s > 1)
+            free_node(c, half[0].ptr);
+        return ENOMEM;
+    }
+
+    int h = entry_height(&half[0]);
+    if (entry_height(&half[1]) > h)
+        h = entry_height(&half[1]);
+
+    int ret;
+    if (!t || path[t-1]->height > h + 1)
+    {
+        if ((n = build(c, half, 2)))
+        {
+            link(c, path, idx, t, n);
+            retire(c, path[t], 0);
+            return 0;
+        }
+        ret = ENOMEM;
+    }
+    else
+    {
+        /* pull up: the parent gets both halves instead of us */
+        struct hot_entry pe[MAXF + 1];
+        int pc = entries(path[t-1], pe);
+        int j = idx[t-1];
+        memmove(&pe[j+2], &pe[j+1], (pc - j - 1) * sizeof(struct hot_entry));
+        pe[j] = half[0];
+        pe[j+1] = half[1];
+        if (!(ret = replace(c, path, idx, t - 1, pe, pc + 1)))
+        {
+            retire(c, path[t], 0);
+            return 0;
+        }
+    }
+
+    if (s > 1)
+        free_node(c, half[0].ptr);
+    if (cnt - s > 1)
+        free_node(c, half[1].ptr);
+    return ret;
+}
+
+/* walk to the leaf the key leads to, noting the path; root must exist */
+static int descend(struct hot_node *n, uint64_t key, struct hot_node **path,
+                   int *idx, struct hot_node **leaf)
+{
+    int d = 0;
+    do
+    {
+        path[d] = n;
+        idx[d] = search(n, key);
+        n = load(&children(n)[idx[d]]);
+    } while (++d < MAX_DEPTH && !is_leaf(n));
+    *leaf = n;
+    return d;
+}
+
+int FUNC(insert)(struct hot *c, uint64_t key, void *value)
+{
+    struct hot_node *path[MAX_DEPTH], *n;
+    int idx[MAX_DEPTH];
+    struct hot_entry e[MAXF + 1];
+
+    pthread_mutex_lock(&c->mutex);
+
+    struct hot_leaf *k = alloc_leaf(c);
+    if (!k)
+    {
+        pthread_mutex_unlock(&c->mutex);
+        return ENOMEM;
+    }
+    k->key = key;
+    k->value = value;
+    struct hot_entry ke = { key, (void*)((uint64_t)k | 1) };
+
+    if (!c->root)
+    {
+        if (!(n = build(c, &ke, 1)))
+        {
+            free_leaf(c, k);
+            pthread_mutex_unlock(&c->mutex);
+            return ENOMEM;
+        }
+        store(&c->root, n);
+        pthread_mutex_unlock(&c->mutex);
+        return 0;
+    }
+
+    int d = descend(c->root, key, path, idx, &n);
+    uint64_t other = to_leaf(n)->key;
+    if (other == key)
+    {
+        free_leaf(c, k);
+        pthread_mutex_unlock(&c->mutex);
+        return EEXIST;
+    }
+
+    /*
+     * The new key branches off at bit m: it goes into the topmost node
+     * whose child on the path (if a node) tests only bits below m.
+     */
+    int m = topbit(other ^ key);
+    int t = 0;
+    while (t < d - 1 && topbit(path[t+1]->mask) > m)
+        t++;
+
+    int cnt = entries(path[t], e);
+    int pos = 0;
+    while (pos < cnt && e[pos].key < key)
+        pos++;
+    memmove(&e[pos+1], &e[pos], (cnt - pos) * sizeof(struct hot_entry));
+    e[pos] = ke;
+
+    int ret = replace(c, path, idx, t, e, cnt + 1);
+    if (ret)
+        free_leaf(c, k);
+    pthread_mutex_unlock(&c->mutex);
+    return ret;
+}
+
+/*
+ * Rebuilds the leaf's node without it (or, down to one entry, the parent
+ * with that entry in the node's place); if the rebuilt node can't be
+ * allocated, returns NULL with the key still in.
+ */
+void *FUNC(remove)(struct hot *c, uint64_t key)
+{
+    struct hot_node *path[MAX_DEPTH], *n;
+    int idx[MAX_DEPTH];
+    struct hot_entry e[MAXF], pe[MAXF];
+    void *value = 0;
+
+    pthread_mutex_lock(&c->mutex);
+    if (!c->root)
+        goto out;
+
+    int d = descend(c->root, key, path, idx, &n);
+    struct hot_leaf *k = to_leaf(n);
+    if (k->key != key)
+        goto out;
+
+    struct hot_node *victim = path[d-1];
+    int cnt = entries(victim, e);
+    int i = idx[d-1];
+    memmove(&e[i], &e[i+1], (cnt - i - 1) * sizeof(struct hot_entry));
+    cnt--;
+
+    if (!cnt)
+    {
+        store(&c->root, 0);
+        retire(c, victim, 0);
+    }
+    else if (cnt == 1 && d > 1)
+    {
+        /* the node goes away, its other entry takes its place */
+        int pc = entries(path[d-2], pe);
+        pe[idx[d-2]] = e[0];
+        if (replace(c, path, idx, d - 2, pe, pc))
+            goto out;
+        retire(c, victim, 0);
+    }
+    else if (cnt == 1 && !is_leaf(e[0].ptr))
+    {
+        store(&c->root, e[0].ptr);
+        retire(c, victim, 0);
+    }
+    else if (replace(c, path, idx, d - 1, e, cnt))
+        goto out;
+
+    value = k->value;
+    retire(c, 0, k);
+out:
+    pthread_mutex_unlock(&c->mutex);
+    return value;
+}
+
+/*
+ * hot_get -- query for a key
+ *
+ * One extract-and-match per node.  Nodes it read are immutable but for
+ * child pointers, so only their reuse (remove_count) makes it restart.
+ */
+void *FUNC(get)(struct hot *c, uint64_t key)
+{
+    uint64_t wrs1, wrs2;
+    void *res;
+
+    do
+    {
+        wrs1 = __atomic_load_n(&c->remove_count, __ATOMIC_ACQUIRE);
+        struct hot_node *n = load(&c->root);
+        for (int d = 0; n && !is_leaf(n) && d < MAX_DEPTH; d++)
+            n = load(&children(n)[search(n, key)]);
+        res = (n && is_leaf(n) && to_leaf(n)->key == key)
+            ? to_leaf(n)->value : 0;
+        wrs2 = __atomic_load_n(&c->remove_count, __ATOMIC_ACQUIRE);
+    } while (wrs1 + DELETED_LIFE <= wrs2);
+
+    return res;
+}
+
+/* rightmost value in a subtree */
+static void *find_max(struct hot_node *n)
+{
+    for (int d = 0; !is_leaf(n) && d < MAX_DEPTH; d++)
+        n = load(&children(n)[n->count - 1]);
+    return is_leaf(n) ? to_leaf(n)->value : 0;
+}
+
+/*
+ * The leaf the key leads to tells at which bit m the key branches off;
+ * in the node that bit belongs to, the entries sharing the leaf's bits
+ * above m have the same sparse key bits above m.  The key is right above
+ * them or right below.
+ */
+static void *find_le(struct hot_node *root, uint64_t key)
+{
+    struct hot_node *path[MAX_DEPTH], *n;
+    int idx[MAX_DEPTH];
+
+    if (!root)
+        return 0;
+    int d = descend(root, key, path, idx, &n);
+    if (!is_leaf(n))
+        return 0; /* stale */
+    uint64_t other = to_leaf(n)->key;
+    if (other == key)
+        return to_leaf(n)->value;
+
+    int m = topbit(other ^ key);
+    int t = 0;
+    while (t < d - 1 && topbit(path[t+1]->mask) > m)
+        t++;
+
+    n = path[t];
+    int i = idx[t], j = i;
+    sparse_t above = extract(~0ULL << m << 1, n->mask);
+    if (key >> m & 1)
+    {
+        while (j + 1 < n->count && !((n->sparse[j+1] ^ n->sparse[i]) & above))
+            j++;
+        return find_max(load(&children(n)[j]));
+    }
+
+    while (j > 0 && !((n->sparse[j-1] ^ n->sparse[i]) & above))
+        j--;
+    if (j)
+        return find_max(load(&children(n)[j-1]));
+    /* the key is below everything in this subtree */
+    while (t--)
+        if (idx[t])
+            return find_max(load(&children(path[t])[idx[t]-1]));
+    return 0;
+}
+
+/*
+ * hot_find_le -- the value of the largest key <= the given one
+ */
+void *FUNC(find_le)(struct hot *c, uint64_t key)
+{
+    uint64_t wrs1, wrs2;
+    void *res;
+
+    do
+    {
+        wrs1 = __atomic_load_n(&c->remove_count, __ATOMIC_ACQUIRE);
+        res = find_le(load(&c->root), key);
+        wrs2 = __atomic_load_n(&c->remove_count, __ATOMIC_ACQUIRE);
+    } while (wrs1 + DELETED_LIFE <= wrs2);
+
+    return res;
+}
@@ -0,0 +1,266 @@
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "util.h"
+#include "frozen.h"
+#include "learned.h"
+
+/*
+ * Learned index (piecewise linear, after FITing-tree/RadixSpline): all
+ * keys in one sorted array, plus linear segments mapping a key to about
+ * where in the array it is.  Segments are cut greedily, each as long as
+ * some slope keeps every key in it within EPSILON positions of where the
+ * line says.  Finding the segment is a radix table on the key's top bits
+ * then a search among the few segments that share them; the last mile is
+ * a binary search of a window 2*err+2 keys wide, err being the worst miss
+ * actually measured over all keys.
+ *
+ * A key not in the set still lands within the window of its predecessor:
+ * the line is monotonic, so it can't be predicted left of a smaller key
+ * or right of a bigger one in the same segment, and the window is clamped
+ * to the segment.
+ *
+ * The engine (learned_*) is a critnib until hm_freeze (frozen.h).
+ */
+
+#define EPSILON 8
+/* radix table entries per segment, about */
+#define RADIX_PER_SEG 2
+
+struct learned_seg
+{
+    uint64_t key; /* the first one */
+    double slope;
+    uint64_t start; /* position of key */
+    uint64_t end; /* of the last key in this segment */
+};
+
+struct learned_index
+{
+    size_t n;
+    uint64_t err;
+    uint64_t min, max;
+    int shift;
+    uint64_t nseg;
+    uint32_t *radix; /* first segment with these top bits */
+    struct learned_seg *seg;
+    uint64_t *key;
+    void **value;
+};
+
+/* where the segment's line puts the key, within the segment */
+static inline uint64_t predict(const struct learned_seg *s, uint64_t key)
+{
+    double d = s->slope * (double)(key - s->key);
+    if (d >= (double)(s->end - s->start))
+        return s->end;
+    return s->start + (uint64_t)d;
+}
+
+/* the last segment whose first key is <= key (which is >= min) */
+static inline const struct learned_seg *find_seg(
+    const struct learned_index *l, uint64_t key)
+{
+    uint64_t p = (key - l->min) >> l->shift;
+    uint64_t lo = l->radix[p], n = l->radix[p + 1] - lo + 1;
+    if (lo)
+        lo--;
+    else
+        n--;
+    const struct learned_seg *s = &l->seg[lo];
+    while (n > 1)
+    {
+        uint64_t half = n / 2;
+        s = (s[half].key <= key) ? s + half : s;
+        n -= half;
+    }
+    return s;
+}
+
+/* index of the largest key <= the given one, which is in [min, max] */
+static inline uint64_t find_pos(const struct learned_index *l, uint64_t key)
+{
+    const struct learned_seg *s = find_seg(l, key);
+    uint64_t pos = predict(s, key);
+    uint64_t lo = (pos > s->start + l->err + 1) ? pos - l->err - 1 : s->start;
+    uint64_t hi = (pos + l->err < s->end) ? pos + l->err : s->end;
+
+    const uint64_t *k = &l->key[lo];
+    uint64_t n = hi - lo + 1;
+    while (n > 1)
+    {
+        uint64_t half = n / 2;
+        k = (k[half] <= key) ? k + half : k;
+        n -= half;
+    }
+    return k - l->key;
+}
+
+/* greedy: extend while some slope keeps every key within EPSILON */
+static uint64_t cut_segments(const uint64_t *key, size_t n,
+    struct learned_seg *seg)
+{
+    uint64_t nseg = 0;
+    for (size_t i = 0; i < n; )
+    {
+        double lo = 0, hi = INFINITY;
+        size_t j;
+        for (j = i + 1; j < n; j++)
+        {
+            double dx = (double)(key[j] - key[i]);
+            double dy = (double)(j - i);
+            double nlo = (dy - EPSILON) / dx, nhi = (dy + EPSILON) / dx;
+            if (nlo < lo)
+                nlo = lo;
+            if (nhi > hi)
+                nhi = hi;
+            if (nlo > nhi)
+                break;
+            lo = nlo;
+            hi = nhi;
+        }
+        seg[nseg].key = key[i];
+        seg[nseg].slope = (hi == INFINITY) ? 0 : (lo + hi) / 2;
+        seg[nseg].start = i;
+        seg[nseg].end = j - 1;
+        nseg++;
+        i = j;
+    }
+    return nseg;
+}
+
+/*
+ * learned_build -- build an index of sorted keys
+ *
+ * Returns NULL if out of memory, or (EINVAL) if the keys aren't sorted.
+ */
+struct learned_index *learned_build(const uint64_t *key, void *const *value,
+    size_t n)
+{
+    for (size_t i = 1; i < n; i++)
+        if (key[i - 1] >= key[i])
+        {
+            errno = EINVAL;
+            return 0;
+        }
+
+    struct learned_index *l = Zalloc(sizeof(struct learned_index));
+    if (!l)
+        return 0;
+    l->n = n;
+    if (!n)
+        return l;
+
+    if (!(l->key = Malloc(n * sizeof(uint64_t))))
+        goto fail;
+    if (!(l->value = Malloc(n * sizeof(void *))))
+        goto fail;
+    memcpy(l->key, key, n * sizeof(uint64_t));
+    memcpy(l->value, value, n * sizeof(void *));
+
+    struct learned_seg *seg = Malloc(n * sizeof(struct learned_seg));
+    if (!seg)
+        goto fail;
+    l->nseg = cut_segments(key, n, seg);
+    l->seg = Realloc(seg, l->nseg * sizeof(struct learned_seg));
+    if (!l->seg)
+    {
+        Free(seg);
+        goto fail;
+    }
+
+    /* enough top bits of key-min for RADIX_PER_SEG entries per segment */
+    l->min = key[0];
+    l->max = key[n - 1];
+    int bits = 64 - __builtin_clzll((l->max - l->min) | 1);
+    int want = 64 - __builtin_clzll(l->nseg * RADIX_PER_SEG);
+    l->shift = (bits > want) ? bits - want : 0;
+    uint64_t nradix = ((l->max - l->min) >> l->shift) + 1;
+    if (!(l->radix = Malloc((nradix + 1) * sizeof(uint32_t))))
+        goto fail;
+    uint64_t s = 0;
+    for (uint64_t p = 0; p <= nradix; p++)
+    {
+        while (s < l->nseg && ((l->seg[s].key - l->min) >> l->shift) < p)
+            s++;
+        l->radix[p] = s;
+    }
+
+    for (size_t i = 0; i < n; i++)
+    {
+        uint64_t pos = predict(find_seg(l, key[i]), key[i]);
+        uint64_t miss = (pos > i) ? pos - i : i - pos;
+        if (miss > l->err)
+            l->err = miss;
+    }
+
+    return l;
+
+fail:
+    learned_index_delete(l);
+    return 0;
+}
+
+void learned_index_delete(struct learned_index *l)
+{
+    Free(l->key);
+    Free(l->value);
+    Free(l->seg);
+    Free(l->radix);
+    Free(l);
+}
+
+/*
+ * learned_index_get -- query for a key
+ */
+void *learned_index_get(struct learned_index *l, uint64_t key)
+{
+    if (!l->n || key < l->min || key > l->max)
+        return 0;
+    uint64_t i = find_pos(l, key);
+    return (l->key[i] == key) ? l->value[i] : 0;
+}
+
+/*
+ * learned_index_find_le -- the value of the largest key <= the given one
+ */
+void *learned_index_find_le(struct learned_index *l, uint64_t key)
+{
+    if (!l->n || key < l->min)
+        return 0;
+    if (key >= l->max)
+        return l->value[l->n - 1];
+    return l->value[find_pos(l, key)];
+}
+
+/*
+ * learned_index_find_le_key -- like find_le, also telling the key found
+ */
+void *learned_index_find_le_key(struct learned_index *l, uint64_t key,
+    uint64_t *found)
+{
+    if (!l->n || key < l->min)
+        return 0;
+    uint64_t i = (key >= l->max) ? l->n - 1 : find_pos(l, key);
+    *found = l->key[i];
+    return l->value[i];
+}
+
+/*
+ * learned_index_sorted -- the keys and values, in order; returns how many
+ */
+size_t learned_index_sorted(struct learned_index *l, const uint64_t **key,
+    void *const **value)
+{
+    *key = l->key;
+    *value = l->value;
+    return l->n;
+}
+
+/**********/
+/* engine */
+/**********/
+
+FROZEN_ENGINE(learned, learned_index, learned_build, learned_index_get,
+    learned_index_find_le, learned_index_delete)
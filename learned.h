@@ -0,0 +1,25 @@
+/*
+ * learned.h -- a read-only learned index, built in bulk
+ */
+
+#ifndef LEARNED_H
+#define LEARNED_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct learned_index;
+
+/* keys sorted, no duplicates; both arrays get copied.  NULL if no memory */
+struct learned_index *learned_build(const uint64_t *key, void *const *value,
+    size_t n);
+void learned_index_delete(struct learned_index *l);
+
+void *learned_index_get(struct learned_index *l, uint64_t key);
+void *learned_index_find_le(struct learned_index *l, uint64_t key);
+void *learned_index_find_le_key(struct learned_index *l, uint64_t key,
+    uint64_t *found);
+size_t learned_index_sorted(struct learned_index *l, const uint64_t **key,
+    void *const **value);
+
+#endif
@@ -0,0 +1,611 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include "util.h"
+#include "critnib.h"
+#include "learned.h"
+
+/*
+ * Two layers, LSM style: writes go to a small critnib (the delta), reads
+ * look there first, then in a learned index (the base) that's rebuilt
+ * from both in the background once the delta grows to half of it.
+ *
+ * The delta maps a key to an entry {key, value}: a value of NULL is a
+ * tombstone, shadowing the key in the base.  An insert over a tombstone
+ * stores into it, so there's no moment the key falls through to a stale
+ * base.  A key that's in no older layer needs no tombstone: its entry is
+ * unlinked and pooled, reused after DELETED_LIFE such removes like
+ * critnib's leaves -- churn of short-lived keys doesn't grow the delta.
+ * Writers take a mutex: an insert has to know whether the key is in the
+ * base before it can say EEXIST.
+ *
+ * A rebuild first swaps in a fresh delta, the full one staying readable as
+ * "frozen" until its merge with the base is done; then a view without it
+ * replaces that.  A reader loads the current view (delta, frozen, base)
+ * inside a read generation, like critnib's inserts: a view swapped out
+ * goes, along with the layers only it had, to the limbo of the current
+ * generation, and back to malloc once no reader of that generation is
+ * left -- however long one sleeps in there.
+ *
+ * find_le takes the largest candidate of the three layers; a tombstone
+ * there means looking again below it.
+ */
+
+#define FUNC(x) lsm_##x
+
+#define DELETED_LIFE 16
+#define MIN_DELTA 4096
+
+struct lsm_entry
+{
+    uint64_t key;
+    void *value; /* NULL: removed */
+};
+
+/* layers a view swap unlinked */
+struct lsm_retired
+{
+    struct critnib *delta;
+    struct lsm_entry **entry; /* the delta's, no need to walk it again */
+    size_t nentry;
+    struct learned_index *base;
+};
+
+struct lsm_view
+{
+    struct critnib *delta;
+    struct critnib *frozen; /* being merged into base */
+    struct learned_index *base;
+
+    /* once swapped out: what went with it, and the next one in limbo */
+    struct lsm_retired gone;
+    struct lsm_view *next;
+};
+
+struct lsm
+{
+    struct lsm_view *view;
+    uint64_t remove_count;
+
+    /* read generation, and number of reads running in each */
+    uint64_t read_gen;
+    uint64_t read_active[2];
+    struct lsm_view *limbo[2]; /* swapped out, maybe still read */
+    struct lsm_entry *pending_del[DELETED_LIFE];
+    struct lsm_entry *deleted_entry; /* pool, next at value */
+
+    pthread_mutex_t mutex; /* writes */
+    size_t ndelta; /* entries in view->delta */
+    size_t nfrozen;
+    size_t nbase;
+    int rebuilding;
+    int rebuilder_started;
+    pthread_t rebuilder;
+};
+
+static inline void load(void *src, void *dst)
+{
+    __atomic_load((uint64_t *)src, (uint64_t *)dst, __ATOMIC_ACQUIRE);
+}
+
+static inline void store(void *dst, void *src)
+{
+    __atomic_store_n((uint64_t *)dst, (uint64_t)src, __ATOMIC_RELEASE);
+}
+
+/* a delta and all of its entries */
+static void delta_delete(struct critnib *d)
+{
+    size_t n = critnib_count(d);
+    void **e = Malloc((n + 1) * sizeof(void *));
+    uint64_t *k = Malloc((n + 1) * sizeof(uint64_t));
+    if (e && k)
+    {
+        critnib_sorted(d, k, e);
+        for (size_t i = 0; i < n; i++)
+            Free(e[i]);
+    }
+    Free(e);
+    Free(k);
+    critnib_delete(d);
+}
+
+static void retired_free(struct lsm_retired *r)
+{
+    for (size_t i = 0; i < r->nentry; i++)
+        Free(r->entry[i]);
+    Free(r->entry);
+    if (r->delta)
+        critnib_delete(r->delta);
+    if (r->base)
+        learned_index_delete(r->base);
+}
+
+static void limbo_free(struct lsm_view *v)
+{
+    while (v)
+    {
+        struct lsm_view *next = v->next;
+        retired_free(&v->gone);
+        Free(v);
+        v = next;
+    }
+}
+
+/* register a running read, return its generation */
+static inline uint64_t read_enter(struct lsm *t)
+{
+    uint64_t gen, gen2;
+    while (1)
+    {
+        load(&t->read_gen, &gen);
+        util_fetch_and_add64(&t->read_active[gen & 1], 1);
+        load(&t->read_gen, &gen2);
+        if (gen == gen2)
+            return gen;
+        util_fetch_and_sub64(&t->read_active[gen & 1], 1);
+    }
+}
+
+static inline void read_leave(struct lsm *t, uint64_t gen)
+{
+    util_fetch_and_sub64(&t->read_active[gen & 1], 1);
+}
+
+/*
+ * under the mutex: publish a new view; the old one, and what only it had
+ * (r, may be NULL), go to the limbo -- and the previous generation's limbo
+ * to malloc, if its reads are all done
+ */
+static void swap_view(struct lsm *t, struct lsm_view *v,
+                      const struct lsm_retired *r)
+{
+    struct lsm_view *old = t->view;
+    store(&t->view, v);
+    if (r)
+        old->gone = *r;
+
+    uint64_t gen = t->read_gen;
+    uint64_t active;
+    load(&t->read_active[(gen + 1) & 1], &active);
+    if (!active)
+    {
+        limbo_free(t->limbo[(gen + 1) & 1]);
+        t->limbo[(gen + 1) & 1] = 0;
+        util_fetch_and_add64(&t->read_gen, 1);
+        gen++;
+    }
+    old->next = t->limbo[gen & 1];
+    t->limbo[gen & 1] = old;
+}
+
+static struct lsm_entry *alloc_entry(struct lsm *t, uint64_t key,
+                                     void *value)
+{
+    struct lsm_entry *e = t->deleted_entry;
+    if (e)
+        t->deleted_entry = e->value;
+    else if (!(e = Malloc(sizeof(struct lsm_entry))))
+        return 0;
+    e->key = key;
+    e->value = value;
+    return e;
+}
+
+/* an entry unlinked from the delta, reused DELETED_LIFE removes later */
+static void retire_entry(struct lsm *t, struct lsm_entry *e)
+{
+    uint64_t del = util_fetch_and_add64(&t->remove_count, 1) % DELETED_LIFE;
+    struct lsm_entry *old = t->pending_del[del];
+    if (old)
+    {
+        old->value = t->deleted_entry;
+        t->deleted_entry = old;
+    }
+    t->pending_del[del] = e;
+}
+
+struct lsm *FUNC(new)(void)
+{
+    struct lsm *t = Zalloc(sizeof(struct lsm));
+    if (!t)
+        return 0;
+    if (!(t->view = Zalloc(sizeof(struct lsm_view))))
+        goto fail;
+    if (!(t->view->delta = critnib_new()))
+        goto fail;
+    if (!(t->view->base = learned_build(0, 0, 0)))
+        goto fail;
+    pthread_mutex_init(&t->mutex, 0);
+    return t;
+
+fail:
+    if (t->view && t->view->delta)
+        critnib_delete(t->view->delta);
+    Free(t->view);
+    Free(t);
+    return 0;
+}
+
+static void wait_rebuild(struct lsm *t)
+{
+    if (t->rebuilder_started)
+    {
+        pthread_join(t->rebuilder, 0);
+        t->rebuilder_started = 0;
+    }
+}
+
+void FUNC(delete)(struct lsm *t)
+{
+    wait_rebuild(t);
+    pthread_mutex_destroy(&t->mutex);
+    for (int i = 0; i < 2; i++)
+        limbo_free(t->limbo[i]);
+    for (int i = 0; i < DELETED_LIFE; i++)
+        Free(t->pending_del[i]);
+    for (struct lsm_entry *e = t->deleted_entry; e; )
+    {
+        struct lsm_entry *next = e->value;
+        Free(e);
+        e = next;
+    }
+    delta_delete(t->view->delta);
+    if (t->view->frozen)
+        delta_delete(t->view->frozen);
+    learned_index_delete(t->view->base);
+    Free(t->view);
+    Free(t);
+}
+
+/* base + frozen delta (nf entries) -> a new base; *ent gets the entries */
+static struct learned_index *merge(struct learned_index *base,
+                                   struct critnib *frozen, size_t nf,
+                                   struct lsm_entry ***ent)
+{
+    const uint64_t *bk;
+    void *const *bv;
+    size_t nb = learned_index_sorted(base, &bk, &bv);
+
+    struct learned_index *l = 0;
+    uint64_t *fk = Malloc((nf + 1) * sizeof(uint64_t));
+    struct lsm_entry **fe = Malloc((nf + 1) * sizeof(void *));
+    uint64_t *key = Malloc((nb + nf + 1) * sizeof(uint64_t));
+    void **value = Malloc((nb + nf + 1) * sizeof(void *));
+    if (!fk || !fe || !key || !value)
+        goto out;
+    critnib_sorted(frozen, fk, (void **)fe);
+
+    size_t n = 0, i = 0, j = 0;
+    while (i < nb || j < nf)
+    {
+        if (j == nf || (i < nb && bk[i] < fk[j]))
+        {
+            key[n] = bk[i];
+            value[n++] = bv[i++];
+            continue;
+        }
+        if (i < nb && bk[i] == fk[j])
+            i++;
+        if (fe[j]->value)
+        {
+            key[n] = fk[j];
+            value[n++] = fe[j]->value;
+        }
+        j++;
+    }
+    if ((l = learned_build(key, value, n)))
+    {
+        *ent = fe;
+        fe = 0;
+    }
+
+out:
+    Free(fk);
+    Free(fe);
+    Free(key);
+    Free(value);
+    return l;
+}
+
+/* the merge: done by a thread of its own, or inline by freeze */
+static void *rebuild(void *arg)
+{
+    struct lsm *t = arg;
+    struct lsm_view *v = t->view; /* only we replace it now */
+    struct lsm_retired r = { .delta = v->frozen, .nentry = t->nfrozen,
+                             .base = v->base };
+    struct learned_index *base = merge(v->base, v->frozen, t->nfrozen,
+                                       &r.entry);
+
+    pthread_mutex_lock(&t->mutex);
+    struct lsm_view *nv = base ? Zalloc(sizeof(struct lsm_view)) : 0;
+    if (nv)
+    {
+        nv->delta = t->view->delta;
+        nv->frozen = 0;
+        nv->base = base;
+        const uint64_t *k;
+        void *const *val;
+        t->nbase = learned_index_sorted(base, &k, &val);
+        swap_view(t, nv, &r);
+    }
+    else if (base)
+    {
+        learned_index_delete(base);
+        Free(r.entry);
+    }
+    /* out of memory: the frozen delta stays, to be merged next time */
+    t->rebuilding = 0;
+    pthread_mutex_unlock(&t->mutex);
+    return 0;
+}
+
+/* under the mutex: swap in an empty delta, the full one to be merged */
+static int start_rebuild(struct lsm *t)
+{
+    struct lsm_view *v = t->view;
+    if (v->frozen) /* a failed rebuild left it: try again */
+    {
+        t->rebuilding = 1;
+        return 0;
+    }
+
+    struct lsm_view *nv = Zalloc(sizeof(struct lsm_view));
+    if (!nv)
+        return ENOMEM;
+    if (!(nv->delta = critnib_new()))
+    {
+        Free(nv);
+        return ENOMEM;
+    }
+    nv->frozen = v->delta;
+    nv->base = v->base;
+    swap_view(t, nv, 0);
+    t->nfrozen = t->ndelta;
+    t->ndelta = 0;
+    t->rebuilding = 1;
+    return 0;
+}
+
+static void maybe_rebuild(struct lsm *t)
+{
+    if (t->rebuilding || t->ndelta < MIN_DELTA || t->ndelta < t->nbase / 2)
+        return;
+    wait_rebuild(t); /* it's done, or about to return */
+    if (start_rebuild(t))
+        return;
+    if (!pthread_create(&t->rebuilder, 0, rebuild, t))
+        t->rebuilder_started = 1;
+    else
+        t->rebuilding = 0; /* merged next time */
+}
+
+/*
+ * freeze -- merge everything into the base
+ *
+ * Writes are still allowed afterwards; they'll go to a delta again.
+ */
+int FUNC(freeze)(struct lsm *t)
+{
+    pthread_mutex_lock(&t->mutex);
+    while (t->rebuilding)
+    {
+        pthread_mutex_unlock(&t->mutex);
+        sched_yield();
+        pthread_mutex_lock(&t->mutex);
+    }
+    wait_rebuild(t);
+    if (!t->ndelta && !t->view->frozen)
+    {
+        pthread_mutex_unlock(&t->mutex);
+        return 0;
+    }
+    int ret = start_rebuild(t);
+    pthread_mutex_unlock(&t->mutex);
+    if (ret)
+        return ret;
+
+    rebuild(t);
+    return t->view->frozen ? ENOMEM : 0;
+}
+
+/* a layer's say on a key: the entry, or NULL if it has none */
+static inline struct lsm_entry *delta_get(struct critnib *d, uint64_t key)
+{
+    return d ? critnib_get(d, key) : 0;
+}
+
+/* what's below the delta */
+static void *get_older(struct lsm_view *v, uint64_t key)
+{
+    struct lsm_entry *e;
+    if ((e = delta_get(v->frozen, key)))
+        return e->value;
+    return learned_index_get(v->base, key);
+}
+
+static void *get(struct lsm_view *v, uint64_t key, struct lsm_entry **ent)
+{
+    struct lsm_entry *e;
+    void *val;
+    if ((e = delta_get(v->delta, key)))
+    {
+        *ent = e;
+        load(&e->value, &val);
+        return val;
+    }
+    *ent = 0;
+    return get_older(v, key);
+}
+
+/*
+ * insert -- write a key:value (both non-zero) pair
+ *
+ * Returns:
+ *  • 0 on success
+ *  • EEXIST if such a key already exists
+ *  • ENOMEM if we're out of memory
+ */
+int FUNC(insert)(struct lsm *t, uint64_t key, void *value)
+{
+    int ret = 0;
+    pthread_mutex_lock(&t->mutex);
+
+    struct lsm_entry *e;
+    if (get(t->view, key, &e))
+        ret = EEXIST;
+    else if (e)
+        store(&e->value, value);
+    else if (!(e = alloc_entry(t, key, value)))
+        ret = ENOMEM;
+    else if ((ret = critnib_insert(t->view->delta, key, e)))
+    {
+        e->value = t->deleted_entry;
+        t->deleted_entry = e;
+    }
+    else
+    {
+        t->ndelta++;
+        maybe_rebuild(t);
+    }
+
+    pthread_mutex_unlock(&t->mutex);
+    return ret;
+}
+
+/*
+ * remove -- delete a key from the map, returning its value
+ *
+ * Returns the value, or NULL if not found.
+ */
+void *FUNC(remove)(struct lsm *t, uint64_t key)
+{
+    pthread_mutex_lock(&t->mutex);
+
+    struct lsm_entry *e;
+    void *value = get(t->view, key, &e);
+    if (!value)
+        ;
+    else if (e && !get_older(t->view, key))
+    {
+        critnib_remove(t->view->delta, key);
+        retire_entry(t, e);
+        t->ndelta--;
+    }
+    else if (e)
+        store(&e->value, 0);
+    else if (!(e = alloc_entry(t, key, 0)))
+        value = 0; /* can't remove without a tombstone */
+    else if (critnib_insert(t->view->delta, key, e))
+    {
+        e->value = t->deleted_entry;
+        t->deleted_entry = e;
+        value = 0;
+    }
+    else
+    {
+        t->ndelta++;
+        maybe_rebuild(t);
+    }
+
+    pthread_mutex_unlock(&t->mutex);
+    return value;
+}
+
+/* a read that took too long to be sure the entries it saw were valid */
+static inline int stale(struct lsm *t, uint64_t wrs1)
+{
+    uint64_t wrs2;
+    load(&t->remove_count, &wrs2);
+    return wrs1 + DELETED_LIFE <= wrs2;
+}
+
+/*
+ * get -- query for a key
+ *
+ * Lock-free: the view is loaded once inside a read generation, the remove
+ * count checked like critnib's.
+ */
+void *FUNC(get)(struct lsm *t, uint64_t key)
+{
+    uint64_t wrs1;
+    void *res;
+    uint64_t gen = read_enter(t);
+
+    do
+    {
+        struct lsm_view *v;
+        struct lsm_entry *e;
+        load(&t->remove_count, &wrs1);
+        load(&t->view, &v);
+        res = get(v, key, &e);
+    } while (stale(t, wrs1));
+
+    read_leave(t, gen);
+    return res;
+}
+
+/* a delta's largest entry <= key, or NULL */
+static inline struct lsm_entry *delta_le(struct critnib *d, uint64_t key)
+{
+    return d ? critnib_find_le(d, key) : 0;
+}
+
+static void *find_le(struct lsm_view *v, uint64_t key)
+{
+    while (1)
+    {
+        struct lsm_entry *d = delta_le(v->delta, key);
+        struct lsm_entry *f = delta_le(v->frozen, key);
+        uint64_t bk;
+        void *b = learned_index_find_le_key(v->base, key, &bk);
+
+        /* newer layers win a tie */
+        void *val;
+        uint64_t k;
+        if (d && (!f || d->key >= f->key) && (!b || d->key >= bk))
+        {
+            k = d->key;
+            load(&d->value, &val);
+        }
+        else if (f && (!b || f->key >= bk))
+        {
+            k = f->key;
+            val = f->value;
+        }
+        else if (b)
+            return b;
+        else
+            return 0;
+
+        if (val)
+            return val;
+        if (!k || k > key) /* k > key: an entry reused under us */
+            return 0;
+        key = k - 1; /* a tombstone: look below */
+    }
+}
+
+/*
+ * find_le -- query for a key, returning the value of the largest one <= it
+ */
+void *FUNC(find_le)(struct lsm *t, uint64_t key)
+{
+    uint64_t wrs1;
+    void *res;
+    uint64_t gen = read_enter(t);
+
+    do
+    {
+        struct lsm_view *v;
+        load(&t->remove_count, &wrs1);
+        load(&t->view, &v);
+        res = find_le(v, key);
+    } while (stale(t, wrs1));
+
+    read_leave(t, gen);
+    return res;
+}
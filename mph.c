@@ -0,0 +1,250 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "util.h"
+#include "frozen.h"
+#include "mph.h"
+
+/*
+ * Minimal perfect hash (BBHash, Limasset et al.): a cascade of bit arrays.
+ * Every key is hashed into level 0, GAMMA bits per key; a bit hit by
+ * exactly one key is set, keys that collided go on to level 1 (again GAMMA
+ * bits for each of them), and so on.  A key's index is the number of set
+ * bits before its own, over all levels: 0..n-1 with no gaps.  The few
+ * keys that keep colliding for MAX_LEVELS levels go to a sorted array.
+ *
+ * Bits come in cachelines of 448, with a running count of the set ones
+ * before, so a level costs one cacheline however far its rank is.  ~60%
+ * of keys stop at level 0, on average 1.6 levels are read; the bits take
+ * ~3.7 per key.  The entries sit at their index as key+value, so a get
+ * ends with a single random access that also tells keys not in the set
+ * (which would otherwise get some other key's value) away.
+ *
+ * The engine (mph_*) is a critnib until hm_freeze (frozen.h).
+ */
+
+#define GAMMA 2
+#define MAX_LEVELS 32
+#define BLOCK_BITS 448
+
+struct mph_block
+{
+    uint64_t rank; /* set bits in all blocks before */
+    uint64_t bits[BLOCK_BITS / 64];
+} __attribute__((aligned(64)));
+
+struct mph_level
+{
+    uint64_t first; /* block */
+    uint64_t size; /* in bits */
+};
+
+struct mph_entry
+{
+    uint64_t key;
+    void *value;
+};
+
+struct mph_index
+{
+    size_t n;
+    int nlevels;
+    struct mph_level level[MAX_LEVELS];
+    struct mph_block *block;
+    struct mph_entry *entry;
+    size_t nfallback; /* the last ones, sorted */
+};
+
+/* murmur3's finalizer, salted per level */
+static inline uint64_t hash(uint64_t key, int level)
+{
+    return util_hash64(key + (level + 1) * 0x9e3779b97f4a7c15ULL);
+}
+
+/* the key's bit in a level */
+static inline uint64_t slot(uint64_t key, int level, uint64_t size)
+{
+    return (unsigned __int128)hash(key, level) * size >> 64;
+}
+
+static inline int test_bit(const uint64_t *bits, uint64_t b)
+{
+    return bits[b / 64] >> (b % 64) & 1;
+}
+
+static inline void set_bit(uint64_t *bits, uint64_t b)
+{
+    bits[b / 64] |= 1ULL << (b % 64);
+}
+
+/* index among all keys, or n if not in any level */
+static inline size_t lookup(const struct mph_index *m, uint64_t key)
+{
+    for (int l = 0; l < m->nlevels; l++)
+    {
+        uint64_t b = slot(key, l, m->level[l].size);
+        const struct mph_block *bl = &m->block[m->level[l].first
+            + b / BLOCK_BITS];
+        b %= BLOCK_BITS;
+        int w = b / 64;
+        uint64_t mask = 1ULL << (b % 64);
+        if (!(bl->bits[w] & mask))
+            continue;
+
+        uint64_t r = bl->rank
+            + __builtin_popcountll(bl->bits[w] & (mask - 1));
+        for (int i = 0; i < w; i++)
+            r += __builtin_popcountll(bl->bits[i]);
+        return r;
+    }
+    return m->n;
+}
+
+static int cmp_entry(const void *a, const void *b)
+{
+    uint64_t x = ((const struct mph_entry *)a)->key;
+    uint64_t y = ((const struct mph_entry *)b)->key;
+    return (x > y) - (x < y);
+}
+
+/*
+ * mph_build -- build a minimal perfect hash of a key set
+ *
+ * Returns NULL if out of memory.
+ */
+struct mph_index *mph_build(const uint64_t *key, void *const *value,
+    size_t n)
+{
+    struct mph_index *m = Zalloc(sizeof(struct mph_index));
+    if (!m)
+        return 0;
+    m->n = n;
+
+    uint64_t *left = Malloc((n + 1) * sizeof(uint64_t));
+    uint64_t *seen = 0, *coll = 0;
+    if (!left || !(m->entry = Malloc((n + 1) * sizeof(struct mph_entry))))
+        goto fail;
+    memcpy(left, key, n * sizeof(uint64_t));
+
+    size_t nleft = n;
+    uint64_t nblocks = 0;
+    for (int l = 0; nleft && l < MAX_LEVELS; l++)
+    {
+        uint64_t nb = (nleft * GAMMA + BLOCK_BITS - 1) / BLOCK_BITS;
+        uint64_t size = nb * BLOCK_BITS;
+        if (!(seen = Zalloc(size / 8)))
+            goto fail;
+        if (!(coll = Zalloc(size / 8)))
+            goto fail;
+        for (size_t i = 0; i < nleft; i++)
+        {
+            uint64_t b = slot(left[i], l, size);
+            if (test_bit(seen, b))
+                set_bit(coll, b);
+            set_bit(seen, b);
+        }
+
+        /* aligned, or a block would straddle two cachelines */
+        struct mph_block *bl;
+        if (posix_memalign((void**)&bl, CACHELINE_SIZE,
+                           (nblocks + nb) * sizeof(struct mph_block)))
+            goto fail;
+        if (nblocks)
+            memcpy(bl, m->block, nblocks * sizeof(struct mph_block));
+        free(m->block);
+        m->block = bl;
+        for (uint64_t i = 0; i < nb; i++)
+            for (int w = 0; w < BLOCK_BITS / 64; w++)
+            {
+                uint64_t j = i * (BLOCK_BITS / 64) + w;
+                bl[nblocks + i].bits[w] = seen[j] & ~coll[j];
+            }
+        m->level[l].first = nblocks;
+        m->level[l].size = size;
+        m->nlevels = l + 1;
+        nblocks += nb;
+
+        size_t k = 0;
+        for (size_t i = 0; i < nleft; i++)
+            if (test_bit(coll, slot(left[i], l, size)))
+                left[k++] = left[i];
+        nleft = k;
+        Free(seen);
+        Free(coll);
+        seen = coll = 0;
+    }
+
+    uint64_t rank = 0;
+    for (uint64_t i = 0; i < nblocks; i++)
+    {
+        m->block[i].rank = rank;
+        for (int w = 0; w < BLOCK_BITS / 64; w++)
+            rank += __builtin_popcountll(m->block[i].bits[w]);
+    }
+
+    /* the leftovers go last, sorted */
+    m->nfallback = nleft;
+    for (size_t i = 0, f = n - nleft; i < n; i++)
+    {
+        size_t j = lookup(m, key[i]);
+        if (j == n)
+            j = f++;
+        m->entry[j].key = key[i];
+        m->entry[j].value = value[i];
+    }
+    qsort(&m->entry[n - nleft], nleft, sizeof(struct mph_entry), cmp_entry);
+
+    Free(left);
+    return m;
+
+fail:
+    Free(left);
+    Free(seen);
+    Free(coll);
+    mph_index_delete(m);
+    return 0;
+}
+
+void mph_index_delete(struct mph_index *m)
+{
+    free(m->block);
+    Free(m->entry);
+    Free(m);
+}
+
+/*
+ * mph_index_get -- query for a key
+ */
+void *mph_index_get(struct mph_index *m, uint64_t key)
+{
+    size_t i = lookup(m, key);
+    if (i == m->n)
+    {
+        size_t lo = m->n - m->nfallback, hi = m->n;
+        while (lo < hi)
+        {
+            size_t mid = (lo + hi) / 2;
+            if (m->entry[mid].key < key)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        i = lo;
+        if (i == m->n)
+            return 0;
+    }
+    return (m->entry[i].key == key) ? m->entry[i].value : 0;
+}
+
+/**********/
+/* engine */
+/**********/
+
+/* a hash keeps no order (hms[] flags it as such) */
+static void *mph_index_find_le(struct mph_index *m, uint64_t key)
+{
+    return 0;
+}
+
+FROZEN_ENGINE(mph, mph_index, mph_build, mph_index_get,
+    mph_index_find_le, mph_index_delete)
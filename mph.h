@@ -0,0 +1,20 @@
+/*
+ * mph.h -- a read-only minimal perfect hash, built in bulk
+ */
+
+#ifndef MPH_H
+#define MPH_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct mph_index;
+
+/* keys in any order, no duplicates; both get copied.  NULL if no memory */
+struct mph_index *mph_build(const uint64_t *key, void *const *value,
+    size_t n);
+void mph_index_delete(struct mph_index *m);
+
+void *mph_index_get(struct mph_index *m, uint64_t key);
+
+#endif
@@ -0,0 +1,370 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "util.h"
+#include "hmproto.h"
+#include "nr.h"
+
+/*
+ * Node replication (Calciu et al., "Black-box Concurrent Data Structures
+ * for NUMA Architectures"): a copy of the map per group of CPUs -- a
+ * socket, ideally -- kept in sync through a shared log of writes.  Reads
+ * touch only their group's copy, so node cachelines and the inner engine's
+ * own counters (critnib's remove_count) stay local; the only shared line a
+ * read loads is the log's completed tail, written once per write.
+ *
+ * A write publishes its op in a free slot of its replica, then waits for
+ * it to be done -- or, if it gets the replica's lock, becomes the combiner:
+ * it takes every op pending in the slots, claims that many log entries
+ * with one CAS on the log tail (done only once their previous lap has
+ * been applied by every replica), fills them, then brings its replica up
+ * to and including them, handing each op the result it got there.  So a
+ * burst of writes from one group costs one lock handoff, one shared-tail
+ * CAS and one pass over a warm replica.  Every replica applies the same
+ * ops in the same order, so they all agree.  Replicas without writers of
+ * their own catch up when read, or when the log is full and a combiner
+ * helps them along.
+ *
+ * A read first notes the completed tail (ops that have returned); if its
+ * replica is behind that, it brings it up to date (or waits for whoever
+ * holds the lock to), then reads the inner engine as usual.  The inner
+ * engine sees a single writer per replica and concurrent readers, which
+ * every engine here supports.
+ *
+ * Replicas are picked by sched_getcpu(): CPUs split into NR_REPLICAS
+ * contiguous ranges, one per replica -- that's sockets on the usual
+ * numbering; with more replicas than sockets it's cores sharing a cache.
+ * Built with a critnib inside as the `nr` engine; nr_new_of() (nr.h) takes
+ * any engine and count.  (The hm entry points take void *: this file
+ * needs hmproto.h for struct hm, and with it their prototypes.)
+ */
+
+#define FUNC(x) nr_##x
+
+#ifndef NR_REPLICAS
+# define NR_REPLICAS 2
+#endif
+#define NR_INNER "critnib"
+
+#define LOG_SIZE (1 << 14)
+#define NR_SLOTS 32 /* ops a replica's writers can have pending */
+
+enum { OP_INSERT, OP_REMOVE };
+enum { SLOT_FREE, SLOT_FILLING, SLOT_PENDING, SLOT_DONE };
+
+struct nr_entry
+{
+    uint64_t key;
+    void *value;
+    uint64_t lap_op; /* (lap+1)*2 + op, once filled */
+};
+
+struct nr_slot
+{
+    uint64_t key;
+    void *value;
+    void *res;
+    int op;
+    int ret;
+    int state;
+    char pad[28];
+};
+
+struct nr_replica
+{
+    struct nr_slot slot[NR_SLOTS];
+    void *map;
+    uint64_t local_tail; /* log entries applied */
+    pthread_mutex_t lock;
+    char pad[64];
+};
+
+struct nr
+{
+    const struct hm *inner;
+    int nrep;
+    int ncpu;
+    struct nr_replica *rep;
+    struct nr_entry *log;
+
+    uint64_t pad1[8];
+    uint64_t log_tail; /* claimed */
+    uint64_t pad2[7];
+    uint64_t completed_tail; /* returned */
+    uint64_t pad3[7];
+};
+
+static inline uint64_t load64(uint64_t *x)
+{
+    return __atomic_load_n(x, __ATOMIC_ACQUIRE);
+}
+
+struct nr *nr_new_of(const struct hm *inner, int replicas)
+{
+    struct nr *r = Zalloc(sizeof(struct nr));
+    if (!r)
+        return 0;
+    r->inner = inner;
+    r->nrep = (replicas > 0) ? replicas : 1;
+    r->ncpu = sysconf(_SC_NPROCESSORS_CONF);
+    if (r->ncpu < 1)
+        r->ncpu = 1;
+
+    if (!(r->log = Zalloc(LOG_SIZE * sizeof(struct nr_entry))))
+        goto fail;
+    if (!(r->rep = Zalloc(r->nrep * sizeof(struct nr_replica))))
+        goto fail;
+    for (int i = 0; i < r->nrep; i++)
+    {
+        if (!(r->rep[i].map = inner->hm_new()))
+            goto fail;
+        pthread_mutex_init(&r->rep[i].lock, 0);
+    }
+    return r;
+
+fail:
+    if (r->rep)
+        for (int i = 0; i < r->nrep && r->rep[i].map; i++)
+            inner->hm_delete(r->rep[i].map);
+    Free(r->rep);
+    Free(r->log);
+    Free(r);
+    return 0;
+}
+
+void *FUNC(new)(void)
+{
+    for (size_t i = 0; i < sizeof(hms) / sizeof(hms[0]); i++)
+        if (hms[i].hm_name && !strcmp(hms[i].hm_name, NR_INNER))
+            return nr_new_of(&hms[i], NR_REPLICAS);
+    return 0;
+}
+
+void FUNC(delete)(void *c)
+{
+    struct nr *r = c;
+    for (int i = 0; i < r->nrep; i++)
+    {
+        r->inner->hm_delete(r->rep[i].map);
+        pthread_mutex_destroy(&r->rep[i].lock);
+    }
+    Free(r->rep);
+    Free(r->log);
+    Free(r);
+}
+
+static inline struct nr_replica *my_replica(struct nr *r)
+{
+    int cpu = sched_getcpu();
+    if (cpu < 0 || cpu >= r->ncpu)
+        return &r->rep[0];
+    return &r->rep[cpu * r->nrep / r->ncpu];
+}
+
+/* apply one log entry, once it's filled */
+static inline void *apply(struct nr *r, struct nr_replica *p, uint64_t i,
+                          int *ret)
+{
+    struct nr_entry *e = &r->log[i % LOG_SIZE];
+    uint64_t lap_op;
+    while (((lap_op = load64(&e->lap_op)) >> 1) != i / LOG_SIZE + 1)
+        sched_yield();
+    if ((lap_op & 1) == OP_REMOVE)
+        return r->inner->hm_remove(p->map, e->key);
+    *ret = r->inner->hm_insert(p->map, e->key, e->value);
+    return 0;
+}
+
+/* with p's lock held: apply the log up to tail */
+static void update(struct nr *r, struct nr_replica *p, uint64_t tail)
+{
+    int ret;
+    uint64_t i;
+    for (i = p->local_tail; i < tail; i++)
+        apply(r, p, i, &ret);
+    if (i > p->local_tail)
+        __atomic_store_n(&p->local_tail, i, __ATOMIC_RELEASE);
+}
+
+/*
+ * With p's lock held: claim n log entries once their previous lap is
+ * applied everywhere -- meanwhile bringing p (and whichever other replicas
+ * are free to take) up to date, so some replica always progresses.
+ */
+static uint64_t claim(struct nr *r, struct nr_replica *p, int n)
+{
+    while (1)
+    {
+        uint64_t tail = load64(&r->log_tail);
+        uint64_t min = tail;
+        for (int j = 0; j < r->nrep; j++)
+        {
+            uint64_t t = load64(&r->rep[j].local_tail);
+            if (t < min)
+                min = t;
+        }
+        if (tail + n - min <= LOG_SIZE)
+        {
+            if (__atomic_compare_exchange_n(&r->log_tail, &tail, tail + n,
+                    0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+                return tail;
+            continue;
+        }
+
+        update(r, p, tail);
+        for (int j = 0; j < r->nrep; j++)
+        {
+            struct nr_replica *q = &r->rep[j];
+            if (q != p && !pthread_mutex_trylock(&q->lock))
+            {
+                update(r, q, tail);
+                pthread_mutex_unlock(&q->lock);
+            }
+        }
+        sched_yield();
+    }
+}
+
+/* with p's lock held: log and apply every op pending in p's slots */
+static void combine(struct nr *r, struct nr_replica *p)
+{
+    struct nr_slot *batch[NR_SLOTS];
+    int n = 0;
+    for (int j = 0; j < NR_SLOTS; j++)
+        if (__atomic_load_n(&p->slot[j].state, __ATOMIC_ACQUIRE)
+            == SLOT_PENDING)
+        {
+            batch[n++] = &p->slot[j];
+        }
+    if (!n)
+        return;
+
+    uint64_t i = claim(r, p, n);
+    for (int k = 0; k < n; k++)
+    {
+        struct nr_entry *e = &r->log[(i + k) % LOG_SIZE];
+        e->key = batch[k]->key;
+        e->value = batch[k]->value;
+        __atomic_store_n(&e->lap_op, ((i + k) / LOG_SIZE + 1) * 2
+                         + batch[k]->op, __ATOMIC_RELEASE);
+    }
+
+    update(r, p, i);
+    for (int k = 0; k < n; k++)
+    {
+        batch[k]->ret = 0;
+        batch[k]->res = apply(r, p, i + k, &batch[k]->ret);
+    }
+    __atomic_store_n(&p->local_tail, i + n, __ATOMIC_RELEASE);
+
+    uint64_t done = load64(&r->completed_tail);
+    while (done < i + n && !__atomic_compare_exchange_n(&r->completed_tail,
+            &done, i + n, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        ;
+
+    /* only now: a read after the op returns must find it completed */
+    for (int k = 0; k < n; k++)
+        __atomic_store_n(&batch[k]->state, SLOT_DONE, __ATOMIC_RELEASE);
+}
+
+/* a free slot of p, taken; if all are pending, help them through */
+static struct nr_slot *take_slot(struct nr *r, struct nr_replica *p)
+{
+    static __thread int hint;
+    while (1)
+    {
+        for (int j = 0; j < NR_SLOTS; j++)
+        {
+            int k = (hint + j) % NR_SLOTS;
+            int state = SLOT_FREE;
+            if (__atomic_compare_exchange_n(&p->slot[k].state, &state,
+                    SLOT_FILLING, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            {
+                hint = k;
+                return &p->slot[k];
+            }
+        }
+        if (!pthread_mutex_trylock(&p->lock))
+        {
+            combine(r, p);
+            pthread_mutex_unlock(&p->lock);
+        }
+        else
+            sched_yield();
+    }
+}
+
+static void *write_op(struct nr *r, int op, uint64_t key, void *value,
+                      int *ret)
+{
+    struct nr_replica *p = my_replica(r);
+    struct nr_slot *s = take_slot(r, p);
+    s->key = key;
+    s->value = value;
+    s->op = op;
+    __atomic_store_n(&s->state, SLOT_PENDING, __ATOMIC_RELEASE);
+
+    while (__atomic_load_n(&s->state, __ATOMIC_ACQUIRE) != SLOT_DONE)
+    {
+        if (!pthread_mutex_trylock(&p->lock))
+        {
+            combine(r, p);
+            pthread_mutex_unlock(&p->lock);
+        }
+        else
+            sched_yield();
+    }
+
+    void *res = s->res;
+    *ret = s->ret;
+    __atomic_store_n(&s->state, SLOT_FREE, __ATOMIC_RELEASE);
+    return res;
+}
+
+/* a replica that has every op that returned before now */
+static inline struct nr_replica *read_replica(struct nr *r)
+{
+    struct nr_replica *p = my_replica(r);
+    uint64_t done = load64(&r->completed_tail);
+    while (load64(&p->local_tail) < done)
+    {
+        if (!pthread_mutex_trylock(&p->lock))
+        {
+            update(r, p, done);
+            pthread_mutex_unlock(&p->lock);
+            break;
+        }
+        sched_yield();
+    }
+    return p;
+}
+
+int FUNC(insert)(void *r, uint64_t key, void *value)
+{
+    int ret = 0;
+    write_op(r, OP_INSERT, key, value, &ret);
+    return ret;
+}
+
+void *FUNC(remove)(void *r, uint64_t key)
+{
+    int ret;
+    return write_op(r, OP_REMOVE, key, 0, &ret);
+}
+
+void *FUNC(get)(void *c, uint64_t key)
+{
+    struct nr *r = c;
+    return r->inner->hm_get(read_replica(r)->map, key);
+}
+
+void *FUNC(find_le)(void *c, uint64_t key)
+{
+    struct nr *r = c;
+    return r->inner->hm_find_le(read_replica(r)->map, key);
+}
@@ -0,0 +1,16 @@
+/*
+ * nr.h -- node replication of any hms[] engine
+ */
+
+#ifndef NR_H
+#define NR_H 1
+
+#include <stdint.h>
+
+struct hm;
+struct nr;
+
+/* replicas of inner (an entry of hms[]); threads pick one by their CPU */
+struct nr *nr_new_of(const struct hm *inner, int replicas);
+
+#endif
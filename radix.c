@@ -0,0 +1,367 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "util.h"
+
+/*
+ * Traditional radix tree: fixed depth, no compression, every level is a
+ * slice of the key.  The slice width is picked at creation by choosing one
+ * of radix8, radix11, radix13 or radix16; every function is instantiated
+ * for each width so that levels, shifts and masks are constant-folded and
+ * the descent is fully unrolled.
+ *
+ *   width  levels  node size
+ *     8      8       2KB
+ *    11      6      16KB
+ *    13      5      64KB
+ *    16      4     512KB
+ *
+ * The top level takes what's left of 64 bits (eg, 9 bits for width 11).
+ *
+ * Readers are lock-free and sync-free just like critnib: they never take
+ * any lock, nodes of empty subtrees are recycled only after DELETED_LIFE
+ * further removes, and a reader that notices that many removes happened
+ * restarts.  Writes take a mutex as removes need to know when a subtree
+ * becomes empty; inserts alone could be done by cmpxchg.
+ *
+ * Memory is tolerable only for dense keys (pointers and the like): random
+ * 64-bit keys get a whole chain of mostly-empty nodes each.
+ */
+
+#define DELETED_LIFE 16
+
+struct radix_node
+{
+    struct radix_node *next; /* pool/pending chain, never read by readers */
+    uint64_t nchildren;
+    void *child[];
+};
+
+struct radix
+{
+    struct radix_node *root;
+    struct radix_node *deleted_node;
+    struct radix_node *pending_del[DELETED_LIFE];
+    uint64_t remove_count;
+    unsigned slice;
+    pthread_mutex_t mutex;
+};
+
+#define LEVELS(w) ((64 + (w) - 1) / (w))
+#define SLNODES(w) (1ULL << (w))
+
+static inline uint64_t sl(uint64_t key, int lev, unsigned w)
+{
+    return key >> (lev * w) & (SLNODES(w) - 1);
+}
+
+static inline void load(void *src, void *dst)
+{
+    util_atomic_load_explicit64((uint64_t *)src, (uint64_t *)dst,
+        memory_order_acquire);
+}
+
+static inline void store(void *dst, void *src)
+{
+    util_atomic_store_explicit64((uint64_t *)dst, (uint64_t)src,
+        memory_order_release);
+}
+
+static inline struct radix_node *alloc_node(struct radix *c, unsigned w)
+{
+    /* nodes go to the pool only once empty */
+    struct radix_node *n = c->deleted_node;
+    if (!n)
+        return Zalloc(sizeof(struct radix_node) + SLNODES(w) * sizeof(void*));
+    c->deleted_node = n->next;
+    n->next = 0;
+    return n;
+}
+
+static inline struct radix *radix_new(unsigned w)
+{
+    struct radix *c = Zalloc(sizeof(struct radix));
+    if (!c)
+        return 0;
+    c->slice = w;
+    if (!(c->root = alloc_node(c, w)))
+    {
+        Free(c);
+        return 0;
+    }
+    pthread_mutex_init(&c->mutex, 0);
+    return c;
+}
+
+static void teardown(struct radix_node *n, int lev, unsigned w)
+{
+    if (lev)
+        for (uint64_t i=0; i<SLNODES(w); i++)
+            if (n->child[i])
+                teardown(n->child[i], lev-1, w);
+    Free(n);
+}
+
+static void free_chain(struct radix_node *n)
+{
+    while (n)
+    {
+        struct radix_node *nn = n->next;
+        Free(n);
+        n = nn;
+    }
+}
+
+static inline void radix_delete(struct radix *c, unsigned w)
+{
+    teardown(c->root, LEVELS(w)-1, w);
+    free_chain(c->deleted_node);
+    for (int i=0; i<DELETED_LIFE; i++)
+        free_chain(c->pending_del[i]);
+    pthread_mutex_destroy(&c->mutex);
+    Free(c);
+}
+
+static inline __attribute__((always_inline))
+int radix_insert(struct radix *c, uint64_t key, void *value, unsigned w)
+{
+    /* value of 0 is indistinguishable from "not existent" */
+    if (!value)
+        return EINVAL;
+
+    pthread_mutex_lock(&c->mutex);
+
+    struct radix_node *n = c->root;
+    int lev;
+    for (lev = LEVELS(w)-1; lev; lev--)
+    {
+        struct radix_node *m = n->child[sl(key, lev, w)];
+        if (!m)
+            break;
+        n = m;
+    }
+
+    if (!lev && n->child[sl(key, 0, w)])
+    {
+        pthread_mutex_unlock(&c->mutex);
+        return EEXIST;
+    }
+
+    /*
+     * Build the missing part of the path unconnected, then link it with a
+     * single store -- readers see either nothing or the whole chain.
+     */
+    struct radix_node *top = 0, *m = 0;
+    for (int l = lev; l; l--)
+    {
+        struct radix_node *k = alloc_node(c, w);
+        if (!k)
+        {
+            /*
+             * Never seen by readers, thus can go straight back to the pool
+             * (whence some came) once clean again: each has just the one
+             * child, on the key's path.
+             */
+            for (int ll = lev-1; top; ll--)
+            {
+                k = top->next;
+                top->child[sl(key, ll, w)] = 0;
+                top->nchildren = 0;
+                top->next = c->deleted_node;
+                c->deleted_node = top;
+                top = k;
+            }
+            pthread_mutex_unlock(&c->mutex);
+            return ENOMEM;
+        }
+        if (m)
+        {
+            m->child[sl(key, l, w)] = k;
+            m->nchildren = 1;
+            m->next = k; /* only to free on failure */
+        }
+        else
+            top = k;
+        m = k;
+    }
+
+    if (m)
+    {
+        m->child[sl(key, 0, w)] = value;
+        m->nchildren = 1;
+        for (struct radix_node *k = top, *kk; k; k = kk)
+            kk = k->next, k->next = 0;
+        store(&n->child[sl(key, lev, w)], top);
+    }
+    else
+        store(&n->child[sl(key, 0, w)], value);
+    n->nchildren++;
+
+    pthread_mutex_unlock(&c->mutex);
+    return 0;
+}
+
+static inline __attribute__((always_inline))
+void *radix_remove(struct radix *c, uint64_t key, unsigned w)
+{
+    struct radix_node *path[LEVELS(w)];
+
+    pthread_mutex_lock(&c->mutex);
+
+    struct radix_node *n = c->root;
+    for (int lev = LEVELS(w)-1; lev; lev--)
+    {
+        path[lev] = n;
+        if (!(n = n->child[sl(key, lev, w)]))
+        {
+            pthread_mutex_unlock(&c->mutex);
+            return 0;
+        }
+    }
+    path[0] = n;
+
+    void *value = n->child[sl(key, 0, w)];
+    if (!value)
+    {
+        pthread_mutex_unlock(&c->mutex);
+        return 0;
+    }
+
+    uint64_t del = util_fetch_and_add64(&c->remove_count, 1) % DELETED_LIFE;
+    for (struct radix_node *k = c->pending_del[del], *kk; k; k = kk)
+    {
+        kk = k->next;
+        k->next = c->deleted_node;
+        c->deleted_node = k;
+    }
+    c->pending_del[del] = 0;
+
+    store(&n->child[sl(key, 0, w)], NULL);
+    /* unlink every subtree that became empty, except for the root */
+    for (int lev = 0; !--path[lev]->nchildren && lev < LEVELS(w)-1; lev++)
+    {
+        store(&path[lev+1]->child[sl(key, lev+1, w)], NULL);
+        path[lev]->next = c->pending_del[del];
+        c->pending_del[del] = path[lev];
+    }
+
+    pthread_mutex_unlock(&c->mutex);
+    return value;
+}
+
+static inline __attribute__((always_inline))
+void *radix_get(struct radix *c, uint64_t key, unsigned w)
+{
+    uint64_t wrs1, wrs2;
+    void *res;
+
+    do
+    {
+        load(&c->remove_count, &wrs1);
+        struct radix_node *n = c->root;
+        for (int lev = LEVELS(w)-1; lev && n; lev--)
+            load(&n->child[sl(key, lev, w)], &n);
+        if (n)
+            load(&n->child[sl(key, 0, w)], &res);
+        else
+            res = 0;
+        load(&c->remove_count, &wrs2);
+    } while (wrs1 + DELETED_LIFE <= wrs2);
+
+    return res;
+}
+
+/* rightmost value in a subtree */
+static void *find_max(struct radix_node *n, int lev, unsigned w)
+{
+    for (int64_t i = SLNODES(w)-1; i >= 0; i--)
+    {
+        void *m;
+        load(&n->child[i], &m);
+        if (!m)
+            continue;
+        if (!lev)
+            return m;
+        if ((m = find_max(m, lev-1, w)))
+            return m;
+    }
+    return 0;
+}
+
+static void *find_le(struct radix_node *n, int lev, uint64_t key, unsigned w)
+{
+    int64_t i = sl(key, lev, w);
+    void *m;
+
+    if (!lev)
+    {
+        for (; i >= 0; i--)
+        {
+            load(&n->child[i], &m);
+            if (m)
+                return m;
+        }
+        return 0;
+    }
+
+    load(&n->child[i], &m);
+    if (m && (m = find_le(m, lev-1, key, w)))
+        return m;
+
+    /* nothing <= key in our subtree, take the max of one to the left */
+    for (i--; i >= 0; i--)
+    {
+        load(&n->child[i], &m);
+        if (m && (m = find_max(m, lev-1, w)))
+            return m;
+    }
+    return 0;
+}
+
+static inline __attribute__((always_inline))
+void *radix_find_le(struct radix *c, uint64_t key, unsigned w)
+{
+    uint64_t wrs1, wrs2;
+    void *res;
+
+    do
+    {
+        load(&c->remove_count, &wrs1);
+        res = find_le(c->root, LEVELS(w)-1, key, w);
+        load(&c->remove_count, &wrs2);
+    } while (wrs1 + DELETED_LIFE <= wrs2);
+
+    return res;
+}
+
+#define RADIX_FUNCS(w) \
+    struct radix *radix##w##_new(void)					\
+    {									\
+        return radix_new(w);						\
+    }									\
+    void radix##w##_delete(struct radix *c)				\
+    {									\
+        radix_delete(c, w);						\
+    }									\
+    int radix##w##_insert(struct radix *c, uint64_t key, void *value)	\
+    {									\
+        return radix_insert(c, key, value, w);				\
+    }									\
+    void *radix##w##_remove(struct radix *c, uint64_t key)		\
+    {									\
+        return radix_remove(c, key, w);					\
+    }									\
+    void *radix##w##_get(struct radix *c, uint64_t key)			\
+    {									\
+        return radix_get(c, key, w);					\
+    }									\
+    void *radix##w##_find_le(struct radix *c, uint64_t key)		\
+    {									\
+        return radix_find_le(c, key, w);				\
+    }
+
+RADIX_FUNCS(8)
+RADIX_FUNCS(11)
+RADIX_FUNCS(13)
+RADIX_FUNCS(16)
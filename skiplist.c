@@ -0,0 +1,495 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "util.h"
+#include "skiplist.h"
+
+/*
+ * Lock-free skip list (Fraser; Herlihy & Shavit's variant of it): every
+ * write is a cmpxchg, there's no mutex anywhere.
+ *
+ * A remove marks bit 0 of the victim's next pointers, top level first;
+ * whoever marks level 0 has removed the key.  Marked nodes get unlinked by
+ * any writer that walks past them.  An insert links the bottom level (that
+ * makes the key present), then the rest, stopping if the node got marked
+ * meanwhile.  As an insert may still be linking a node in while it's being
+ * removed, the node is retired by whichever of the two finishes last
+ * (INSERTING/REMOVED in state).
+ *
+ * Readers don't write and don't help: they skip marked nodes and use
+ * critnib's remove count to notice walking through recycled ones.  With no
+ * lock to serialize removes, there's no DELETED_LIFE ring: each removed
+ * node notes the count it got and waits on a stack, whence whoever gets
+ * the flush flag takes those DELETED_LIFE counts old.  That flusher also
+ * advances the writer generations (like critnib's inserters, but counting
+ * every writer here).  Nodes are pooled by height.
+ */
+
+#define FUNC(x) skiplist_##x
+
+#define MAX_LEVEL 20
+#define DELETED_LIFE 16
+
+#define MARK 1ULL
+#define POOL_PTR ((1ULL << 48) - 1)
+#define POOL_TAG (1ULL << 48)
+
+#define INSERTING 1
+#define REMOVED   2
+
+struct sl_node
+{
+    uint64_t key;
+    void *value;
+    struct sl_node *free_next; /* pending/limbo/pool chain, readers don't care */
+    uint64_t removed_at; /* remove_count before its remove bumped it */
+    uint32_t height;
+    uint32_t state;
+    struct sl_node *next[]; /* bit 0: being removed */
+};
+
+struct skiplist
+{
+    struct sl_node *head;
+    uint64_t top; /* highest level in use, a hint for readers */
+    uint64_t deleted_node[MAX_LEVEL]; /* tagged pool heads, by height */
+    struct sl_node *pending_del; /* not yet DELETED_LIFE removes old */
+    struct sl_node *limbo[2];
+    uint64_t remove_count;
+    uint64_t gen;
+    uint64_t active[2];
+    uint32_t flushing;
+};
+
+static inline int cas(void *slot, void *oldval, void *newval)
+{
+    return util_bool_compare_and_swap64((uint64_t *)slot,
+        (uint64_t)oldval, (uint64_t)newval);
+}
+
+static inline void *load(void *src)
+{
+    return __atomic_load_n((void**)src, __ATOMIC_ACQUIRE);
+}
+
+static inline struct sl_node *marked(struct sl_node *n)
+{
+    return (void*)((uint64_t)n | MARK);
+}
+
+static inline struct sl_node *unmarked(struct sl_node *n)
+{
+    return (void*)((uint64_t)n & ~MARK);
+}
+
+static inline int is_marked(struct sl_node *n)
+{
+    return (uint64_t)n & MARK;
+}
+
+/* 1 + geometric with p=1/4: fewer levels to walk than p=1/2 */
+static int random_height(void)
+{
+    static __thread uint64_t rnd;
+    if (!rnd)
+        rnd = (uint64_t)&rnd | 1;
+    rnd ^= rnd << 13;
+    rnd ^= rnd >> 7;
+    rnd ^= rnd << 17;
+    return 1 + __builtin_ctzll(rnd | 1ULL << (2 * (MAX_LEVEL - 1))) / 2;
+}
+
+static inline size_t node_size(int h)
+{
+    return sizeof(struct sl_node) + h * sizeof(struct sl_node *);
+}
+
+struct skiplist *FUNC(new)(void)
+{
+    struct skiplist *c = Zalloc(sizeof(struct skiplist));
+    if (!c)
+        return 0;
+    if (!(c->head = Zalloc(node_size(MAX_LEVEL))))
+    {
+        Free(c);
+        return 0;
+    }
+    c->head->height = MAX_LEVEL;
+    c->top = 1;
+    return c;
+}
+
+static void free_chain(struct sl_node *n)
+{
+    while (n)
+    {
+        struct sl_node *nn = n->free_next;
+        Free(n);
+        n = nn;
+    }
+}
+
+void FUNC(delete)(struct skiplist *c)
+{
+    for (struct sl_node *n = c->head, *nn; n; n = nn)
+    {
+        nn = n->next[0];
+        Free(n);
+    }
+    free_chain(c->pending_del);
+    free_chain(c->limbo[0]);
+    free_chain(c->limbo[1]);
+    for (int h=0; h<MAX_LEVEL; h++)
+        free_chain((void*)(c->deleted_node[h] & POOL_PTR));
+    Free(c);
+}
+
+static uint64_t writer_enter(struct skiplist *c)
+{
+    uint64_t gen, gen2;
+
+    while (1)
+    {
+        gen = (uint64_t)load(&c->gen);
+        util_fetch_and_add64(&c->active[gen & 1], 1);
+        gen2 = (uint64_t)load(&c->gen);
+        if (gen == gen2)
+            return gen;
+        util_fetch_and_sub64(&c->active[gen & 1], 1);
+    }
+}
+
+static void writer_leave(struct skiplist *c, uint64_t gen)
+{
+    util_fetch_and_sub64(&c->active[gen & 1], 1);
+}
+
+static struct sl_node *alloc_node(struct skiplist *c, int h)
+{
+    uint64_t head;
+    struct sl_node *n;
+    do
+    {
+        head = (uint64_t)load(&c->deleted_node[h-1]);
+        n = (void*)(head & POOL_PTR);
+        if (!n)
+            return Malloc(node_size(h));
+    } while (!cas(&c->deleted_node[h-1], (void*)head, (void*)(((head
+             & ~POOL_PTR) + POOL_TAG) | (uint64_t)load(&n->free_next))));
+    return n;
+}
+
+static void free_node(struct skiplist *c, struct sl_node *n)
+{
+    uint64_t head;
+    do
+    {
+        head = (uint64_t)load(&c->deleted_node[n->height-1]);
+        n->free_next = (void*)(head & POOL_PTR);
+    } while (!cas(&c->deleted_node[n->height-1], (void*)head,
+             (void*)(((head & ~POOL_PTR) + POOL_TAG) | (uint64_t)n)));
+}
+
+static void push(struct sl_node **stack, struct sl_node *first,
+                 struct sl_node *last)
+{
+    do
+        last->free_next = load(stack);
+    while (!cas(stack, last->free_next, first));
+}
+
+/*
+ * Nodes removed DELETED_LIFE counts ago go from pending_del to limbo: no
+ * reader can be in them anymore without noticing.
+ *
+ * Everything in limbo[g] got there while the generation was g or g-1 (a
+ * writer that read g-1 blocks going past g).  When no writers of g-1 are
+ * left, bumping to g+1 makes limbo[g-1] -- same parity -- safe to reuse.
+ */
+static void flush(struct skiplist *c)
+{
+    if (__sync_lock_test_and_set(&c->flushing, 1))
+        return;
+    uint64_t gen = (uint64_t)load(&c->gen);
+
+    uint64_t cnt = (uint64_t)load(&c->remove_count);
+    struct sl_node *n = __atomic_exchange_n(&c->pending_del, 0,
+                                            __ATOMIC_ACQ_REL);
+    struct sl_node *keep = 0, *keep_last = 0;
+    while (n)
+    {
+        struct sl_node *nn = n->free_next;
+        if (n->removed_at + DELETED_LIFE <= cnt)
+            push(&c->limbo[gen & 1], n, n);
+        else
+        {
+            n->free_next = keep;
+            keep = n;
+            if (!keep_last)
+                keep_last = n;
+        }
+        n = nn;
+    }
+    if (keep)
+        push(&c->pending_del, keep, keep_last);
+
+    if (!load(&c->active[(gen + 1) & 1]))
+    {
+        struct sl_node *n = __atomic_exchange_n(&c->limbo[(gen + 1) & 1], 0,
+                                                __ATOMIC_ACQ_REL);
+        util_fetch_and_add64(&c->gen, 1);
+        while (n)
+        {
+            struct sl_node *nn = n->free_next;
+            free_node(c, n);
+            n = nn;
+        }
+    }
+    __sync_lock_release(&c->flushing);
+}
+
+/* n is fully unlinked; to be called within writer_enter() */
+static void retire(struct skiplist *c, struct sl_node *n)
+{
+    n->removed_at = util_fetch_and_add64(&c->remove_count, 1);
+    push(&c->pending_del, n, n);
+    flush(c);
+}
+
+/*
+ * Fill preds/succs for every level, unlinking marked nodes on the way.
+ * Returns whether succs[0] has the key.  For writers only.
+ */
+static int find(struct skiplist *c, uint64_t key, struct sl_node **preds,
+                struct sl_node **succs)
+{
+    struct sl_node *pred, *cur, *succ;
+
+retry:
+    pred = c->head;
+    for (int i=MAX_LEVEL-1; i>=0; i--)
+    {
+        cur = unmarked(load(&pred->next[i]));
+        while (cur)
+        {
+            succ = load(&cur->next[i]);
+            if (is_marked(succ))
+            {
+                /* fails if pred got marked or changed meanwhile */
+                if (!cas(&pred->next[i], cur, unmarked(succ)))
+                    goto retry;
+                cur = unmarked(succ);
+                continue;
+            }
+            if (cur->key >= key)
+                break;
+            pred = cur;
+            cur = succ;
+        }
+        preds[i] = pred;
+        succs[i] = cur;
+    }
+    return succs[0] && succs[0]->key == key;
+}
+
+int FUNC(insert)(struct skiplist *c, uint64_t key, void *value)
+{
+    struct sl_node *preds[MAX_LEVEL], *succs[MAX_LEVEL];
+    uint64_t gen = writer_enter(c);
+    int h = random_height();
+
+    struct sl_node *n = alloc_node(c, h);
+    if (!n)
+    {
+        writer_leave(c, gen);
+        return ENOMEM;
+    }
+    n->key = key;
+    n->value = value;
+    n->height = h;
+    n->state = INSERTING;
+
+    do
+    {
+        if (find(c, key, preds, succs))
+        {
+            /* never published, no grace needed */
+            free_node(c, n);
+            writer_leave(c, gen);
+            return EEXIST;
+        }
+        for (int i=0; i<h; i++)
+            n->next[i] = succs[i];
+    } while (!cas(&preds[0]->next[0], succs[0], n));
+
+    for (int i=1; i<h; i++)
+        while (1)
+        {
+            struct sl_node *nx = load(&n->next[i]);
+            /* fails only if a remove marked it */
+            if (is_marked(nx) || (nx != succs[i]
+                                  && !cas(&n->next[i], nx, succs[i])))
+                goto done;
+            if (cas(&preds[i]->next[i], succs[i], n))
+                break;
+            if (!find(c, key, preds, succs) || succs[0] != n)
+                goto done;
+        }
+
+done:
+    for (uint64_t top = c->top; top < (uint64_t)h; top = c->top)
+        if (cas(&c->top, (void*)top, (void*)(uint64_t)h))
+            break;
+    if (util_fetch_and_and32(&n->state, ~INSERTING) & REMOVED)
+    {
+        /* the remove ran while we were linking upper levels */
+        find(c, key, preds, succs);
+        retire(c, n);
+    }
+    writer_leave(c, gen);
+    return 0;
+}
+
+void *FUNC(remove)(struct skiplist *c, uint64_t key)
+{
+    struct sl_node *preds[MAX_LEVEL], *succs[MAX_LEVEL];
+    struct sl_node *nx;
+    uint64_t gen = writer_enter(c);
+
+    if (!find(c, key, preds, succs))
+    {
+        writer_leave(c, gen);
+        return 0;
+    }
+
+    struct sl_node *n = succs[0];
+    for (int i=n->height-1; i>0; i--)
+        do
+            nx = load(&n->next[i]);
+        while (!is_marked(nx) && !cas(&n->next[i], nx, marked(nx)));
+
+    do
+    {
+        nx = load(&n->next[0]);
+        if (is_marked(nx))
+        {
+            /* lost to another remove */
+            writer_leave(c, gen);
+            return 0;
+        }
+    } while (!cas(&n->next[0], nx, marked(nx)));
+
+    void *value = n->value;
+    int inserting = util_fetch_and_or32(&n->state, REMOVED) & INSERTING;
+    find(c, key, preds, succs);
+    if (!inserting)
+        retire(c, n);
+    writer_leave(c, gen);
+    return value;
+}
+
+/*
+ * Readers: the last node < key (or <= key) on the bottom level, and the one
+ * after it.  Returns 0 if the walk went through recycled nodes (keys not
+ * increasing) and must restart.
+ */
+static inline int descend(struct skiplist *c, uint64_t key, int le,
+                          struct sl_node **predp, struct sl_node **curp)
+{
+    struct sl_node *pred = c->head, *cur = 0;
+    for (int i=(int)(uint64_t)load(&c->top)-1; i>=0; i--)
+    {
+        cur = unmarked(load(&pred->next[i]));
+        while (cur)
+        {
+            uint64_t k = cur->key;
+            if (pred != c->head && k <= pred->key)
+                return 0;
+            if (le ? k > key : k >= key)
+                break;
+            pred = cur;
+            cur = unmarked(load(&cur->next[i]));
+        }
+    }
+    *predp = pred;
+    *curp = cur;
+    return 1;
+}
+
+void* FUNC(get)(struct skiplist *c, uint64_t key)
+{
+    struct sl_node *pred, *cur;
+    uint64_t wrs1, wrs2;
+    void *res;
+
+    do
+    {
+        wrs1 = (uint64_t)load(&c->remove_count);
+        if (!descend(c, key, 0, &pred, &cur))
+        {
+            wrs2 = wrs1 + DELETED_LIFE;
+            continue;
+        }
+        res = 0;
+        if (cur && cur->key == key && !is_marked(load(&cur->next[0])))
+            res = cur->value;
+        wrs2 = (uint64_t)load(&c->remove_count);
+    } while (wrs1 + DELETED_LIFE <= wrs2);
+
+    return res;
+}
+
+/* a hit on a removed node retries just below (above) it */
+void* FUNC(find_le)(struct skiplist *c, uint64_t key)
+{
+    struct sl_node *pred, *cur;
+    uint64_t wrs1, wrs2, k;
+    void *res;
+
+    while (1)
+    {
+        wrs1 = (uint64_t)load(&c->remove_count);
+        if (!descend(c, key, 1, &pred, &cur))
+            continue;
+        if (pred == c->head)
+            return 0;
+        k = pred->key;
+        res = pred->value;
+        int removed = is_marked(load(&pred->next[0]));
+        wrs2 = (uint64_t)load(&c->remove_count);
+        if (wrs1 + DELETED_LIFE <= wrs2)
+            continue;
+        if (!removed)
+            return res;
+        if (!k)
+            return 0;
+        key = k - 1;
+    }
+}
+
+void *FUNC(find_ge)(struct skiplist *c, uint64_t key)
+{
+    struct sl_node *pred, *cur;
+    uint64_t wrs1, wrs2, k;
+    void *res;
+
+    while (1)
+    {
+        wrs1 = (uint64_t)load(&c->remove_count);
+        if (!descend(c, key, 0, &pred, &cur))
+            continue;
+        if (!cur)
+            return 0;
+        k = cur->key;
+        res = cur->value;
+        int removed = is_marked(load(&cur->next[0]));
+        wrs2 = (uint64_t)load(&c->remove_count);
+        if (wrs1 + DELETED_LIFE <= wrs2)
+            continue;
+        if (!removed)
+            return res;
+        if (!~k)
+            return 0;
+        key = k + 1;
+    }
+}
@@ -0,0 +1,15 @@
+/*
+ * skiplist.h -- what the skip list offers beyond HM_PROTOS
+ */
+
+#ifndef SKIPLIST_H
+#define SKIPLIST_H 1
+
+#include <stdint.h>
+
+struct skiplist;
+
+/* value of the smallest key >= key, or NULL */
+void *skiplist_find_ge(struct skiplist *c, uint64_t key);
+
+#endif
@@ -0,0 +1,459 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "util.h"
+
+/*
+ * Split-ordered list (Shalev & Shavit): a hash where every entry sits in a
+ * single linked list sorted by the bit-reversed hash.  A bucket is but a
+ * pointer to a dummy node in that list; in bit-reversed order a bucket's
+ * entries are contiguous, and doubling the bucket count splits each run in
+ * two right where the new bucket's dummy goes.  Thus growing moves nothing:
+ * new buckets get their dummies lazily, linked in starting from the parent
+ * bucket (the same index less its top bit).  The bucket array is a
+ * directory of segments that double in size, so it never gets copied
+ * either.
+ *
+ * Inserts are lock-free: a cmpxchg on the predecessor's next pointer, and
+ * so is growing (a cmpxchg on the bucket count).  Removes take a mutex, as
+ * recycling nodes needs to know who else is recycling: they mark the
+ * victim's next pointer (bit 0), after which no insert can link in behind
+ * it, then unlink it.  An insert that runs into a marked node helps
+ * unlinking it rather than waiting.
+ *
+ * Readers neither write nor help: they skip marked nodes, and walk through
+ * removed ones the critnib way -- a removed node is left untouched for
+ * DELETED_LIFE further removes, a reader that sees that many restarts.  A
+ * stalled insert could still cmpxchg into a recycled node, thus like in
+ * critnib removed nodes go through a limbo that waits for every insert
+ * started before, and only then to the pool.
+ */
+
+#define FUNC(x) splitorder_##x
+
+#define DELETED_LIFE 16
+/* double the bucket count past this many entries per bucket */
+#define MAX_LOAD 2
+#define SEGMENTS 64
+
+#define MARK 1ULL
+#define POOL_PTR ((1ULL << 48) - 1)
+#define POOL_TAG (1ULL << 48)
+
+struct so_node
+{
+    uint64_t so; /* bit-reversed hash: odd for entries, even for dummies */
+    uint64_t key;
+    void *value;
+    struct so_node *next; /* bit 0: being removed */
+};
+
+struct splitorder
+{
+    /* segment s holds buckets [2^(s-1), 2^s), segment 0 just bucket 0 */
+    struct so_node **seg[SEGMENTS];
+    uint64_t log_size;
+    uint64_t count;
+    uint64_t deleted_node; /* tagged pool head */
+    struct so_node *pending_del[DELETED_LIFE];
+    struct so_node *limbo[2];
+    uint64_t remove_count;
+    uint64_t ins_gen;
+    uint64_t ins_active[2];
+    pthread_mutex_t mutex;
+};
+
+static inline uint64_t reverse(uint64_t x)
+{
+    x = __builtin_bswap64(x);
+    x = (x & 0x0f0f0f0f0f0f0f0fULL) << 4 | (x >> 4 & 0x0f0f0f0f0f0f0f0fULL);
+    x = (x & 0x3333333333333333ULL) << 2 | (x >> 2 & 0x3333333333333333ULL);
+    x = (x & 0x5555555555555555ULL) << 1 | (x >> 1 & 0x5555555555555555ULL);
+    return x;
+}
+
+/* the top bit of the hash is lost, equal so are told apart by the key */
+static inline uint64_t so_entry(uint64_t h)
+{
+    return reverse(h) | 1;
+}
+
+static inline uint64_t so_dummy(uint64_t b)
+{
+    return reverse(b);
+}
+
+/* is n ordered before so:key? */
+static inline int before(const struct so_node *restrict n, uint64_t so,
+                         uint64_t key)
+{
+    return n->so < so || (n->so == so && n->key < key);
+}
+
+static inline uint64_t parent(uint64_t b)
+{
+    return b & ~(1ULL << (63 - __builtin_clzll(b)));
+}
+
+static inline int cas(void *slot, void *oldval, void *newval)
+{
+    return util_bool_compare_and_swap64((uint64_t *)slot,
+        (uint64_t)oldval, (uint64_t)newval);
+}
+
+static inline void *load(void *src)
+{
+    return __atomic_load_n((void**)src, __ATOMIC_ACQUIRE);
+}
+
+static inline struct so_node *marked(struct so_node *n)
+{
+    return (void*)((uint64_t)n | MARK);
+}
+
+static inline struct so_node *unmarked(struct so_node *n)
+{
+    return (void*)((uint64_t)n & ~MARK);
+}
+
+static inline int is_marked(struct so_node *n)
+{
+    return (uint64_t)n & MARK;
+}
+
+static inline uint64_t seg_size(int s)
+{
+    return s ? 1ULL << (s - 1) : 1;
+}
+
+/* where bucket b lives; with alloc=0, NULL if its segment doesn't exist */
+static struct so_node **bucket_slot(struct splitorder *c, uint64_t b,
+                                    int alloc)
+{
+    int s = b ? 64 - __builtin_clzll(b) : 0;
+    struct so_node **seg = load(&c->seg[s]);
+    if (!seg)
+    {
+        if (!alloc)
+            return 0;
+        if (!(seg = Zalloc(seg_size(s) * sizeof(void*))))
+            return 0;
+        if (!cas(&c->seg[s], 0, seg))
+        {
+            Free(seg);
+            seg = load(&c->seg[s]);
+        }
+    }
+    return &seg[b - (s ? seg_size(s) : 0)];
+}
+
+struct splitorder *FUNC(new)(void)
+{
+    struct splitorder *c = Zalloc(sizeof(struct splitorder));
+    if (!c)
+        return 0;
+    struct so_node **slot = bucket_slot(c, 0, 1);
+    if (!slot || !(*slot = Zalloc(sizeof(struct so_node))))
+    {
+        Free(c->seg[0]);
+        Free(c);
+        return 0;
+    }
+    pthread_mutex_init(&c->mutex, 0);
+    return c;
+}
+
+static void free_chain(struct so_node *n)
+{
+    while (n)
+    {
+        struct so_node *nn = unmarked(n->next);
+        Free(n);
+        n = nn;
+    }
+}
+
+void FUNC(delete)(struct splitorder *c)
+{
+    /* the list has every dummy and every live entry */
+    free_chain(c->seg[0][0]);
+    for (int i=0; i<DELETED_LIFE; i++)
+        if (c->pending_del[i])
+            Free(c->pending_del[i]);
+    free_chain(c->limbo[0]);
+    free_chain(c->limbo[1]);
+    free_chain((void*)(c->deleted_node & POOL_PTR));
+    for (int s=0; s<SEGMENTS; s++)
+        if (c->seg[s])
+            Free(c->seg[s]);
+    pthread_mutex_destroy(&c->mutex);
+    Free(c);
+}
+
+static uint64_t insert_enter(struct splitorder *c)
+{
+    uint64_t gen, gen2;
+
+    while (1)
+    {
+        gen = (uint64_t)load(&c->ins_gen);
+        util_fetch_and_add64(&c->ins_active[gen & 1], 1);
+        gen2 = (uint64_t)load(&c->ins_gen);
+        if (gen == gen2)
+            return gen;
+        util_fetch_and_sub64(&c->ins_active[gen & 1], 1);
+    }
+}
+
+static void insert_leave(struct splitorder *c, uint64_t gen)
+{
+    util_fetch_and_sub64(&c->ins_active[gen & 1], 1);
+}
+
+static struct so_node *alloc_node(struct splitorder *c)
+{
+    uint64_t head;
+    struct so_node *n;
+    do
+    {
+        head = (uint64_t)load(&c->deleted_node);
+        n = (void*)(head & POOL_PTR);
+        if (!n)
+            return Malloc(sizeof(struct so_node));
+    } while (!cas(&c->deleted_node, (void*)head, (void*)(((head & ~POOL_PTR)
+             + POOL_TAG) | (uint64_t)load(&n->next))));
+    return n;
+}
+
+/* push a chain first..last (already linked) to the pool */
+static void free_nodes(struct splitorder *c, struct so_node *first,
+                       struct so_node *last)
+{
+    uint64_t head;
+    do
+    {
+        head = (uint64_t)load(&c->deleted_node);
+        last->next = (void*)(head & POOL_PTR);
+    } while (!cas(&c->deleted_node, (void*)head,
+             (void*)(((head & ~POOL_PTR) + POOL_TAG) | (uint64_t)first)));
+}
+
+/*
+ * Called with the mutex held, n already unlinked.  n stays intact for
+ * DELETED_LIFE removes, then waits in limbo for inserts of the generation
+ * it got there in.  Limbo chains keep the mark: a stalled insert's
+ * cmpxchg on such a node must still fail.
+ */
+static void retire(struct splitorder *c, struct so_node *n)
+{
+    uint64_t del = util_fetch_and_add64(&c->remove_count, 1) % DELETED_LIFE;
+    struct so_node *k = c->pending_del[del];
+    c->pending_del[del] = n;
+    if (!k)
+        return;
+
+    uint64_t gen = c->ins_gen;
+    if (!load(&c->ins_active[(gen + 1) & 1]))
+    {
+        struct so_node *m = c->limbo[(gen + 1) & 1];
+        if (m)
+        {
+            struct so_node *last = m;
+            while ((last->next = unmarked(last->next)))
+                last = last->next;
+            free_nodes(c, m, last);
+        }
+        c->limbo[(gen + 1) & 1] = 0;
+        util_fetch_and_add64(&c->ins_gen, 1);
+        gen++;
+    }
+
+    k->next = marked(c->limbo[gen & 1]);
+    c->limbo[gen & 1] = k;
+}
+
+/*
+ * Find the first live node not before so:key, starting from a dummy;
+ * marked nodes on the way get unlinked.  For writers only: to be called
+ * within insert_enter() or with the mutex held.
+ */
+static void find(struct so_node *head, uint64_t so, uint64_t key,
+                 struct so_node **predp, struct so_node **curp)
+{
+    struct so_node *pred, *cur, *next;
+
+retry:
+    pred = head;
+    cur = load(&pred->next); /* dummies are never marked */
+    while (cur)
+    {
+        next = load(&cur->next);
+        if (is_marked(next))
+        {
+            /* fails if pred got marked or changed meanwhile */
+            if (!cas(&pred->next, cur, unmarked(next)))
+                goto retry;
+            cur = unmarked(next);
+            continue;
+        }
+        if (!before(cur, so, key))
+            break;
+        pred = cur;
+        cur = next;
+    }
+    *predp = pred;
+    *curp = cur;
+}
+
+/* link n in; if there's already a node with its so:key, return that */
+static struct so_node *list_insert(struct so_node *head, struct so_node *n)
+{
+    struct so_node *pred, *cur;
+    do
+    {
+        find(head, n->so, n->key, &pred, &cur);
+        if (cur && cur->so == n->so && cur->key == n->key)
+            return cur;
+        n->next = cur;
+    } while (!cas(&pred->next, cur, n));
+    return 0;
+}
+
+/* bucket b's dummy, linking it in if it's not there yet */
+static struct so_node *get_bucket(struct splitorder *c, uint64_t b)
+{
+    struct so_node **slot = bucket_slot(c, b, 1);
+    if (!slot)
+        return 0;
+    struct so_node *d = load(slot);
+    if (d)
+        return d;
+
+    struct so_node *p = get_bucket(c, parent(b));
+    if (!p || !(d = Malloc(sizeof(struct so_node))))
+        return 0;
+    d->so = so_dummy(b);
+    d->key = 0;
+    d->value = 0;
+    struct so_node *old = list_insert(p, d);
+    if (old)
+    {
+        Free(d);
+        d = old;
+    }
+    /* everyone racing here stores the same dummy */
+    __atomic_store_n(slot, d, __ATOMIC_RELEASE);
+    return d;
+}
+
+/* the dummy of the closest initialized bucket on b's way to bucket 0 */
+static struct so_node *find_bucket(struct splitorder *c, uint64_t h)
+{
+    uint64_t b = h & ((1ULL << (uint64_t)load(&c->log_size)) - 1);
+    while (1)
+    {
+        struct so_node **slot = bucket_slot(c, b, 0);
+        struct so_node *d;
+        if (slot && (d = load(slot)))
+            return d;
+        b = parent(b);
+    }
+}
+
+int FUNC(insert)(struct splitorder *c, uint64_t key, void *value)
+{
+    uint64_t h = util_hash64(key);
+    uint64_t gen = insert_enter(c);
+    uint64_t ls = (uint64_t)load(&c->log_size);
+    int ret = 0;
+
+    struct so_node *head = get_bucket(c, h & ((1ULL << ls) - 1));
+    struct so_node *n = head ? alloc_node(c) : 0;
+    if (!n)
+    {
+        insert_leave(c, gen);
+        return ENOMEM;
+    }
+    n->so = so_entry(h);
+    n->key = key;
+    n->value = value;
+
+    if (list_insert(head, n))
+    {
+        /* never published, no grace needed */
+        free_nodes(c, n, n);
+        ret = EEXIST;
+    }
+    else if (util_fetch_and_add64(&c->count, 1) + 1 > MAX_LOAD << ls
+             && ls < SEGMENTS - 2)
+        cas(&c->log_size, (void*)ls, (void*)(ls + 1));
+
+    insert_leave(c, gen);
+    return ret;
+}
+
+void *FUNC(remove)(struct splitorder *c, uint64_t key)
+{
+    uint64_t h = util_hash64(key);
+    uint64_t so = so_entry(h);
+    struct so_node *pred, *cur, *next;
+    void *value = 0;
+
+    pthread_mutex_lock(&c->mutex);
+    struct so_node *head = find_bucket(c, h);
+    find(head, so, key, &pred, &cur);
+    if (cur && cur->so == so && cur->key == key)
+    {
+        /* only removes mark, and they're serialized */
+        util_fetch_and_or64((uint64_t*)&cur->next, MARK);
+        value = cur->value;
+        /* unlinks cur unless an insert has helped already */
+        find(head, so, key, &pred, &next);
+        util_fetch_and_sub64(&c->count, 1);
+        retire(c, cur);
+    }
+    pthread_mutex_unlock(&c->mutex);
+    return value;
+}
+
+void* FUNC(get)(struct splitorder *c, uint64_t key)
+{
+    uint64_t h = util_hash64(key);
+    uint64_t so = so_entry(h);
+    uint64_t wrs1, wrs2;
+    void *res;
+
+retry:
+    wrs1 = (uint64_t)load(&c->remove_count);
+    res = 0;
+    struct so_node *d = find_bucket(c, h);
+    uint64_t pso = d->so, pkey = 0;
+    for (struct so_node *n = unmarked(load(&d->next)); n; )
+    {
+        uint64_t nso = n->so, nkey = n->key;
+        /* out of order: we've wandered off into recycled nodes */
+        if (nso < pso || (nso == pso && nkey <= pkey))
+            goto retry;
+        if (nso > so || (nso == so && nkey >= key))
+        {
+            if (nso == so && nkey == key && !is_marked(load(&n->next)))
+                res = n->value;
+            break;
+        }
+        pso = nso;
+        pkey = nkey;
+        n = unmarked(load(&n->next));
+    }
+    wrs2 = (uint64_t)load(&c->remove_count);
+    if (wrs1 + DELETED_LIFE <= wrs2)
+        goto retry;
+    return res;
+}
+
+void* FUNC(find_le)(struct splitorder *c, uint64_t key)
+{
+    fprintf(stderr, "Not implemented.\n");
+    abort();
+}
@@ -0,0 +1,365 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+#include "util.h"
+
+/*
+ * Swiss table: open addressing over groups of 16 slots, every group having
+ * 16 one-byte control tags (7 bits of the hash, or empty/deleted) that are
+ * compared all at once with SSE2.  A get reads the tags, then usually one
+ * slot -- two cachelines, not counting the rare probe into the next group.
+ *
+ * Writes take a mutex.  Every group has its own seqlock: a write bumps it
+ * around changing a slot, a reader retries the group if it overlapped.
+ *
+ * Growing (or cleaning up deleted tags) rehashes into a new table.  Old
+ * tables are never freed while the map lives -- they're pooled by size
+ * and reused once two further rehashes have started; readers notice that
+ * many rehashes and restart, as a recycled table of the same size is
+ * harmless to read till then.  In the worst case (steady churn) that's
+ * three tables of the current size.
+ */
+
+#define FUNC(x) swiss_##x
+
+#define GROUP 16
+#define EMPTY   0x80
+#define DELETED 0xfe
+/* rehash when more than 7/8 of slots are used or deleted */
+#define MAX_LOAD(n) ((n) / 8 * 7)
+
+struct swiss_slot
+{
+    uint64_t key;
+    void *value;
+};
+
+struct swiss_group
+{
+    uint8_t ctrl[GROUP];
+    uint64_t volatile write_status;
+    uint64_t pad;
+    struct swiss_slot slot[GROUP];
+};
+
+struct swiss_table
+{
+    uint64_t mask; /* groups-1 */
+    uint64_t retired; /* rehash count when it stopped being current */
+    struct swiss_table *next; /* in the pool */
+    uint64_t pad[5];
+    struct swiss_group g[];
+};
+
+struct swiss
+{
+    struct swiss_table *table;
+    uint64_t rehashes;
+    uint64_t count;
+    uint64_t deleted;
+    struct swiss_table *pool;
+    pthread_mutex_t mutex;
+};
+
+static inline uint8_t h2(uint64_t h)
+{
+    return h & 0x7f;
+}
+
+static inline uint64_t h1(uint64_t h)
+{
+    return h >> 7;
+}
+
+/* bitmask of slots in the group whose tag is c */
+static inline uint32_t match(const struct swiss_group *restrict g, uint8_t c)
+{
+#ifdef __SSE2__
+    __m128i ctrl = _mm_loadu_si128((const __m128i*)g->ctrl);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(c)));
+#else
+    uint32_t m = 0;
+    for (int i=0; i<GROUP; i++)
+        m |= (uint32_t)(g->ctrl[i] == c) << i;
+    return m;
+#endif
+}
+
+/* bitmask of empty or deleted slots: the only tags with the top bit set */
+static inline uint32_t match_free(const struct swiss_group *restrict g)
+{
+#ifdef __SSE2__
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)g->ctrl));
+#else
+    uint32_t m = 0;
+    for (int i=0; i<GROUP; i++)
+        m |= (uint32_t)(g->ctrl[i] >> 7) << i;
+    return m;
+#endif
+}
+
+static inline void write_poke(struct swiss_group *restrict g)
+{
+    util_fetch_and_add64(&g->write_status, 1);
+}
+
+static void init_table(struct swiss_table *t)
+{
+    for (uint64_t i=0; i<=t->mask; i++)
+    {
+        memset(&t->g[i], 0, sizeof(struct swiss_group));
+        memset(t->g[i].ctrl, EMPTY, GROUP);
+    }
+}
+
+static struct swiss_table *alloc_table(uint64_t ngroups)
+{
+    struct swiss_table *t;
+    size_t sz = sizeof(struct swiss_table)
+              + ngroups * sizeof(struct swiss_group);
+    if (posix_memalign((void**)&t, CACHELINE_SIZE, sz))
+        return 0;
+    memset(t, 0, sizeof(struct swiss_table));
+    t->mask = ngroups - 1;
+    init_table(t);
+    return t;
+}
+
+struct swiss *FUNC(new)(void)
+{
+    struct swiss *c = Zalloc(sizeof(struct swiss));
+    if (!c)
+        return 0;
+    if (!(c->table = alloc_table(1)))
+    {
+        Free(c);
+        return 0;
+    }
+    pthread_mutex_init(&c->mutex, 0);
+    return c;
+}
+
+void FUNC(delete)(struct swiss *c)
+{
+    pthread_mutex_destroy(&c->mutex);
+    for (struct swiss_table *t = c->pool, *tt; t; t = tt)
+    {
+        tt = t->next;
+        free(t);
+    }
+    free(c->table);
+    Free(c);
+}
+
+/*
+ * Triangular probing over groups visits every group once when their count
+ * is a power of two.  Returns the slot index (group*GROUP+i) or -1.
+ */
+static int64_t find(struct swiss_table *restrict t, uint64_t key, uint64_t h)
+{
+    uint64_t gi = h1(h) & t->mask;
+    for (uint64_t step=1; step<=t->mask+1; step++)
+    {
+        struct swiss_group *g = &t->g[gi];
+        for (uint32_t m = match(g, h2(h)); m; m &= m - 1)
+        {
+            int i = __builtin_ctz(m);
+            if (g->slot[i].key == key)
+                return gi * GROUP + i;
+        }
+        if (match(g, EMPTY))
+            return -1;
+        gi = (gi + step) & t->mask;
+    }
+    return -1;
+}
+
+/* first empty or deleted slot on the key's probe path; there's always one */
+static uint64_t find_free(struct swiss_table *restrict t, uint64_t h)
+{
+    uint64_t gi = h1(h) & t->mask;
+    for (uint64_t step=1; ; step++)
+    {
+        uint32_t m = match_free(&t->g[gi]);
+        if (m)
+            return gi * GROUP + __builtin_ctz(m);
+        gi = (gi + step) & t->mask;
+    }
+}
+
+/* to be called with the mutex held */
+static struct swiss_table *get_table(struct swiss *c, uint64_t ngroups,
+                                     uint64_t now)
+{
+    for (struct swiss_table **tp = &c->pool; *tp; tp = &(*tp)->next)
+    {
+        struct swiss_table *t = *tp;
+        if (t->mask + 1 == ngroups && t->retired + 2 <= now)
+        {
+            *tp = t->next;
+            init_table(t);
+            return t;
+        }
+    }
+    return alloc_table(ngroups);
+}
+
+static int rehash(struct swiss *c)
+{
+    uint64_t now = util_fetch_and_add64(&c->rehashes, 1) + 1;
+    struct swiss_table *t = c->table;
+
+    uint64_t ng = 1;
+    while (MAX_LOAD(ng * GROUP) < (c->count + 1) * 2)
+        ng *= 2;
+    struct swiss_table *n = get_table(c, ng, now);
+    if (!n)
+        return ENOMEM;
+
+    /* not visible to anyone yet, no pokes needed */
+    for (uint64_t j=0; j<=t->mask; j++)
+        for (int i=0; i<GROUP; i++)
+            if (!(t->g[j].ctrl[i] & 0x80))
+            {
+                struct swiss_slot *s = &t->g[j].slot[i];
+                uint64_t h = util_hash64(s->key);
+                uint64_t f = find_free(n, h);
+                n->g[f / GROUP].ctrl[f % GROUP] = h2(h);
+                n->g[f / GROUP].slot[f % GROUP] = *s;
+            }
+
+    __atomic_store_n(&c->table, n, __ATOMIC_RELEASE);
+    c->deleted = 0;
+    t->retired = now;
+    t->next = c->pool;
+    c->pool = t;
+    return 0;
+}
+
+int FUNC(insert)(struct swiss *c, uint64_t key, void *value)
+{
+    uint64_t h = util_hash64(key);
+
+    pthread_mutex_lock(&c->mutex);
+    struct swiss_table *t = c->table;
+    if (find(t, key, h) >= 0)
+    {
+        pthread_mutex_unlock(&c->mutex);
+        return EEXIST;
+    }
+
+    if (c->count + c->deleted + 1 > MAX_LOAD((t->mask + 1) * GROUP))
+    {
+        int ret = rehash(c);
+        if (ret)
+        {
+            pthread_mutex_unlock(&c->mutex);
+            return ret;
+        }
+        t = c->table;
+    }
+
+    uint64_t f = find_free(t, h);
+    struct swiss_group *g = &t->g[f / GROUP];
+    if (g->ctrl[f % GROUP] == DELETED)
+        c->deleted--;
+    write_poke(g);
+    g->slot[f % GROUP].key = key;
+    g->slot[f % GROUP].value = value;
+    g->ctrl[f % GROUP] = h2(h);
+    write_poke(g);
+    c->count++;
+
+    pthread_mutex_unlock(&c->mutex);
+    return 0;
+}
+
+void *FUNC(remove)(struct swiss *c, uint64_t key)
+{
+    void *value = 0;
+
+    pthread_mutex_lock(&c->mutex);
+    struct swiss_table *t = c->table;
+    int64_t f = find(t, key, util_hash64(key));
+    if (f >= 0)
+    {
+        struct swiss_group *g = &t->g[f / GROUP];
+        /*
+         * A group that has an empty slot never had a probe pass through
+         * it, so it can take another one; otherwise leave a tombstone.
+         */
+        uint8_t tag = match(g, EMPTY) ? EMPTY : DELETED;
+        write_poke(g);
+        value = g->slot[f % GROUP].value;
+        g->ctrl[f % GROUP] = tag;
+        g->slot[f % GROUP].key = 0;
+        g->slot[f % GROUP].value = 0;
+        write_poke(g);
+        c->count--;
+        if (tag == DELETED)
+            c->deleted++;
+    }
+    pthread_mutex_unlock(&c->mutex);
+    return value;
+}
+
+void* FUNC(get)(struct swiss *c, uint64_t key)
+{
+    uint64_t h = util_hash64(key);
+    uint64_t rh1, rh2, wrs1, wrs2;
+    void *res;
+
+retry:
+    util_atomic_load_explicit64(&c->rehashes, &rh1, memory_order_acquire);
+    struct swiss_table *t = __atomic_load_n(&c->table, __ATOMIC_ACQUIRE);
+    uint64_t gi = h1(h) & t->mask;
+    res = 0;
+    for (uint64_t step=1; step<=t->mask+1; step++)
+    {
+        struct swiss_group *g = &t->g[gi];
+        int more;
+group:
+        util_atomic_load_explicit64(&g->write_status, &wrs1,
+                                    memory_order_acquire);
+        if (wrs1 & 1)
+        {
+            sched_yield();
+            goto group;
+        }
+        for (uint32_t m = match(g, h2(h)); m; m &= m - 1)
+        {
+            int i = __builtin_ctz(m);
+            if (g->slot[i].key == key)
+            {
+                res = g->slot[i].value;
+                break;
+            }
+        }
+        more = !res && !match(g, EMPTY);
+        util_atomic_load_explicit64(&g->write_status, &wrs2,
+                                    memory_order_acquire);
+        if (wrs1 != wrs2)
+        {
+            res = 0;
+            goto group;
+        }
+        if (!more)
+            break;
+        gi = (gi + step) & t->mask;
+    }
+    util_atomic_load_explicit64(&c->rehashes, &rh2, memory_order_acquire);
+    if (rh1 + 2 <= rh2)
+        goto retry;
+    return res;
+}
+
+void* FUNC(find_le)(struct swiss *c, uint64_t key)
+{
+    fprintf(stderr, "Not implemented.\n");
+    abort();
+}
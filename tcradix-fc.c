@@ -0,0 +1,6 @@
+/*
+ * tcradix-fc.c -- tcradix with flat-combined writes
+ */
+#define TCRADIX_FC
+#define FUNC(x) tcradix_fc_##x
+#include "tcradix.c"
@@ -10,7 +10,9 @@
 #define SLICE 4
 #define SLNODES (1<<(SLICE))
 #define LEVELS ((63+SLICE)/SLICE)
-#define FUNC(x) tcradix_##x
+#ifndef FUNC
+# define FUNC(x) tcradix_##x
+#endif
 
 #ifdef DEBUG_SPAM
 # define dprintf(...) printf(__VA_ARGS__)
@@ -34,6 +36,27 @@ struct tcrnode
     uint64_t nchildren;
 };
 
+#ifdef TCRADIX_FC
+/*
+ * Flat combining (tcradix-fc.c): a write posts itself in a slot, whoever
+ * holds the mutex does all posted ones between a single pair of
+ * write_status bumps -- readers retry once per batch rather than once per
+ * write, and the lock's cacheline moves once.
+ */
+# define FC_SLOTS 32
+enum { FC_FREE, FC_BUSY, FC_POSTED, FC_DONE };
+enum { FC_INSERT, FC_REMOVE };
+
+struct fc_slot
+{
+    uint64_t state;
+    int op;
+    int ret;
+    uint64_t key;
+    void *value; /* in for insert, out for remove */
+} __attribute__((aligned(64)));
+#endif
+
 struct tcrhead
 {
     struct tcrnode root;
@@ -41,6 +64,9 @@ struct tcrhead
     uint64_t pad[4]; // TODO: is avoiding cacheline dirtying worth it?
     pthread_mutex_t mutex;
     struct tcrnode *deleted_node;
+#ifdef TCRADIX_FC
+    struct fc_slot fc[FC_SLOTS];
+#endif
 };
 
 #define TOP_EMPTY 0xffffffffffffffff
@@ -212,6 +238,19 @@ static int insert(struct tcrhead *restrict c, struct tcrnode *restrict n,
     return insert_child(c, n, lev, key, value);
 }
 
+/* with the mutex held and write_status odd */
+static int insert_top(struct tcrhead *restrict n, uint64_t key, void *value)
+{
+    if (n->root.only_key == TOP_EMPTY && !n->root.nchildren)
+    {
+        n->root.only_val = value;
+        n->root.only_key = key;
+    }
+
+    return insert(n, &n->root, LEVELS-1, key, value);
+}
+
+#ifndef TCRADIX_FC
 int FUNC(insert)(struct tcrhead *restrict n, uint64_t key, void *value)
 {
     dprintf("insert(%016lx)\n", key);
@@ -222,13 +261,7 @@ int FUNC(insert)(struct tcrhead *restrict n, uint64_t key, void *value)
 
     pthread_mutex_lock(&n->mutex);
     write_poke(n);
-    if (n->root.only_key == TOP_EMPTY && !n->root.nchildren)
-    {
-        n->root.only_val = value;
-        n->root.only_key = key;
-    }
-
-    int ret = insert(n, &n->root, LEVELS-1, key, value);
+    int ret = insert_top(n, key, value);
     write_poke(n);
     pthread_mutex_unlock(&n->mutex);
     if (ret)
@@ -237,6 +270,7 @@ int FUNC(insert)(struct tcrhead *restrict n, uint64_t key, void *value)
     //display(&n->root, LEVELS-1);
     return 0;
 }
+#endif
 
 /* return 1 if we removed last subtree, making n empty */
 static int nremove(struct tcrhead *restrict c, struct tcrnode *restrict n,
@@ -281,6 +315,7 @@ static int nremove(struct tcrhead *restrict c, struct tcrnode *restrict n,
     return !n->nchildren && !n->only_key;
 }
 
+#ifndef TCRADIX_FC
 void *FUNC(remove)(struct tcrhead *restrict n, uint64_t key)
 {
     dprintf("remove(%016lx)\n", key);
@@ -293,6 +328,107 @@ void *FUNC(remove)(struct tcrhead *restrict n, uint64_t key)
     //display(&n->root, LEVELS-1);
     return value;
 }
+#else
+static __thread unsigned fc_self = -1U;
+static unsigned fc_threads;
+
+/* take a free slot, starting from our own */
+static struct fc_slot *fc_claim(struct tcrhead *restrict n)
+{
+    if (fc_self == -1U)
+        fc_self = util_fetch_and_add32(&fc_threads, 1);
+
+    for (unsigned i = 0; ; i++)
+    {
+        struct fc_slot *f = &n->fc[(fc_self + i) % FC_SLOTS];
+        if (util_bool_compare_and_swap64(&f->state, FC_FREE, FC_BUSY))
+            return f;
+        if (i % FC_SLOTS == FC_SLOTS - 1)
+            sched_yield();
+    }
+}
+
+/* with the mutex held: do every posted write, in one write_status window */
+static void combine(struct tcrhead *restrict n)
+{
+    struct fc_slot *done[FC_SLOTS];
+    int nd = 0;
+
+    /* a thread only strays from its own slot once all are taken */
+    unsigned nslots = __atomic_load_n(&fc_threads, __ATOMIC_RELAXED);
+    if (nslots > FC_SLOTS)
+        nslots = FC_SLOTS;
+
+    write_poke(n);
+    for (unsigned i = 0; i < nslots; i++)
+    {
+        struct fc_slot *f = &n->fc[i];
+        uint64_t state;
+        util_atomic_load_explicit64(&f->state, &state, memory_order_acquire);
+        if (state != FC_POSTED)
+            continue;
+
+        if (f->op == FC_INSERT)
+            f->ret = insert_top(n, f->key, f->value);
+        else
+        {
+            f->value = 0;
+            nremove(n, &n->root, LEVELS-1, f->key, &f->value);
+        }
+        done[nd++] = f;
+    }
+    write_poke(n);
+
+    for (int i = 0; i < nd; i++)
+        util_atomic_store_explicit64(&done[i]->state, FC_DONE,
+                                     memory_order_release);
+}
+
+/* post a write, then combine or wait for whoever does */
+static struct fc_slot *fc_write(struct tcrhead *restrict n, int op,
+                                uint64_t key, void *value)
+{
+    struct fc_slot *f = fc_claim(n);
+    f->op = op;
+    f->key = key;
+    f->value = value;
+    util_atomic_store_explicit64(&f->state, FC_POSTED, memory_order_release);
+
+    uint64_t state;
+    while (util_atomic_load_explicit64(&f->state, &state,
+               memory_order_acquire), state != FC_DONE)
+    {
+        if (!pthread_mutex_trylock(&n->mutex))
+        {
+            combine(n);
+            pthread_mutex_unlock(&n->mutex);
+        }
+        else
+            sched_yield();
+    }
+    return f;
+}
+
+int FUNC(insert)(struct tcrhead *restrict n, uint64_t key, void *value)
+{
+    /* value of 0 is indistinguishable from "not existent" */
+    if (!value)
+        return 0;
+
+    struct fc_slot *f = fc_write(n, FC_INSERT, key, value);
+    int ret = f->ret;
+    util_atomic_store_explicit64(&f->state, FC_FREE, memory_order_release);
+    return ret;
+}
+
+void *FUNC(remove)(struct tcrhead *restrict n, uint64_t key)
+{
+    struct fc_slot *f = fc_write(n, FC_REMOVE, key, 0);
+    void *value = f->value;
+    util_atomic_store_explicit64(&f->state, FC_FREE, memory_order_release);
+    return value;
+}
+#endif
 
 #ifdef TRACEMEM
 # define INCDEPTHS util_fetch_and_add64(&depths, 1)
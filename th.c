@@ -2,6 +2,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <malloc.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/syscall.h>
 #include "hmproto.h"
@@ -265,6 +267,8 @@ static void run_test(int spreload, int rpreload, thread_func_t rthread, thread_f
     else
         for (int i=spreload; i<rpreload; i++)
             hm_insert(c, the1000[i], (void*)the1000[i]);
+    if (hm_freeze && !wthread)
+        CHECK(!hm_freeze(c));
 
     pthread_t th[nthreads], wr[nwthreads];
     int ntr=wthread?nrthreads:nthreads;
@@ -298,10 +302,176 @@ static void run_test(int spreload, int rpreload, thread_func_t rthread, thread_f
     hm_delete(c);
 }
 
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static size_t mem_used()
+{
+    struct mallinfo2 mi = mallinfo2();
+    return mi.uordblks + mi.hblkhd;
+}
+
+// Single thread filling a map: inserts per second, the worst single insert
+// (ie, a rehash or other stop-the-writers pause) in µs, and bytes per key
+// as seen by malloc -- leaks included.
+static void run_grow(int n)
+{
+    unsigned short xsubi[3];
+    randomize(xsubi);
+
+    size_t mem0 = mem_used();
+    void *c = hm_new();
+    uint64_t worst=0, start=now_ns();
+    for (int i=0; i<n; i++)
+    {
+        uint64_t v=rnd_r64(xsubi);
+        uint64_t t0=now_ns();
+        hm_insert(c, v, (void*)v);
+        uint64_t t=now_ns()-t0;
+        if (t > worst)
+            worst = t;
+        CHECK(hm_get(c, v) == (void*)v);
+    }
+    uint64_t total=now_ns()-start;
+    size_t mem = mem_used()-mem0;
+
+    printf("\e[F\e[25C%15lu %12luµs %9.1fB/key\n", (uint64_t)n*1000000000/total,
+        worst/1000, (double)mem/n);
+    hm_delete(c);
+}
+
+// Single thread bulk-loading a map then freezing it (if the engine can),
+// then getting every key back in random order: gets per second, and bytes
+// per key of what's left once frozen.
+static void run_bulk(int n)
+{
+    unsigned short xsubi[3];
+    randomize(xsubi);
+    uint64_t *keys = malloc(n * sizeof(uint64_t));
+    for (int i=0; i<n; i++)
+        keys[i]=rnd_r64(xsubi);
+
+    size_t mem0 = mem_used();
+    void *c = hm_new();
+    for (int i=0; i<n; i++)
+        hm_insert(c, keys[i], (void*)keys[i]);
+    if (hm_freeze)
+        CHECK(!hm_freeze(c));
+    size_t mem = mem_used()-mem0;
+
+    uint64_t start=now_ns();
+    for (int i=0; i<n; i++)
+        CHECK(hm_get(c, keys[i]) == (void*)keys[i]);
+    uint64_t total=now_ns()-start;
+
+    printf("\e[F\e[25C%15lu %9.1fB/key\n", (uint64_t)n*1000000000/total,
+        (double)mem/n);
+    hm_delete(c);
+    free(keys);
+}
+
+static uint64_t ins_per_thread;
+
+static void* thread_insert(void* c)
+{
+    unsigned short xsubi[3];
+    randomize(xsubi);
+    for (uint64_t i=0; i<ins_per_thread; i++)
+    {
+        uint64_t v=rnd_r64(xsubi);
+        CHECK(!hm_insert(c, v, (void*)v));
+    }
+    return 0;
+}
+
+// nthreads threads filling a map together: inserts per second.
+static void run_insert(int n)
+{
+    void *c = hm_new();
+    pthread_t th[nthreads];
+    ins_per_thread = n/nthreads;
+
+    uint64_t start=now_ns();
+    for (int i=0; i<nthreads; i++)
+        CHECK(!pthread_create(&th[i], 0, thread_insert, c));
+    for (int i=0; i<nthreads; i++)
+        CHECK(!pthread_join(th[i], 0));
+    uint64_t total=now_ns()-start;
+
+    printf("\e[F\e[25C%15lu\n", ins_per_thread*nthreads*1000000000/total);
+    hm_delete(c);
+}
+
+// A bulk insert (hm_insert_bulk) spread over nthreads threads: inserts per
+// second.
+static void run_insert_bulk(int n)
+{
+    unsigned short xsubi[3];
+    randomize(xsubi);
+    uint64_t *keys = malloc(n * sizeof(uint64_t));
+    for (int i=0; i<n; i++)
+        keys[i]=rnd_r64(xsubi);
+
+    void *c = hm_new();
+    uint64_t start=now_ns();
+    CHECK(hm_insert_bulk(c, keys, (void *const *)keys, n, nthreads) == n);
+    uint64_t total=now_ns()-start;
+
+    printf("\e[F\e[25C%15lu\n", (uint64_t)n*1000000000/total);
+    hm_delete(c);
+    free(keys);
+}
+
+static void* thread_insert_async(void* c)
+{
+    unsigned short xsubi[3];
+    randomize(xsubi);
+    for (uint64_t i=0; i<ins_per_thread; i++)
+    {
+        uint64_t v=rnd_r64(xsubi);
+        hm_insert_async(c, v, (void*)v);
+    }
+    return 0;
+}
+
+// nthreads threads queueing inserts (hm_insert_async), then one hm_flush:
+// inserts per second, counting until the last one is applied.
+static void run_insert_async(int n)
+{
+    void *c = hm_new();
+    pthread_t th[nthreads];
+    ins_per_thread = n/nthreads;
+
+    uint64_t start=now_ns();
+    for (int i=0; i<nthreads; i++)
+        CHECK(!pthread_create(&th[i], 0, thread_insert_async, c));
+    for (int i=0; i<nthreads; i++)
+        CHECK(!pthread_join(th[i], 0));
+    hm_flush(c);
+    uint64_t total=now_ns()-start;
+
+    printf("\e[F\e[25C%15lu\n", ins_per_thread*nthreads*1000000000/total);
+    hm_delete(c);
+}
+
+enum test_kind
+{
+    TEST_THREADS,       // readers and writers for a second: run_test
+    TEST_GROW,          // run_grow
+    TEST_INSERT,        // run_insert
+    TEST_BULK,          // run_bulk
+    TEST_INSERT_BULK,   // run_insert_bulk, if the engine has hm_insert_bulk
+    TEST_INSERT_ASYNC,  // run_insert_async, if it has hm_insert_async
+};
+
 static int only_hm = -1;
 
-static void test(const char *name, int spreload, int rpreload,
-    thread_func_t rthread, thread_func_t wthread, int req)
+static void test(const char *name, enum test_kind kind, int spreload,
+    int rpreload, thread_func_t rthread, thread_func_t wthread, int req)
 {
     printf("TEST: %s\n", name);
 
@@ -310,7 +480,11 @@ static void test(const char *name, int spreload, int rpreload,
     for (int i=hmin; i<=hmax; i++)
     {
         hm_select(i);
-        if ((wthread && (hm_immutable&1)) || hm_immutable&req)
+        int writes = (kind==TEST_THREADS) ? !!wthread : kind!=TEST_BULK;
+        if ((writes && (hm_immutable&1))
+            || hm_immutable&req
+            || (kind==TEST_INSERT_BULK && !hm_insert_bulk)
+            || (kind==TEST_INSERT_ASYNC && !hm_insert_async))
         {
             printf(" \e[35m[\e[1m!\e[22m]\e[0m: %s\n", hm_name);
             continue;
@@ -318,7 +492,26 @@ static void test(const char *name, int spreload, int rpreload,
 
         printf(" \e[34m[\e[1m⚒\e[22m]\e[0m: %s\e[0m\n", hm_name);
         bad=0;
-        run_test(spreload, rpreload, rthread, ((intptr_t)wthread==-1)?0:wthread);
+        switch (kind)
+        {
+        case TEST_GROW:
+            run_grow(rpreload);
+            break;
+        case TEST_INSERT:
+            run_insert(rpreload);
+            break;
+        case TEST_BULK:
+            run_bulk(rpreload);
+            break;
+        case TEST_INSERT_BULK:
+            run_insert_bulk(rpreload);
+            break;
+        case TEST_INSERT_ASYNC:
+            run_insert_async(rpreload);
+            break;
+        default:
+            run_test(spreload, rpreload, rthread, ((intptr_t)wthread==-1)?0:wthread);
+        }
         if (!bad)
             printf("\e[F \e[32m[\e[1m✓\e[22m]\e[0m\n");
         else
@@ -359,19 +552,36 @@ int main(int argc, char **argv)
         nrthreads = 1;
     printf("Using %lu threads; %lu readers %lu writers in mixed tests.\n",
         nthreads, nrthreads, nwthreads);
-    test("read 1-of-1", 1, 0, thread_read1, 0, 0);
-    test("read 1-of-2", 2, 0, thread_read1, 0, 0);
-    test("read 1-of-1000", 1, 1000, thread_read1, 0, 0);
-    test("read 1000-of-1000", 0, 1000, thread_read1000, 0, 0);
-    test("read 1-of-1000 pointers", 0, -1000, thread_read1p, 0, 0);
-    test("read 1 write 1000", 1, 0, thread_read1, thread_write1000, 0);
-    test("read 1000 write 1000", 0, 1000, thread_read1000, thread_write1000, 0);
-    test("read-write-remove", 0, 0, thread_read_write_remove, (thread_func_t)-1, 0);
-    test("read 1-of-1 cachekiller", 1, 0, thread_read1_cachekiller, 0, 0);
-    test("read 1-of-1000 cachekiller", 1, 1000, thread_read1_cachekiller, 0, 0);
-    test("read 1000 write 1000 cachekiller", 0, 1000, thread_read1000_cachekiller, thread_write1000_cachekiller, 0);
-    test("le 1 van der Corput", 1, 0, thread_le1, 0, 2);
-    test("le 1000 van der Corput", 0, 1000, thread_le1000, 0, 2);
+    test("read 1-of-1", TEST_THREADS, 1, 0, thread_read1, 0, 0);
+    test("read 1-of-2", TEST_THREADS, 2, 0, thread_read1, 0, 0);
+    test("read 1-of-1000", TEST_THREADS, 1, 1000, thread_read1, 0, 0);
+    test("read 1000-of-1000", TEST_THREADS, 0, 1000, thread_read1000, 0, 0);
+    test("read 1-of-1000 pointers", TEST_THREADS, 0, -1000, thread_read1p, 0, 0);
+    test("read 1 write 1000", TEST_THREADS, 1, 0, thread_read1, thread_write1000, 0);
+    test("read 1000 write 1000", TEST_THREADS, 0, 1000, thread_read1000, thread_write1000, 0);
+    test("read-write-remove", TEST_THREADS, 0, 0, thread_read_write_remove, (thread_func_t)-1, 0);
+    test("read 1-of-1 cachekiller", TEST_THREADS, 1, 0, thread_read1_cachekiller, 0, 0);
+    test("read 1-of-1000 cachekiller", TEST_THREADS, 1, 1000, thread_read1_cachekiller, 0, 0);
+    test("read 1000 write 1000 cachekiller", TEST_THREADS, 0, 1000, thread_read1000_cachekiller, thread_write1000_cachekiller, 0);
+    test("insert 2M pauses", TEST_GROW, 0, 2097152, 0, 0, 4);
+    test("read 2M bulk loaded", TEST_BULK, 0, 2097152, 0, 0, 4);
+    uint64_t nt=nthreads;
+    for (nthreads=1; ; nthreads*=2)
+    {
+        if (nthreads > nt)
+            nthreads = nt;
+        char name[64];
+        sprintf(name, "insert 2M, %lu threads", nthreads);
+        test(name, TEST_INSERT, 0, 2097152, 0, 0, 4);
+        sprintf(name, "insert 2M bulk, %lu threads", nthreads);
+        test(name, TEST_INSERT_BULK, 0, 2097152, 0, 0, 4);
+        sprintf(name, "insert 2M queued, %lu threads", nthreads);
+        test(name, TEST_INSERT_ASYNC, 0, 2097152, 0, 0, 4);
+        if (nthreads == nt)
+            break;
+    }
+    test("le 1 van der Corput", TEST_THREADS, 1, 0, thread_le1, 0, 2);
+    test("le 1000 van der Corput", TEST_THREADS, 0, 1000, thread_le1000, 0, 2);
 
     for (int i=0; i<ARRAYSZ(the1000p); i++)
         free(the1000p[i]);
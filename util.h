@@ -153,6 +153,21 @@ util_clrbit(uint8_t *b, uint32_t i)
 	b[i / 8] = (uint8_t)(b[i / 8] & (uint8_t)(~(1 << (i % 8))));
 }
 
+/*
+ * util_hash64 -- murmur3's 64-bit finalizer: a permutation, every bit of
+ * the key affecting every bit of the result
+ */
+static inline uint64_t
+util_hash64(uint64_t key)
+{
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	key *= 0xc4ceb9fe1a85ec53ULL;
+	key ^= key >> 33;
+	return key;
+}
+
 #define util_isset(a, i) isset(a, i)
 #define util_isclr(a, i) isclr(a, i)
 
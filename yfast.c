@@ -0,0 +1,661 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "util.h"
+
+/*
+ * y-fast trie (Willard): keys live in sorted runs of up to BUCKET entries,
+ * each run owning the key range from its representative (rep) up to the
+ * next run's.  The reps form an x-fast trie: every prefix of every rep is
+ * in a hash, together with the smallest and largest rep under it.  A
+ * binary search over prefix lengths (at most 6 probes for 64 bits) finds
+ * the longest prefix the key shares with any rep; the key branches off
+ * below it, thus its run is either the largest rep there or the one
+ * before the smallest.  That's O(log log U) to reach the run, plus a binary search
+ * within -- find_le never backtracks.
+ *
+ * The first run has rep 0 and never goes away, thus every key has a run.
+ * A full run is split in halves, an empty one (or small enough to fit in
+ * its predecessor) gets merged into the one before.  Only splits and
+ * merges touch the x-fast hash; a rep's prefixes are kept only down to
+ * where it parts with its neighbours, ~log2 of the run count rather than
+ * 64 of them.
+ *
+ * Writes take a mutex.  A run's entries are copied on write, the run
+ * itself stays, so only a split or merge relinks anything.  Readers are
+ * lock-free the critnib way (everything unlinked waits DELETED_LIFE
+ * further unlinks, readers that saw that many restart).  The hash is but
+ * a hint: a reader walks the list of runs to the right one, so a torn or
+ * stale slot only costs a few steps.
+ */
+
+#define FUNC(x) yfast_##x
+
+#define DELETED_LIFE 16
+#define BUCKET 64
+/* walking back past this many runs means the hint was bad */
+#define MAX_WALK 16
+#define MIN_SLOTS 64
+
+struct yf_kv
+{
+    uint64_t key;
+    void *value;
+};
+
+struct yf_bucket
+{
+    uint64_t count;
+    struct yf_kv e[BUCKET];
+};
+
+struct yf_run
+{
+    uint64_t rep;
+    struct yf_bucket *b;
+    struct yf_run *next;
+    struct yf_run *prev;
+};
+
+/* a prefix: its length and bits, and the extreme reps below */
+struct yf_slot
+{
+    uint64_t code; /* 0: never used */
+    struct yf_run *min; /* 0: removed */
+    struct yf_run *max;
+};
+
+struct yf_table
+{
+    uint64_t mask;
+    uint64_t used; /* removed slots included */
+    uint64_t live;
+    struct yf_slot s[];
+};
+
+struct yfast
+{
+    struct yf_run *head;
+    struct yf_table *table;
+    uint64_t depth; /* no prefix goes deeper */
+    struct yf_bucket *deleted_bucket;
+    struct yf_run *deleted_run;
+    struct yf_table *deleted_table[64];
+    struct yf_bucket *pending_del_buckets[DELETED_LIFE];
+    struct yf_run *pending_del_runs[DELETED_LIFE];
+    struct yf_table *pending_del_tables[DELETED_LIFE];
+    uint64_t remove_count;
+    pthread_mutex_t mutex;
+};
+
+static inline void *load(void *src)
+{
+    return __atomic_load_n((void**)src, __ATOMIC_ACQUIRE);
+}
+
+static inline void store(void *dst, void *v)
+{
+    __atomic_store_n((void**)dst, v, __ATOMIC_RELEASE);
+}
+
+/*
+ * The key's top l bits (l < 64) and a 1 right below, which tells the
+ * length apart -- never 0.
+ */
+static inline uint64_t code(uint64_t key, int l)
+{
+    return (key >> (63 - l) | 1) << (63 - l);
+}
+
+/* the slot with the given code, or where it'd go */
+static struct yf_slot *probe(struct yf_table *t, uint64_t code)
+{
+    for (uint64_t i = util_hash64(code);; i++)
+    {
+        struct yf_slot *s = &t->s[i & t->mask];
+        uint64_t sc = __atomic_load_n(&s->code, __ATOMIC_ACQUIRE);
+        if (!sc || sc == code)
+            return s;
+    }
+}
+
+/**************/
+/* allocation */
+/**************/
+
+static struct yf_bucket *alloc_bucket(struct yfast *c)
+{
+    struct yf_bucket *b = c->deleted_bucket;
+    if (!b)
+        return Malloc(sizeof(struct yf_bucket));
+    c->deleted_bucket = b->e[0].value;
+    return b;
+}
+
+static void free_bucket(struct yfast *c, struct yf_bucket *b)
+{
+    if (!b)
+        return;
+    /* not over count: a stale reader would search past the end */
+    b->e[0].value = c->deleted_bucket;
+    c->deleted_bucket = b;
+}
+
+static struct yf_run *alloc_run(struct yfast *c)
+{
+    struct yf_run *r = c->deleted_run;
+    if (!r)
+        return Malloc(sizeof(struct yf_run));
+    c->deleted_run = r->next;
+    return r;
+}
+
+static void free_run(struct yfast *c, struct yf_run *r)
+{
+    if (!r)
+        return;
+    r->next = c->deleted_run;
+    c->deleted_run = r;
+}
+
+static inline size_t table_size(uint64_t slots)
+{
+    return sizeof(struct yf_table) + slots * sizeof(struct yf_slot);
+}
+
+/* tables are pooled too: a freed one might get unmapped under a reader */
+static struct yf_table *alloc_table(struct yfast *c, uint64_t slots)
+{
+    int lg = __builtin_ctzll(slots);
+    struct yf_table *t = c->deleted_table[lg];
+    if (t)
+    {
+        c->deleted_table[lg] = (void*)t->used;
+        memset(t, 0, table_size(slots));
+    }
+    else if (!(t = Zalloc(table_size(slots))))
+        return 0;
+    t->mask = slots - 1;
+    return t;
+}
+
+static void free_table(struct yfast *c, struct yf_table *t)
+{
+    if (!t)
+        return;
+    int lg = __builtin_ctzll(t->mask + 1);
+    t->used = (uint64_t)c->deleted_table[lg];
+    c->deleted_table[lg] = t;
+}
+
+/*
+ * b is a run's superseded entries, r a run merged away, t an x-fast table
+ * that got rehashed (any may be NULL); they displace the oldest ring slot.
+ */
+static void retire(struct yfast *c, struct yf_bucket *b, struct yf_run *r,
+    struct yf_table *t)
+{
+    uint64_t del = util_fetch_and_add64(&c->remove_count, 1) % DELETED_LIFE;
+    free_bucket(c, c->pending_del_buckets[del]);
+    free_run(c, c->pending_del_runs[del]);
+    free_table(c, c->pending_del_tables[del]);
+    c->pending_del_buckets[del] = b;
+    c->pending_del_runs[del] = r;
+    c->pending_del_tables[del] = t;
+}
+
+struct yfast *FUNC(new)(void)
+{
+    struct yfast *c = Zalloc(sizeof(struct yfast));
+    if (!c)
+        return 0;
+    if (!(c->head = Zalloc(sizeof(struct yf_run))))
+        goto fail;
+    if (!(c->head->b = Zalloc(sizeof(struct yf_bucket))))
+        goto fail;
+    if (!(c->table = alloc_table(c, MIN_SLOTS)))
+        goto fail;
+
+    struct yf_slot *s = probe(c->table, code(0, 0));
+    s->code = code(0, 0);
+    s->min = s->max = c->head;
+    c->table->used = c->table->live = 1;
+
+    pthread_mutex_init(&c->mutex, 0);
+    return c;
+
+fail:
+    if (c->head)
+        Free(c->head->b);
+    Free(c->head);
+    Free(c);
+    return 0;
+}
+
+void FUNC(delete)(struct yfast *c)
+{
+    for (struct yf_run *r = c->head, *rr; r; r = rr)
+    {
+        rr = r->next;
+        Free(r->b);
+        Free(r);
+    }
+    for (struct yf_bucket *b = c->deleted_bucket, *bb; b; b = bb)
+    {
+        bb = b->e[0].value;
+        Free(b);
+    }
+    for (struct yf_run *r = c->deleted_run, *rr; r; r = rr)
+    {
+        rr = r->next;
+        Free(r);
+    }
+    for (int i=0; i<64; i++)
+        for (struct yf_table *t = c->deleted_table[i], *tt; t; t = tt)
+        {
+            tt = (void*)t->used;
+            Free(t);
+        }
+    for (int i=0; i<DELETED_LIFE; i++)
+    {
+        Free(c->pending_del_buckets[i]);
+        Free(c->pending_del_runs[i]);
+        Free(c->pending_del_tables[i]);
+    }
+    Free(c->table);
+    pthread_mutex_destroy(&c->mutex);
+    Free(c);
+}
+
+/**********/
+/* x-fast */
+/**********/
+
+/* longest common prefix */
+static inline int lcp(uint64_t a, uint64_t b)
+{
+    return a == b ? 64 : __builtin_clzll(a ^ b);
+}
+
+/*
+ * Makes room for another rep's prefixes and its neighbours': rehashes into
+ * a fresh table if those could push the load past 3/4.  The old one stays
+ * for readers.
+ */
+static int reserve(struct yfast *c)
+{
+    struct yf_table *t = c->table;
+    if ((t->used + 3 * 64) * 4 <= (t->mask + 1) * 3)
+        return 0;
+
+    uint64_t slots = MIN_SLOTS;
+    while (slots < (t->live + 3 * 64) * 2)
+        slots *= 2;
+    struct yf_table *nt = alloc_table(c, slots);
+    if (!nt)
+        return ENOMEM;
+    for (uint64_t i = 0; i <= t->mask; i++)
+        if (t->s[i].min)
+            *probe(nt, t->s[i].code) = t->s[i];
+    nt->used = nt->live = t->live;
+
+    store(&c->table, nt);
+    retire(c, 0, 0, t);
+    return 0;
+}
+
+/* r is under r's prefixes up to the given length */
+static void xfast_add(struct yfast *c, struct yf_run *r, int depth)
+{
+    struct yf_table *t = c->table;
+    if (c->depth < (uint64_t)depth)
+        __atomic_store_n(&c->depth, depth, __ATOMIC_RELEASE);
+    for (int l = 0; l <= depth; l++)
+    {
+        uint64_t sc = code(r->rep, l);
+        struct yf_slot *s = probe(t, sc);
+        if (!s->min)
+        {
+            if (!s->code)
+                t->used++;
+            t->live++;
+            store(&s->max, r);
+            store(&s->min, r);
+            __atomic_store_n(&s->code, sc, __ATOMIC_RELEASE);
+            continue;
+        }
+        if (r->rep < s->min->rep)
+            store(&s->min, r);
+        if (r->rep > s->max->rep)
+            store(&s->max, r);
+    }
+}
+
+/*
+ * r's rep is new.  Its prefixes go only as deep as it takes to tell it
+ * from its neighbours: below that r would be alone, and a lookup that
+ * stops at a node with a single rep still gets the right answer.  The
+ * neighbours' own chains may have been cut short of where r branches off,
+ * so they get deepened first -- a node must never miss a rep below it.
+ */
+static void xfast_link(struct yfast *c, struct yf_run *r)
+{
+    int lp = r->prev ? lcp(r->rep, r->prev->rep) : 0;
+    int ln = r->next ? lcp(r->rep, r->next->rep) : 0;
+    if (r->prev)
+        xfast_add(c, r->prev, lp < 63 ? lp + 1 : 63);
+    if (r->next)
+        xfast_add(c, r->next, ln < 63 ? ln + 1 : 63);
+    int depth = lp > ln ? lp : ln;
+    xfast_add(c, r, depth < 63 ? depth + 1 : 63);
+}
+
+/* r is unlinked already, with prev and next still telling its neighbours */
+static void xfast_del(struct yfast *c, struct yf_run *r)
+{
+    struct yf_table *t = c->table;
+    for (int l = 0; l < 64; l++)
+    {
+        struct yf_slot *s = probe(t, code(r->rep, l));
+        if (!s->min)
+            break;
+        if (s->min == r && s->max == r)
+        {
+            store(&s->min, 0);
+            t->live--;
+        }
+        else if (s->min == r)
+            store(&s->min, r->next);
+        else if (s->max == r)
+            store(&s->max, r->prev);
+    }
+}
+
+/***********/
+/* readers */
+/***********/
+
+/*
+ * A run whose rep is <= the key, usually the last such; the caller walks
+ * forward from there.
+ */
+static struct yf_run *locate(struct yfast *c, uint64_t key)
+{
+    struct yf_table *t = load(&c->table);
+    struct yf_slot *p = probe(t, code(key, 0));
+
+    int lo = 0, hi = __atomic_load_n(&c->depth, __ATOMIC_ACQUIRE) + 1;
+    while (hi - lo > 1)
+    {
+        int mid = (lo + hi) / 2;
+        struct yf_slot *s = probe(t, code(key, mid));
+        int found = !!load(&s->min);
+        p = found ? s : p;
+        lo = found ? mid : lo;
+        hi = found ? hi : mid;
+    }
+
+    /*
+     * The key leaves p's subtree at bit 63-lo: if to the right, every rep
+     * there is smaller, else every one is bigger.
+     */
+    struct yf_run *mn = load(&p->min), *mx = load(&p->max), *r;
+    if (!mn || !mx)
+        return c->head; /* stale */
+    if (mx->rep <= key)
+        r = mx;
+    else if (mn->rep <= key)
+        r = mn;
+    else
+        r = load(&mn->prev);
+
+    for (int i = 0; r && i < MAX_WALK; i++)
+    {
+        if (r->rep <= key)
+            return r;
+        r = load(&r->prev);
+    }
+    return c->head;
+}
+
+/*
+ * The key's run and its entries.  The entries are loaded before the next
+ * link: a split publishes the new run before shrinking the old one.
+ */
+static struct yf_run *find_run(struct yfast *c, uint64_t key,
+    struct yf_bucket **bp)
+{
+    struct yf_run *r = locate(c, key), *nx;
+    struct yf_bucket *b;
+    for (;;)
+    {
+        b = load(&r->b);
+        nx = load(&r->next);
+        /* a recycled run may lead anywhere, but not in circles */
+        if (!nx || nx->rep > key || nx->rep <= r->rep)
+            break;
+        r = nx;
+    }
+    *bp = b;
+    return r;
+}
+
+/* index of the largest key <= the given one, -1 if none */
+static int search(const struct yf_bucket *b, uint64_t key)
+{
+    int base = 0, n = b->count;
+    while (n > 1)
+    {
+        int half = n / 2;
+        base = (b->e[base + half].key <= key) ? base + half : base;
+        n -= half;
+    }
+    return (n && b->e[base].key <= key) ? base : -1;
+}
+
+/*
+ * yfast_get -- query for a key
+ *
+ * A torn or stale hash slot only makes it walk further along the runs;
+ * what sends it back to the top is remove_count moving by DELETED_LIFE.
+ */
+void *FUNC(get)(struct yfast *c, uint64_t key)
+{
+    uint64_t wrs1, wrs2;
+    void *res;
+
+    do
+    {
+        struct yf_bucket *b;
+        wrs1 = __atomic_load_n(&c->remove_count, __ATOMIC_ACQUIRE);
+        find_run(c, key, &b);
+        int i = search(b, key);
+        res = (i >= 0 && b->e[i].key == key) ? b->e[i].value : 0;
+        wrs2 = __atomic_load_n(&c->remove_count, __ATOMIC_ACQUIRE);
+    } while (wrs1 + DELETED_LIFE <= wrs2);
+
+    return res;
+}
+
+/*
+ * yfast_find_le -- the value of the largest key <= the given one
+ *
+ * If the key's run has nothing that small, the answer is the last entry of
+ * the run before (only the head may be empty for long).
+ */
+void *FUNC(find_le)(struct yfast *c, uint64_t key)
+{
+    uint64_t wrs1, wrs2;
+    void *res;
+
+    do
+    {
+        struct yf_bucket *b;
+        wrs1 = __atomic_load_n(&c->remove_count, __ATOMIC_ACQUIRE);
+        struct yf_run *r = find_run(c, key, &b);
+        int i = search(b, key);
+        res = 0;
+        if (i >= 0)
+            res = b->e[i].value;
+        else
+            for (struct yf_run *p; (p = load(&r->prev)) && p->rep < r->rep;)
+            {
+                r = p;
+                b = load(&r->b);
+                if (b->count)
+                {
+                    res = b->e[b->count - 1].value;
+                    break;
+                }
+            }
+        wrs2 = __atomic_load_n(&c->remove_count, __ATOMIC_ACQUIRE);
+    } while (wrs1 + DELETED_LIFE <= wrs2);
+
+    return res;
+}
+
+/***********/
+/* writers */
+/***********/
+
+/* a full run gets split in two, the key going to whichever half */
+static int split(struct yfast *c, struct yf_run *r, int pos, uint64_t key,
+    void *value)
+{
+    struct yf_kv e[BUCKET + 1];
+    struct yf_bucket *b = r->b;
+    memcpy(e, b->e, pos * sizeof(struct yf_kv));
+    e[pos].key = key;
+    e[pos].value = value;
+    memcpy(&e[pos + 1], &b->e[pos], (BUCKET - pos) * sizeof(struct yf_kv));
+
+    if (reserve(c))
+        return ENOMEM;
+    struct yf_bucket *lo = alloc_bucket(c);
+    struct yf_bucket *hi = alloc_bucket(c);
+    struct yf_run *nr = alloc_run(c);
+    if (!lo || !hi || !nr)
+    {
+        free_bucket(c, lo);
+        free_bucket(c, hi);
+        free_run(c, nr);
+        return ENOMEM;
+    }
+
+    int half = (BUCKET + 1) / 2;
+    lo->count = half;
+    memcpy(lo->e, e, half * sizeof(struct yf_kv));
+    hi->count = BUCKET + 1 - half;
+    memcpy(hi->e, &e[half], hi->count * sizeof(struct yf_kv));
+    nr->rep = hi->e[0].key;
+    nr->b = hi;
+    nr->next = r->next;
+    nr->prev = r;
+
+    /* till r shrinks, both have the upper half */
+    store(&r->next, nr);
+    store(&r->b, lo);
+    if (nr->next)
+        store(&nr->next->prev, nr);
+    xfast_link(c, nr);
+    retire(c, b, 0, 0);
+    return 0;
+}
+
+int FUNC(insert)(struct yfast *c, uint64_t key, void *value)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&c->mutex);
+
+    struct yf_bucket *b;
+    struct yf_run *r = find_run(c, key, &b);
+    int pos = search(b, key) + 1;
+    if (pos && b->e[pos - 1].key == key)
+    {
+        ret = EEXIST;
+        goto out;
+    }
+
+    if (b->count == BUCKET)
+    {
+        ret = split(c, r, pos, key, value);
+        goto out;
+    }
+
+    struct yf_bucket *nb = alloc_bucket(c);
+    if (!nb)
+    {
+        ret = ENOMEM;
+        goto out;
+    }
+    nb->count = b->count + 1;
+    memcpy(nb->e, b->e, pos * sizeof(struct yf_kv));
+    nb->e[pos].key = key;
+    nb->e[pos].value = value;
+    memcpy(&nb->e[pos + 1], &b->e[pos],
+        (b->count - pos) * sizeof(struct yf_kv));
+    store(&r->b, nb);
+    retire(c, b, 0, 0);
+
+out:
+    pthread_mutex_unlock(&c->mutex);
+    return ret;
+}
+
+/*
+ * Copies the run's entries without the key; if that copy can't be
+ * allocated, returns NULL with the key still in.
+ */
+void *FUNC(remove)(struct yfast *c, uint64_t key)
+{
+    void *value = 0;
+
+    pthread_mutex_lock(&c->mutex);
+
+    struct yf_bucket *b;
+    struct yf_run *r = find_run(c, key, &b);
+    int i = search(b, key);
+    if (i < 0 || b->e[i].key != key)
+        goto out;
+
+    struct yf_run *p = r->prev;
+    uint64_t pc = p ? p->b->count : 0;
+    struct yf_bucket *nb = alloc_bucket(c);
+    if (!nb)
+        goto out;
+    value = b->e[i].value;
+
+    if (p && (b->count == 1 || pc + b->count - 1 <= BUCKET / 2))
+    {
+        /*
+         * Merge into the run before: it gets r's entries first, then r
+         * is unlinked -- a reader that still gets there finds them too.
+         */
+        struct yf_bucket *pb = p->b;
+        memcpy(nb->e, pb->e, pc * sizeof(struct yf_kv));
+        memcpy(&nb->e[pc], b->e, i * sizeof(struct yf_kv));
+        memcpy(&nb->e[pc + i], &b->e[i + 1],
+            (b->count - i - 1) * sizeof(struct yf_kv));
+        nb->count = pc + b->count - 1;
+        store(&p->b, nb);
+        store(&p->next, r->next);
+        if (r->next)
+            store(&r->next->prev, p);
+        xfast_del(c, r);
+        retire(c, pb, 0, 0);
+        retire(c, b, r, 0);
+        goto out;
+    }
+
+    nb->count = b->count - 1;
+    memcpy(nb->e, b->e, i * sizeof(struct yf_kv));
+    memcpy(&nb->e[i], &b->e[i + 1], (b->count - i - 1) * sizeof(struct yf_kv));
+    store(&r->b, nb);
+    retire(c, b, 0, 0);
+
+out:
+    pthread_mutex_unlock(&c->mutex);
+    return value;
+}